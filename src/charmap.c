@@ -0,0 +1,281 @@
+/*============================================================================
+
+  charmap.c
+
+  The ROM tables follow the character pattern tables in Hitachi's 
+  HD44780U datasheet. Only characters with an unambiguous Unicode 
+  equivalent are listed.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "charmap.h"
+
+// A00 puts the yen sign at 0x5C, and arrows at 0x7E and 0x7F, so its
+//  ASCII ends at 0x7D, with a gap
+#define CHARMAP_A00_ASCII_END 0x7D
+#define CHARMAP_A00_YEN 0x5C
+
+// A00 has the half-width katakana block, in Unicode order, at 0xA1-0xDF
+#define CHARMAP_HALF_KANA 0xFF61
+#define CHARMAP_HALF_KANA_END 0xFF9F
+#define CHARMAP_A00_HALF_KANA 0xA1
+
+// The full-width katakana block
+#define CHARMAP_KANA 0x30A0
+#define CHARMAP_KANA_COUNT 0x60
+
+typedef struct _CharmapEntry
+  {
+  uint16_t cp;
+  BYTE code;
+  } CharmapEntry;
+
+typedef struct _CharmapBitmap
+  {
+  uint16_t cp;
+  BYTE rows[8];
+  } CharmapBitmap;
+
+// A00 codes for each full-width katakana: the low byte is the half-width
+//  form, and the high byte, if not zero, the voiced or semi-voiced mark
+//  that follows it. Zero if A00 doesn't have the character.
+static const uint16_t charmap_a00_kana[CHARMAP_KANA_COUNT] =
+  {
+  0x0000, 0x00A7, 0x00B1, 0x00A8, 0x00B2, 0x00A9, 0x00B3, 0x00AA,
+  0x00B4, 0x00AB, 0x00B5, 0x00B6, 0xDEB6, 0x00B7, 0xDEB7, 0x00B8,
+  0xDEB8, 0x00B9, 0xDEB9, 0x00BA, 0xDEBA, 0x00BB, 0xDEBB, 0x00BC,
+  0xDEBC, 0x00BD, 0xDEBD, 0x00BE, 0xDEBE, 0x00BF, 0xDEBF, 0x00C0,
+  0xDEC0, 0x00C1, 0xDEC1, 0x00AF, 0x00C2, 0xDEC2, 0x00C3, 0xDEC3,
+  0x00C4, 0xDEC4, 0x00C5, 0x00C6, 0x00C7, 0x00C8, 0x00C9, 0x00CA,
+  0xDECA, 0xDFCA, 0x00CB, 0xDECB, 0xDFCB, 0x00CC, 0xDECC, 0xDFCC,
+  0x00CD, 0xDECD, 0xDFCD, 0x00CE, 0xDECE, 0xDFCE, 0x00CF, 0x00D0,
+  0x00D1, 0x00D2, 0x00D3, 0x00AC, 0x00D4, 0x00AD, 0x00D5, 0x00AE,
+  0x00D6, 0x00D7, 0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x0000, 0x00DC,
+  0x0000, 0x0000, 0x00A6, 0x00DD, 0xDEB3, 0x0000, 0x0000, 0x0000,
+  0x0000, 0x0000, 0x0000, 0x00A5, 0x00B0, 0x0000, 0x0000, 0x0000
+  };
+
+// The rest of A00, above ASCII, in code point order
+static const CharmapEntry charmap_a00[] =
+  {
+  { 0x00A2, 0xEC }, { 0x00A5, 0x5C }, { 0x00B0, 0xDF }, { 0x00B5, 0xE4 },
+  { 0x00DF, 0xE2 }, { 0x00E4, 0xE1 }, { 0x00F1, 0xEE }, { 0x00F6, 0xEF },
+  { 0x00F7, 0xFD }, { 0x00FC, 0xF5 }, { 0x03A3, 0xF6 }, { 0x03A9, 0xF4 },
+  { 0x03B1, 0xE0 }, { 0x03B2, 0xE2 }, { 0x03B5, 0xE3 }, { 0x03B8, 0xF2 },
+  { 0x03BC, 0xE4 }, { 0x03C0, 0xF7 }, { 0x03C1, 0xE6 }, { 0x03C3, 0xE5 },
+  { 0x2190, 0x7F }, { 0x2192, 0x7E }, { 0x221A, 0xE8 }, { 0x221E, 0xF3 },
+  { 0x2588, 0xFF }, { 0x3001, 0xA4 }, { 0x3002, 0xA1 }, { 0x300C, 0xA2 },
+  { 0x300D, 0xA3 }, { 0x309B, 0xDE }, { 0x309C, 0xDF }, { 0x4E07, 0xFB },
+  { 0x5186, 0xFC }, { 0x5343, 0xFA }
+  };
+
+// A02, apart from ASCII, and the Latin-1 characters it has in their 
+//  Latin-1 positions, in code point order
+static const CharmapEntry charmap_a02[] =
+  {
+  { 0x0192, 0xA8 }, { 0x0393, 0x92 }, { 0x0398, 0x99 }, { 0x03A3, 0x94 },
+  { 0x03A9, 0x9A }, { 0x03B1, 0x90 }, { 0x03B4, 0x9B }, { 0x03B5, 0x9E },
+  { 0x03C0, 0x93 }, { 0x03C3, 0x95 }, { 0x03C4, 0x97 }, { 0x03C9, 0xB8 },
+  { 0x0411, 0x80 }, { 0x0414, 0x81 }, { 0x0416, 0x82 }, { 0x0417, 0x83 },
+  { 0x0418, 0x84 }, { 0x0419, 0x85 }, { 0x041B, 0x86 }, { 0x041F, 0x87 },
+  { 0x0423, 0x88 }, { 0x0426, 0x89 }, { 0x0427, 0x8A }, { 0x0428, 0x8B },
+  { 0x0429, 0x8C }, { 0x042A, 0x8D }, { 0x042B, 0x8E }, { 0x042D, 0x8F },
+  { 0x042E, 0xAC }, { 0x042F, 0xAD }, { 0x201C, 0x12 }, { 0x201D, 0x13 },
+  { 0x2190, 0x1B }, { 0x2191, 0x18 }, { 0x2192, 0x1A }, { 0x2193, 0x19 },
+  { 0x21B5, 0x17 }, { 0x221E, 0x9C }, { 0x2229, 0x9F }, { 0x2264, 0x1C },
+  { 0x2265, 0x1D }, { 0x2302, 0x7F }, { 0x25B2, 0x1E }, { 0x25B6, 0x10 },
+  { 0x25BC, 0x1F }, { 0x25C0, 0x11 }, { 0x25CF, 0x16 }, { 0x2665, 0x9D },
+  { 0x266A, 0x91 }, { 0x266C, 0x96 }
+  };
+
+// Characters that look enough like ASCII ones to stand in for them, in
+//  code point order
+static const CharmapEntry charmap_aliases[] =
+  {
+  { 0x00A0, ' ' }, { 0x00D7, 'x' }, { 0x0410, 'A' }, { 0x0412, 'B' },
+  { 0x0415, 'E' }, { 0x041A, 'K' }, { 0x041C, 'M' }, { 0x041D, 'H' },
+  { 0x041E, 'O' }, { 0x0420, 'P' }, { 0x0421, 'C' }, { 0x0422, 'T' },
+  { 0x0425, 'X' }, { 0x0430, 'a' }, { 0x0435, 'e' }, { 0x043E, 'o' },
+  { 0x0440, 'p' }, { 0x0441, 'c' }, { 0x0443, 'y' }, { 0x0445, 'x' },
+  { 0x2010, '-' }, { 0x2013, '-' }, { 0x2014, '-' }, { 0x2018, '\'' },
+  { 0x2019, '\'' }, { 0x201C, '"' }, { 0x201D, '"' }
+  };
+
+// Glyphs for common characters that one ROM or the other lacks, in
+//  code point order
+static const CharmapBitmap charmap_bitmaps[] =
+  {
+  { 0x005C, { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00, 0x00 } }, // backslash
+  { 0x007E, { 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00, 0x00 } }, // tilde
+  { 0x00A3, { 0x06, 0x09, 0x08, 0x1C, 0x08, 0x08, 0x1F, 0x00 } }, // pound
+  { 0x00C4, { 0x0A, 0x00, 0x0E, 0x11, 0x1F, 0x11, 0x11, 0x00 } }, // A umlaut
+  { 0x00C5, { 0x04, 0x0A, 0x04, 0x0E, 0x11, 0x1F, 0x11, 0x00 } }, // A ring
+  { 0x00C7, { 0x0E, 0x11, 0x10, 0x10, 0x11, 0x0E, 0x04, 0x0C } }, // C cedilla
+  { 0x00D6, { 0x0A, 0x00, 0x0E, 0x11, 0x11, 0x11, 0x0E, 0x00 } }, // O umlaut
+  { 0x00D8, { 0x01, 0x0E, 0x13, 0x15, 0x19, 0x0E, 0x10, 0x00 } }, // O stroke
+  { 0x00DC, { 0x0A, 0x00, 0x11, 0x11, 0x11, 0x11, 0x0E, 0x00 } }, // U umlaut
+  { 0x00E0, { 0x08, 0x04, 0x0E, 0x01, 0x0F, 0x11, 0x0F, 0x00 } }, // a grave
+  { 0x00E2, { 0x04, 0x0A, 0x0E, 0x01, 0x0F, 0x11, 0x0F, 0x00 } }, // a circumflex
+  { 0x00E5, { 0x04, 0x0A, 0x04, 0x0E, 0x01, 0x0F, 0x11, 0x0F } }, // a ring
+  { 0x00E7, { 0x00, 0x0E, 0x10, 0x10, 0x11, 0x0E, 0x04, 0x0C } }, // c cedilla
+  { 0x00E8, { 0x08, 0x04, 0x0E, 0x11, 0x1F, 0x10, 0x0E, 0x00 } }, // e grave
+  { 0x00E9, { 0x02, 0x04, 0x0E, 0x11, 0x1F, 0x10, 0x0E, 0x00 } }, // e acute
+  { 0x00EA, { 0x04, 0x0A, 0x0E, 0x11, 0x1F, 0x10, 0x0E, 0x00 } }, // e circumflex
+  { 0x00F8, { 0x00, 0x01, 0x0E, 0x13, 0x15, 0x19, 0x0E, 0x10 } }, // o stroke
+  { 0x20AC, { 0x06, 0x09, 0x1C, 0x08, 0x1C, 0x09, 0x06, 0x00 } } // euro
+  };
+
+/*============================================================================
+
+  charmap_search
+
+  Binary-search a table in code point order. Returns the entry, or NULL.
+
+============================================================================*/
+static const CharmapEntry *charmap_search (const CharmapEntry *t, int n, 
+    uint32_t cp)
+  {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (t[mid].cp == cp) return &t[mid];
+    if (t[mid].cp < cp) lo = mid + 1;
+    else hi = mid - 1;
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  charmap_find
+
+============================================================================*/
+int charmap_find (const char *name)
+  {
+  if (strcmp (name, "a00") == 0) return CHARMAP_A00;
+  if (strcmp (name, "a02") == 0) return CHARMAP_A02;
+  return -1;
+  }
+
+/*============================================================================
+
+  charmap_utf8_next
+
+  Overlong forms, surrogates, and anything above U+10FFFF are invalid,
+  as is a sequence cut short -- by the NUL at the end of the string, 
+  for example.
+
+============================================================================*/
+uint32_t charmap_utf8_next (const BYTE *s, int *len)
+  {
+  *len = 1;
+  BYTE b = s[0];
+  if (b < 0x80) return b;
+  int n;
+  uint32_t cp, min;
+  if ((b & 0xE0) == 0xC0) { n = 2; cp = b & 0x1F; min = 0x80; }
+  else if ((b & 0xF0) == 0xE0) { n = 3; cp = b & 0x0F; min = 0x800; }
+  else if ((b & 0xF8) == 0xF0) { n = 4; cp = b & 0x07; min = 0x10000; }
+  else return CHARMAP_REPLACEMENT;
+  for (int i = 1; i < n; i++)
+    {
+    if ((s[i] & 0xC0) != 0x80) return CHARMAP_REPLACEMENT;
+    cp = (cp << 6) | (s[i] & 0x3F);
+    }
+  if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+    return CHARMAP_REPLACEMENT;
+  *len = n;
+  return cp;
+  }
+
+/*============================================================================
+
+  charmap_rom
+
+  Look a code point up in a ROM, without trying look-alikes
+
+============================================================================*/
+static int charmap_rom (int rom, uint32_t cp, BYTE *codes)
+  {
+  const CharmapEntry *e;
+  if (rom == CHARMAP_A00)
+    {
+    if (cp >= ' ' && cp <= CHARMAP_A00_ASCII_END && cp != CHARMAP_A00_YEN)
+      {
+      codes[0] = cp;
+      return 1;
+      }
+    if (cp >= CHARMAP_HALF_KANA && cp <= CHARMAP_HALF_KANA_END)
+      {
+      codes[0] = cp - CHARMAP_HALF_KANA + CHARMAP_A00_HALF_KANA;
+      return 1;
+      }
+    if (cp >= CHARMAP_KANA && cp < CHARMAP_KANA + CHARMAP_KANA_COUNT)
+      {
+      uint16_t k = charmap_a00_kana[cp - CHARMAP_KANA];
+      if (k == 0) return 0;
+      codes[0] = k & 0xFF;
+      codes[1] = k >> 8;
+      return codes[1] ? 2 : 1;
+      }
+    e = charmap_search (charmap_a00, 
+      sizeof (charmap_a00) / sizeof (charmap_a00[0]), cp);
+    }
+  else
+    {
+    // A02 has the Latin-1 characters where Latin-1 does, except for a 
+    //  few accents and marks, whose places hold other characters
+    if ((cp >= ' ' && cp < 0x7F) 
+        || (cp >= 0xA1 && cp <= 0xFF && cp != 0xA8 && cp != 0xAC 
+          && cp != 0xAD && cp != 0xAF && cp != 0xB4 && cp != 0xB8))
+      {
+      codes[0] = cp;
+      return 1;
+      }
+    e = charmap_search (charmap_a02, 
+      sizeof (charmap_a02) / sizeof (charmap_a02[0]), cp);
+    }
+  if (!e) return 0;
+  codes[0] = e->code;
+  return 1;
+  }
+
+/*============================================================================
+
+  charmap_encode
+
+============================================================================*/
+int charmap_encode (int rom, uint32_t cp, BYTE *codes)
+  {
+  int n = charmap_rom (rom, cp, codes);
+  if (n > 0) return n;
+  const CharmapEntry *e = charmap_search (charmap_aliases, 
+    sizeof (charmap_aliases) / sizeof (charmap_aliases[0]), cp);
+  return e ? charmap_rom (rom, e->code, codes) : 0;
+  }
+
+/*============================================================================
+
+  charmap_bitmap
+
+============================================================================*/
+const BYTE *charmap_bitmap (uint32_t cp)
+  {
+  int lo = 0, hi = sizeof (charmap_bitmaps) / sizeof (charmap_bitmaps[0]) - 1;
+  while (lo <= hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (charmap_bitmaps[mid].cp == cp) return charmap_bitmaps[mid].rows;
+    if (charmap_bitmaps[mid].cp < cp) lo = mid + 1;
+    else hi = mid - 1;
+    }
+  return NULL;
+  }
+
@@ -0,0 +1,59 @@
+/*============================================================================
+
+  charmap.h
+
+  Mapping Unicode text onto the character ROMs of the HD44780. The 
+  module has one of two ROMs: A00, which is ASCII (except that '\' and
+  '~' are replaced by a yen sign and arrows), with katakana and a few
+  Greek letters and symbols; or A02, which is ASCII, with most of 
+  Latin-1, and some Greek and Cyrillic. All the tables here are 
+  constant, and built by the compiler, so mapping a character is a 
+  couple of comparisons, or a binary search, with no allocation.
+
+  Characters that aren't in the ROM can still be shown, if there is a 
+  bitmap for them here, using a custom glyph (see lcd8574_glyph()). 
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+// The character ROMs
+#define CHARMAP_A00 0
+#define CHARMAP_A02 1
+
+// The code point that invalid UTF-8 decodes to
+#define CHARMAP_REPLACEMENT 0xFFFD
+
+// The most ROM characters one code point can need -- katakana with a
+//  voiced mark take two
+#define CHARMAP_CODES_MAX 2
+
+BEGIN_DECLS
+
+/** Find a ROM by name: "a00" or "a02". Returns CHARMAP_A00 or
+    CHARMAP_A02, or -1 if the name is not known. */
+int       charmap_find (const char *name);
+
+/** Decode one character from a UTF-8 string, which must not be at its
+    terminating NUL. The number of bytes used is written to len. A byte
+    that doesn't start a valid, shortest-form sequence decodes as
+    CHARMAP_REPLACEMENT, using one byte, so decoding always moves on. */
+uint32_t  charmap_utf8_next (const BYTE *s, int *len);
+
+/** Write the ROM character codes that show a code point into codes, 
+    which must have room for CHARMAP_CODES_MAX. A character that isn't
+    in the ROM might be shown by a look-alike that is. Returns the 
+    number of codes, which is zero if the ROM can't show the code 
+    point at all. */
+int       charmap_encode (int rom, uint32_t cp, BYTE *codes);
+
+/** Get an eight-row bitmap for a code point, in the form 
+    lcd8574_glyph() takes, or NULL if there isn't one */
+const BYTE *charmap_bitmap (uint32_t cp);
+
+END_DECLS
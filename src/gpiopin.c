@@ -4,6 +4,16 @@
 
     A "class" for setting values of specific GPIO pins.
 
+    Pins are requested from the GPIO character device (/dev/gpiochipN),
+    using the v2 line-request ioctls. If there's no character device --
+    an old kernel -- a single GPIOPin falls back to sysfs. A
+    GPIOPinGroup requests a number of lines at once, and sets any
+    combination of them with a single ioctl.
+
+    On a Raspberry Pi, a group can instead map the GPIO registers, 
+    through /dev/gpiomem, and set its lines by writing to the GPSET and 
+    GPCLR registers directly, with no syscall at all.
+
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
@@ -16,13 +26,47 @@
 #include <assert.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/gpio.h>
 #include "defs.h" 
 #include "gpiopin.h" 
 
+#define GPIOPIN_CONSUMER "lcd8574"
+
 struct _GPIOPin
   {
   int pin; 
   int value_fd;
+  BOOL sysfs; // Set if value_fd is a sysfs file, rather than a line request
+  };
+
+// The BCM283x/BCM2711 GPIO registers, as 32-bit word offsets into the
+//  block that /dev/gpiomem maps. There are three function-select bits
+//  per pin, ten pins to a GPFSEL register, and one bit per pin in each
+//  GPSET and GPCLR register. Writing a one sets or clears the pin;
+//  writing a zero leaves it alone.
+#define GPIOPIN_GPFSEL 0
+#define GPIOPIN_GPSET 7
+#define GPIOPIN_GPCLR 10
+#define GPIOPIN_MAP_SIZE 4096
+#define GPIOPIN_FSEL_OUTPUT 1
+// Pins 0-53 are in two banks
+#define GPIOPIN_BCM_MAX 54
+
+// To turn a group's mask or bits into register bits, we look up each
+//  eight lines of the group in turn, in a table for those lines
+#define GPIOPIN_CHUNKS (GPIOPIN_GROUP_MAX / 8)
+
+struct _GPIOPinGroup
+  {
+  char *chip;
+  int pins[GPIOPIN_GROUP_MAX];
+  int n;
+  int line_fd;
+  volatile uint32_t *regs; // The mapped GPIO registers, or NULL
+  uint32_t fsel[GPIOPIN_BCM_MAX / 10 + 1]; // To restore, in _uninit()
+  uint64_t (*expand)[256]; // Register bits for each chunk of lines
   };
 
 /*============================================================================
@@ -37,6 +81,41 @@ GPIOPin *gpiopin_create (int pin)
   return self;
   }
 
+/*============================================================================
+  gpiopin_request
+  Request lines from the GPIO character device chip, as outputs, all
+  initially low. Returns the line request fd, or -1 with errno set.
+============================================================================*/
+static int gpiopin_request (const char *chip, const int *pins, int n)
+  {
+  int chip_fd = open (chip, O_RDWR | O_CLOEXEC);
+  if (chip_fd < 0) return -1;
+  struct gpio_v2_line_request req;
+  memset (&req, 0, sizeof (req));
+  for (int i = 0; i < n; i++)
+    req.offsets[i] = pins[i];
+  req.num_lines = n;
+  strncpy (req.consumer, GPIOPIN_CONSUMER, sizeof (req.consumer) - 1);
+  req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  int ret = ioctl (chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  int e = errno;
+  // The line request has its own fd, so we don't need the chip's
+  close (chip_fd);
+  errno = e;
+  return ret < 0 ? -1 : req.fd;
+  }
+
+/*============================================================================
+  gpiopin_set_lines
+============================================================================*/
+static BOOL gpiopin_set_lines (int line_fd, uint64_t mask, uint64_t bits)
+  {
+  struct gpio_v2_line_values v;
+  v.mask = mask;
+  v.bits = bits;
+  return ioctl (line_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v) >= 0;
+  }
+
 /*============================================================================
   gpiopin_write_to_file
 ============================================================================*/
@@ -82,6 +161,22 @@ void gpiopin_destroy (GPIOPin *self)
 BOOL gpiopin_init (GPIOPin *self, char **error)
   {
   assert (self != NULL);
+  self->value_fd = gpiopin_request (GPIOPIN_CHIP, &self->pin, 1);
+  if (self->value_fd >= 0)
+    {
+    self->sysfs = FALSE;
+    return TRUE;
+    }
+  if (errno != ENOENT)
+    {
+    if (error)
+      asprintf (error, "Can't request GPIO line %d from %s: %s", self->pin,
+        GPIOPIN_CHIP, strerror (errno));
+    return FALSE;
+    }
+
+  // No character device, so this must be an old kernel; use sysfs
+  self->sysfs = TRUE;
   char s[50];
   snprintf (s, sizeof(s), "%d", self->pin);
   BOOL ret = gpiopin_write_to_file ("/sys/class/gpio/export", s, error);
@@ -112,9 +207,10 @@ BOOL gpiopin_init (GPIOPin *self, char **error)
 void gpiopin_uninit (GPIOPin *self)
   {
   assert (self != NULL);
-  if (self->value_fd >= 0)
-    close (self->value_fd);
+  if (self->value_fd < 0) return;
+  close (self->value_fd);
   self->value_fd = -1;
+  if (!self->sysfs) return;
   char s[50];
   snprintf (s, sizeof(s), "%d", self->pin);
   gpiopin_write_to_file ("/sys/class/gpio/unexport", s, NULL);
@@ -127,8 +223,194 @@ void gpiopin_set (GPIOPin *self, BOOL val)
   {
   assert (self != NULL);
   assert (self->value_fd >= 0);
+  if (!self->sysfs)
+    {
+    gpiopin_set_lines (self->value_fd, 1, val ? 1 : 0);
+    return;
+    }
   char c = val ? '1' : '0';
   write (self->value_fd, &c, 1);
   }
 
+/*============================================================================
+  gpiopin_group_create
+============================================================================*/
+GPIOPinGroup *gpiopin_group_create (const char *chip, const int *pins, int n)
+  {
+  assert (pins != NULL);
+  assert (n > 0 && n <= GPIOPIN_GROUP_MAX);
+  GPIOPinGroup *self = malloc (sizeof (GPIOPinGroup));
+  memset (self, 0, sizeof (GPIOPinGroup));
+  self->chip = strdup (chip ? chip : GPIOPIN_CHIP);
+  memcpy (self->pins, pins, n * sizeof (int));
+  self->n = n;
+  self->line_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  gpiopin_group_destroy
+============================================================================*/
+void gpiopin_group_destroy (GPIOPinGroup *self)
+  {
+  if (self)
+    {
+    gpiopin_group_uninit (self);
+    free (self->chip);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  gpiopin_group_map
+  Map the GPIO registers, set the pins to be outputs, and build the
+  tables that turn group bits into register bits. The pins' old 
+  function selections are saved, so _uninit() can put them back.
+============================================================================*/
+static BOOL gpiopin_group_map (GPIOPinGroup *self)
+  {
+  for (int i = 0; i < self->n; i++)
+    {
+    if (self->pins[i] < 0 || self->pins[i] >= GPIOPIN_BCM_MAX)
+      {
+      errno = EINVAL;
+      return FALSE;
+      }
+    }
+  int fd = open (self->chip, O_RDWR | O_SYNC | O_CLOEXEC);
+  if (fd < 0) return FALSE;
+  void *p = mmap (NULL, GPIOPIN_MAP_SIZE, PROT_READ | PROT_WRITE, 
+    MAP_SHARED, fd, 0);
+  int e = errno;
+  close (fd);
+  if (p == MAP_FAILED)
+    {
+    errno = e;
+    return FALSE;
+    }
+  self->regs = p;
+
+  int chunks = (self->n + 7) / 8;
+  self->expand = malloc (chunks * sizeof (self->expand[0]));
+  for (int c = 0; c < chunks; c++)
+    {
+    for (int v = 0; v < 256; v++)
+      {
+      uint64_t r = 0;
+      for (int b = 0; b < 8 && c * 8 + b < self->n; b++)
+        if (v & (1 << b)) r |= 1ULL << self->pins[c * 8 + b];
+      self->expand[c][v] = r;
+      }
+    }
+
+  for (unsigned i = 0; i < sizeof (self->fsel) / sizeof (uint32_t); i++)
+    self->fsel[i] = self->regs[GPIOPIN_GPFSEL + i];
+  uint64_t all = 0;
+  for (int i = 0; i < self->n; i++)
+    {
+    int pin = self->pins[i];
+    all |= 1ULL << pin;
+    volatile uint32_t *r = &self->regs[GPIOPIN_GPFSEL + pin / 10];
+    int shift = (pin % 10) * 3;
+    *r = (*r & ~(7u << shift)) | (GPIOPIN_FSEL_OUTPUT << shift);
+    }
+  // All low, as with a line request
+  self->regs[GPIOPIN_GPCLR] = (uint32_t)all;
+  self->regs[GPIOPIN_GPCLR + 1] = (uint32_t)(all >> 32);
+  return TRUE;
+  }
+
+/*============================================================================
+  gpiopin_group_expand
+============================================================================*/
+static inline uint64_t gpiopin_group_expand (const GPIOPinGroup *self, 
+    uint64_t v)
+  {
+  uint64_t r = 0;
+  for (int c = 0; v; c++, v >>= 8)
+    r |= self->expand[c][v & 0xFF];
+  return r;
+  }
+
+/*============================================================================
+  gpiopin_group_init
+============================================================================*/
+BOOL gpiopin_group_init (GPIOPinGroup *self, char **error)
+  {
+  assert (self != NULL);
+  if (strcmp (self->chip, GPIOPIN_GPIOMEM) == 0)
+    {
+    if (gpiopin_group_map (self)) return TRUE;
+    int e = errno;
+    gpiopin_group_uninit (self);
+    errno = e;
+    if (error)
+      asprintf (error, "Can't map GPIO registers from %s: %s", self->chip,
+        strerror (errno));
+    return FALSE;
+    }
+  self->line_fd = gpiopin_request (self->chip, self->pins, self->n);
+  if (self->line_fd >= 0) return TRUE;
+  if (error)
+    asprintf (error, "Can't request %d GPIO lines from %s: %s", self->n,
+      self->chip, strerror (errno));
+  return FALSE;
+  }
+
+/*============================================================================
+  gpiopin_group_uninit
+  Releasing the request returns the lines to the kernel, so there's
+  no equivalent of the sysfs unexport
+============================================================================*/
+void gpiopin_group_uninit (GPIOPinGroup *self)
+  {
+  assert (self != NULL);
+  if (self->line_fd >= 0)
+    close (self->line_fd);
+  self->line_fd = -1;
+  if (self->regs)
+    {
+    for (int i = 0; i < self->n; i++)
+      {
+      int pin = self->pins[i];
+      volatile uint32_t *r = &self->regs[GPIOPIN_GPFSEL + pin / 10];
+      int shift = (pin % 10) * 3;
+      *r = (*r & ~(7u << shift)) | (self->fsel[pin / 10] & (7u << shift));
+      }
+    munmap ((void *)self->regs, GPIOPIN_MAP_SIZE);
+    self->regs = NULL;
+    }
+  free (self->expand);
+  self->expand = NULL;
+  }
+
+/*============================================================================
+  gpiopin_group_set
+============================================================================*/
+BOOL gpiopin_group_set (GPIOPinGroup *self, uint64_t mask, uint64_t bits)
+  {
+  assert (self != NULL);
+  if (self->regs)
+    {
+    uint64_t set = gpiopin_group_expand (self, mask & bits);
+    uint64_t clr = gpiopin_group_expand (self, mask & ~bits);
+    if (set) self->regs[GPIOPIN_GPSET] = (uint32_t)set;
+    if (clr) self->regs[GPIOPIN_GPCLR] = (uint32_t)clr;
+    if (set >> 32) self->regs[GPIOPIN_GPSET + 1] = (uint32_t)(set >> 32);
+    if (clr >> 32) self->regs[GPIOPIN_GPCLR + 1] = (uint32_t)(clr >> 32);
+    return TRUE;
+    }
+  assert (self->line_fd >= 0);
+  return gpiopin_set_lines (self->line_fd, mask, bits);
+  }
+
+/*============================================================================
+  gpiopin_group_is_mapped
+============================================================================*/
+BOOL gpiopin_group_is_mapped (const GPIOPinGroup *self)
+  {
+  assert (self != NULL);
+  return self->regs != NULL;
+  }
+
 
@@ -2,7 +2,8 @@
   
   gpiopin.h
 
-  Functions to control a specific GPIO pin. 
+  Functions to control a specific GPIO pin, or a group of pins that
+  are set together. 
 
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
@@ -10,11 +11,26 @@
   ==========================================================================*/
 #pragma once
 
+#include <stdint.h>
 #include "defs.h"
 
+// The GPIO character device used by GPIOPin, and by a GPIOPinGroup
+//  unless another is given
+#define GPIOPIN_CHIP "/dev/gpiochip0"
+
+// A GPIOPinGroup created with this as its chip maps the Raspberry Pi's
+//  GPIO registers, rather than using the character device
+#define GPIOPIN_GPIOMEM "/dev/gpiomem"
+
+// The most lines in a GPIOPinGroup (the kernel's limit for one request)
+#define GPIOPIN_GROUP_MAX 64
+
 struct GPIOPin;
 typedef struct _GPIOPin GPIOPin;
 
+struct GPIOPinGroup;
+typedef struct _GPIOPinGroup GPIOPinGroup;
+
 BEGIN_DECLS
 
 /** Initialize the GPIOPin object with pin number. 
@@ -25,8 +41,9 @@ GPIOPin  *gpiopin_create (int pin);
 /** Clean up the object. This method implicitly calls _uninit(). */
 void      gpiopin_destroy (GPIOPin *self);
 
-/** Initialize the object. This opens a file handles for the
-    sysfs file for the GPIO pin. Consequently, the method
+/** Initialize the object. This requests the line from GPIOPIN_CHIP
+    or, if there is no GPIO character device, opens a file handle for
+    the sysfs file for the GPIO pin. Consequently, the method
     can fail. If it does, and *error is not NULL, then it is written with
     and error message that the caller should free. If this method 
     succeeds, _uninit() should be called in due course to clean up. */ 
@@ -40,4 +57,41 @@ void      gpiopin_uninit (GPIOPin *self);
 /** Set this pin HIGH or LOW. */
 void      gpiopin_set (GPIOPin *self, BOOL val);
 
+/** Initialize a group of n GPIO lines, whose numbers (offsets on the
+    chip) are in pins. If chip is NULL, GPIOPIN_CHIP is used. If it is
+    GPIOPIN_GPIOMEM, the pins are the SoC's GPIO numbers, which must be
+    less than 54. Note that this method only stores values, and will 
+    always succeed. */
+GPIOPinGroup *gpiopin_group_create (const char *chip, const int *pins, 
+                 int n);
+
+/** Clean up the group. This method implicitly calls _uninit(). */
+void      gpiopin_group_destroy (GPIOPinGroup *self);
+
+/** Request all the lines in the group, as outputs, initially low, in
+    one operation. With GPIOPIN_GPIOMEM, this maps the registers and
+    sets the pins' functions, instead; their old functions are put back
+    by _uninit(). This can fail, if the chip does not exist, or a line
+    is in use; if it does, and *error is not NULL, then it is written
+    with an error message that the caller should free. */
+BOOL      gpiopin_group_init (GPIOPinGroup *self, char **error);
+
+/** Release the lines. */
+void      gpiopin_group_uninit (GPIOPinGroup *self);
+
+/** Set the lines selected by mask to the corresponding values in bits,
+    using a single ioctl. Bit i of each corresponds to the i'th entry
+    in the pins passed to _create(). Lines not in the mask are left
+    alone. Returns FALSE if the ioctl failed. With GPIOPIN_GPIOMEM, 
+    there's no ioctl: the lines to set and clear are looked up in 
+    tables built by _init(), and written to the GPSET and GPCLR 
+    registers, which takes nanoseconds, and can't fail. */
+BOOL      gpiopin_group_set (GPIOPinGroup *self, uint64_t mask, 
+            uint64_t bits);
+
+/** Returns TRUE if the group sets its lines through the mapped GPIO
+    registers. Then changes take effect within nanoseconds, so callers
+    with timing requirements must provide their own delays. */
+BOOL      gpiopin_group_is_mapped (const GPIOPinGroup *self);
+
 END_DECLS
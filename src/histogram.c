@@ -0,0 +1,153 @@
+/*============================================================================
+
+  histogram.c
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "defs.h"
+#include "histogram.h"
+
+/*============================================================================
+
+  histogram_index
+
+  Work out which bucket a value goes in. Values less than 8 get a 
+  bucket each; after that, each power of two gets eight buckets, 
+  distinguished by the three bits below the highest set bit.
+
+============================================================================*/
+static int histogram_index (long long value)
+  {
+  if (value < HISTOGRAM_SUB_BUCKETS) return value < 0 ? 0 : value;
+  int e = 63 - __builtin_clzll (value);
+  int i = (e - 2) * HISTOGRAM_SUB_BUCKETS 
+    + ((value >> (e - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+  return i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1;
+  }
+
+/*============================================================================
+
+  histogram_bucket_top
+
+  The largest value that goes in a bucket
+
+============================================================================*/
+static long long histogram_bucket_top (int i)
+  {
+  if (i < HISTOGRAM_SUB_BUCKETS) return i;
+  int e = i / HISTOGRAM_SUB_BUCKETS + 2;
+  long long low = (long long)(HISTOGRAM_SUB_BUCKETS 
+    + i % HISTOGRAM_SUB_BUCKETS) << (e - 3);
+  return low + (1LL << (e - 3)) - 1;
+  }
+
+/*============================================================================
+
+  histogram_record
+
+============================================================================*/
+void histogram_record (Histogram *self, long long value)
+  {
+  atomic_fetch_add_explicit (&self->buckets[histogram_index (value)], 1,
+    memory_order_relaxed);
+  atomic_fetch_add_explicit (&self->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&self->sum, value, memory_order_relaxed);
+  long long max = atomic_load_explicit (&self->max, memory_order_relaxed);
+  while (value > max && !atomic_compare_exchange_weak_explicit 
+      (&self->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+    ;
+  }
+
+/*============================================================================
+
+  histogram_reset
+
+============================================================================*/
+void histogram_reset (Histogram *self)
+  {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    atomic_store_explicit (&self->buckets[i], 0, memory_order_relaxed);
+  atomic_store_explicit (&self->count, 0, memory_order_relaxed);
+  atomic_store_explicit (&self->sum, 0, memory_order_relaxed);
+  atomic_store_explicit (&self->max, 0, memory_order_relaxed);
+  }
+
+/*============================================================================
+
+  histogram_count
+
+============================================================================*/
+long long histogram_count (const Histogram *self)
+  {
+  return atomic_load_explicit (&self->count, memory_order_relaxed);
+  }
+
+/*============================================================================
+
+  histogram_percentile
+
+  Add up the buckets until we've passed the required fraction of the
+  values. We count the buckets, rather than trusting the total, since
+  the total might have moved on while we were reading them.
+
+============================================================================*/
+long long histogram_percentile (const Histogram *self, double p)
+  {
+  long long counts[HISTOGRAM_BUCKETS];
+  long long total = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+    counts[i] = atomic_load_explicit (&self->buckets[i], 
+      memory_order_relaxed);
+    total += counts[i];
+    }
+  if (total == 0) return 0;
+  long long want = (long long)(p * total + 0.5);
+  if (want < 1) want = 1;
+  long long seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+    seen += counts[i];
+    if (seen >= want) 
+      {
+      long long top = histogram_bucket_top (i);
+      long long max = atomic_load_explicit (&self->max, 
+        memory_order_relaxed);
+      return top < max ? top : max;
+      }
+    }
+  return atomic_load_explicit (&self->max, memory_order_relaxed);
+  }
+
+/*============================================================================
+
+  histogram_write_header
+
+============================================================================*/
+void histogram_write_header (FILE *f)
+  {
+  fprintf (f, "%-16s %10s %10s %10s %10s %10s %10s\n", "(usec)", "count",
+    "mean", "p50", "p90", "p99", "max");
+  }
+
+/*============================================================================
+
+  histogram_write
+
+============================================================================*/
+void histogram_write (const Histogram *self, const char *name, FILE *f)
+  {
+  long long count = histogram_count (self);
+  long long sum = atomic_load_explicit (&self->sum, memory_order_relaxed);
+  long long max = atomic_load_explicit (&self->max, memory_order_relaxed);
+  fprintf (f, "%-16s %10lld %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, 
+    count, count ? sum / 1000.0 / count : 0.0,
+    histogram_percentile (self, 0.50) / 1000.0,
+    histogram_percentile (self, 0.90) / 1000.0,
+    histogram_percentile (self, 0.99) / 1000.0, max / 1000.0);
+  }
@@ -0,0 +1,60 @@
+/*============================================================================
+
+  histogram.h
+
+  A log-bucketed latency histogram, in the style of HdrHistogram. Each
+  power of two is divided into eight buckets, so a recorded value is
+  known to within 12.5%, whatever its size, and a histogram that can
+  hold anything from a nanosecond to several minutes takes a few
+  kilobytes. Recording a value is a handful of relaxed atomic 
+  operations, with no locks, so any number of threads can record into
+  the same histogram while another reads it.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "defs.h"
+
+// Buckets for each power of two, and the number of buckets. The last
+//  bucket ends at 2^(BUCKETS / SUB_BUCKETS + 2), which is 2^42 -- about
+//  73 minutes, in nanoseconds. Larger values are counted in it anyway
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS 320
+
+typedef struct _Histogram
+  {
+  atomic_llong count;
+  atomic_llong sum;
+  atomic_llong max;
+  atomic_llong buckets[HISTOGRAM_BUCKETS];
+  } Histogram;
+
+BEGIN_DECLS
+
+/** Record one value, which must not be negative */
+void      histogram_record (Histogram *self, long long value);
+
+/** Forget every value */
+void      histogram_reset (Histogram *self);
+
+/** The number of values recorded */
+long long histogram_count (const Histogram *self);
+
+/** The value below which the fraction p (0-1) of the recorded values
+    lie, to within the bucket size. Returns 0 if nothing has been 
+    recorded. */
+long long histogram_percentile (const Histogram *self, double p);
+
+/** Write a one-line summary of the histogram, in microseconds, 
+    assuming that the values are in nanoseconds */
+void      histogram_write (const Histogram *self, const char *name, FILE *f);
+
+/** Write the column headings for histogram_write() */
+void      histogram_write_header (FILE *f);
+
+END_DECLS
@@ -24,22 +24,34 @@
 #include <assert.h>
 #include <pthread.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
+#include <time.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include "defs.h" 
+#include "charmap.h" 
 #include "gpiopin.h" 
 #include "lcd8574.h" 
+#include "transport.h" 
+#include "histogram.h" 
+#include "trace.h" 
 
 // Define how the LCD module pins are connected to the PCF8547
-//  outputs 0-7 
+//  outputs 0-7, in the "standard" wiring profile. This is the
+//  way most backpack modules are wired, but others can be selected
+//  using lcd8574_set_wiring() -- see lcd8574_wirings[] below.
 
 // Register select -- pin 4 on the LCD module. 0=command, 1=data
 #define PIN_RS   0
 // Read/write -- pin 5 on the LCD module. 0=write, 1=read. 
 // In practice, this pin can usually be set permanently to 0V but
 //  if it is connection to an output pin, we must set it low
-// Not currently used in the code -- always set to low
+// It is only set high to read the busy flag, if this has been enabled
+//  by calling lcd8574_set_busy_poll(). If the pin is not wired to
+//  the PCF8574, set this value to -1, and timed delays will always be used
 #define PIN_RW   1
 // Clock (usually called "enable") -- pin 6 on the LCD module. The clock
 //  is triggered on the falling edge of this input 
@@ -48,6 +60,9 @@
 //  If the LED is wired permanently on, set this value to -1, so the
 //  code won't bother setting it
 #define PIN_LED  3 
+// Set to 1 if the backlight is on when the LED output is low (that is,
+//  the backpack has a PNP transistor in the LED circuit)
+#define PIN_LED_ACTIVE_LOW 0
 // Four data pins (pins 11-14). In four-bit mode, 
 //  we only use highest four data lines
 #define PIN_D4   4
@@ -57,6 +72,35 @@
 // Pins 7-10 are connected in 4-bit mode
 
 
+typedef struct _LCD8574Wiring
+  {
+  const char *name;
+  int rs, rw, e, led; // rw and led are -1 if not connected
+  BOOL led_active_low;
+  int d4, d5, d6, d7;
+  int e2; // E of the second controller of a 40x4 module, or -1
+  } LCD8574Wiring;
+
+// Wiring profiles that can be selected by name using lcd8574_set_wiring().
+//  "mjkdz" is the arrangement used by the mjkdz and GY-LCD backpacks;
+//  "standard-norw" is for modules whose RW line is tied to 0V;
+//  "dual-e" is for 40x4 modules, which have two controllers, each with
+//  its own E line. The second E takes the place of RW, which is tied 
+//  to 0V.
+static const LCD8574Wiring lcd8574_wirings[] =
+  {
+  { "standard", PIN_RS, PIN_RW, PIN_E, PIN_LED, PIN_LED_ACTIVE_LOW, 
+      PIN_D4, PIN_D5, PIN_D6, PIN_D7, -1 },
+  { "mjkdz", 6, 5, 4, 7, TRUE, 0, 1, 2, 3, -1 },
+  { "standard-norw", PIN_RS, -1, PIN_E, PIN_LED, PIN_LED_ACTIVE_LOW, 
+      PIN_D4, PIN_D5, PIN_D6, PIN_D7, -1 },
+  { "dual-e", PIN_RS, -1, PIN_E, PIN_LED, PIN_LED_ACTIVE_LOW, 
+      PIN_D4, PIN_D5, PIN_D6, PIN_D7, PIN_RW },
+  { NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+  };
+
+#define LCD_DEFAULT_WIRING (&lcd8574_wirings[0])
+
 /// ************* LCD commands ************
 // Clear display
 #define CMD_CLEAR       0x01
@@ -98,6 +142,10 @@
 // Data Length -- set for 4-bit mode
 #define	LCD_FUNC_DL	0x10
 
+// *** Cursor/display shift command
+// Shift the display, rather than moving the cursor
+#define	LCD_CDSHIFT_SC	0x08
+// Shift right, rather than left
 #define	LCD_CDSHIFT_RL	0x04
 
 // The number of "addresses" occupied by a single row of text on the
@@ -106,28 +154,360 @@
 // The value of 64 comes from the datasheet
 #define LCD_CHARS_PER_ROW 64
 
+// The size of the DDRAM address space. Not all of it is implemented
+//  in the HD44780, but its address counter has seven bits. 
+#define LCD_DDRAM_SIZE 128
+
+// In two-line mode, each line has 40 bytes of DDRAM, starting at 
+//  address zero and LCD_CHARS_PER_ROW. The address counter skips from the
+//  end of the first line to the start of the second, and from the end
+//  of the second back to zero. 
+#define LCD_LINE_LEN 40
+
+// The number of DDRAM addresses that are actually implemented
+#define LCD_DDRAM_CELLS (2 * LCD_LINE_LEN)
+
+// The most rows we know the DDRAM addresses of. Displays with three or
+//  four rows put the third and fourth after the first and second, in 
+//  the same DDRAM lines: on a 20x4 display, the rows start at 0x00, 
+//  0x40, 0x14, and 0x54, and on a 16x4 display at 0x00, 0x40, 0x10,
+//  and 0x50. 
+#define LCD_ROWS_MAX 4
+
+// The rows each HD44780 can drive. A 40x4 module has two of them
+#define LCD_CTL_ROWS 2
+
+// Marks a DDRAM cell whose contents we don't know
+#define LCD_UNKNOWN -1
+
+// A set-DDRAM-address command costs exactly as much bus time as a data 
+//  byte. So when a flush could skip over some unchanged cells with an 
+//  address command, it is no more expensive to rewrite them, if there
+//  are no more of them than this. 
+#define LCD_BRIDGE_MAX 1
+
+// In asynchronous mode, there are three frames: the one the application
+//  is drawing into, the one the writer thread is sending, and the latest
+//  one to be published. The published frame's index is stored alongside
+//  a flag that indicates that it is newer than the writer's frame.
+#define LCD_FRAMES 3
+#define LCD_FRAME_INDEX 0x03
+#define LCD_FRAME_NEW 0x04
+
+// The HD44780 has eight custom characters, each of eight rows. Character
+//  codes 0-7 (and, repeating, 8-15) display them
+#define LCD_GLYPHS 8
+#define LCD_GLYPH_CODES 16
+
+// The longest text that can be shown in a marquee
+#define LCD_MARQUEE_MAX 256
+
+// One complete set of things that the application can draw
+typedef struct _LCD8574Frame
+  {
+  BYTE *cells; // rows x cols, of what should be shown
+  int cursor_row, cursor_col; // Where the cursor goes, or -1 if nowhere 
+  int mode; // Display mode, or -1 if never set
+  BYTE cgram[LCD_GLYPHS][8]; // Custom character bitmaps 
+  int cgram_used; // Bit mask of the glyphs that have been defined
+  int shift; // How many places the display is shifted left, 0-39. A 
+    // marquee moves it on one place a step, whatever its text position
+  int marquee_row; // The row with a marquee, or -1 
+  int marquee_len;
+  int marquee_pos; // Offset in the marquee text of the first visible char
+  BYTE marquee[LCD_MARQUEE_MAX];
+  long long flushed_at; // When it was published (nsec), for the histograms
+  } LCD8574Frame;
+
+// The I2C device used by lcd8574_create()
 #define I2C_DEV "/dev/i2c-1"
 
+// Indices into the timing table. The HD44780 identifies an instruction 
+//  by its highest set bit, so the index of a command is just the position
+//  of that bit. Data writes have their own entry.
+#define LCD_T_CLEAR  0
+#define LCD_T_HOME   1
+#define LCD_T_ENTRY  2
+#define LCD_T_CTRL   3
+#define LCD_T_SHIFT  4
+#define LCD_T_FUNC   5
+#define LCD_T_CGRAM  6
+#define LCD_T_DDRAM  7
+#define LCD_T_DATA   8
+#define LCD_T_COUNT  9
+
+typedef struct _LCD8574Timing
+  {
+  const char *name;
+  int power_up_us; // Before the first command
+  int reset_us; // After each nibble of the 8-bit/4-bit resync 
+  int exec_us[LCD_T_COUNT]; // Execution time of each instruction
+  } LCD8574Timing;
+
+// Timing profiles that can be selected by name using 
+//  lcd8574_set_timing(). The "datasheet" figures are from the HD44780
+//  datasheet, for a 270kHz oscillator. Some clone modules are a good
+//  deal slower than this; the "conservative" profile should suit 
+//  almost anything. "fast-clone" suits the (many) modules that are 
+//  quicker than the datasheet says.
+static const LCD8574Timing lcd8574_timings[] =
+  {
+  // name          power  reset  clear home entry ctrl shift func cgram ddram data
+  { "conservative", 50000, 35000, { 3000, 3000, 1000, 1000, 1000, 1000, 1000, 1000, 1000 } },
+  { "datasheet",    40000,  4100, { 1520, 1520,   37,   37,   37,   37,   37,   37,   41 } },
+  { "fast-clone",   20000,  1000, { 1000, 1000,   20,   20,   20,   20,   20,   20,   20 } },
+  { NULL, 0, 0, { 0 } }
+  };
+
+#define LCD_DEFAULT_TIMING (&lcd8574_timings[1])
+
+// The names of the entries of a timing profile, in a profile file
+static const char *const lcd8574_timing_names[LCD_T_COUNT] =
+  {
+  "clear", "home", "entry", "ctrl", "shift", "func", "cgram", "ddram", "data"
+  };
+
+// Calibration: the cells of DDRAM (or bytes of CGRAM) that each test 
+//  pattern uses, the number of trials a time must pass, and the longest
+//  time (usec) we'll try for any instruction
+#define LCD_CAL_CELLS 16
+#define LCD_CAL_TRIALS 3
+#define LCD_CAL_MAX_US 20000
+
+// How much longer than the timing profile says (usec) we'll keep polling 
+//  the busy flag, before concluding that the LCD module will never
+//  be ready
+#define LCD_BUSY_TIMEOUT_US 10000
+
+// How many times a flush will resync the LCD module and repaint, after
+//  a failed transaction, before leaving it for the next flush
+#define LCD_RESYNC_TRIES 3
+
+// What lcd8574_write_utf8_at() shows for a character that can't be shown
+#define LCD_UTF8_MISSING '?'
+
+// The stack size of a writer thread whose memory is locked. Locking 
+//  faults in the whole stack, so it's kept well below the usual 8MB; 
+//  a flush needs a few tens of kB, even with the i2c-uring transport
+#define LCD_RT_STACK (512 * 1024)
+
+// Size of the buffer in which PCF8574 bytes are built up before being
+//  sent to the I2C bus. Each LCD byte takes four PCF8574 bytes, so this
+//  is enough for a whole 40x4 screen, with addressing commands
+#define LCD_TX_MAX 2048
+
+// The transmit buffer is divided into segments, each of which can be
+//  sent in one transaction, after which the LCD module needs some time
+//  to execute the last instruction. There can't be more segments than
+//  LCD bytes.
+#define LCD_SEG_MAX (LCD_TX_MAX / 4)
+
+// What lcd8574_uninit() leaves in the state file for the next process,
+//  when warm initialization is enabled. The file is only valid on the
+//  same system, so it's just the raw structure. The boot ID tells us
+//  if the system -- and, probably, the LCD module -- has been restarted
+//  since the file was written.
+#define LCD_STATE_MAGIC 0x4C434431
+#define LCD_BOOT_ID "/proc/sys/kernel/random/boot_id"
+
+typedef struct _LCD8574State
+  {
+  int magic;
+  char boot_id[40];
+  char dev[64];
+  int i2c_addr, rows, cols;
+  int ac, mode, shift;
+  int ddram[LCD_DDRAM_SIZE];
+  BYTE cgram[LCD_GLYPHS][8];
+  int cgram_known;
+  } LCD8574State;
+
+// The DDRAM address that a warm initialization sets, and reads back, 
+//  to check that the LCD module is in step with us in 4-bit mode. 
+//  Its two nibbles differ, so a module in 8-bit mode, which returns 
+//  the same nibble twice, can't give the right answer.
+#define LCD_WARM_PROBE 0x12
+
+// The most displays that can share one bus. There are only eight
+//  PCF8574 addresses, and eight more for the PCF8574A
+#define LCD_BUS_MAX 16
+
+typedef struct _LCD8574Seg
+  {
+  int end; // Offset in the transmit buffer of the end of this segment
+  int wait; // Time (usec) the LCD needs, after the segment is sent
+  } LCD8574Seg;
+
+// A screen template, compiled into PCF8574 bytes
+struct _LCD8574DisplayList
+  {
+  LCD8574 *lcd;
+  BYTE *cells; // rows x cols, of what the display list shows
+  int *cell_off; // Offset in bytes of the data for each cell
+  BYTE *bytes; // The compiled PCF8574 bytes
+  int len;
+  LCD8574Seg *segs; // Where the LCD must be given time to execute
+  int nsegs;
+  int end_ac; // The LCD address counter after the list has been played
+  int commands, data; // How many of each the list sends
+  int (*fields)[3]; // Row, column, and width of each field
+  int nfields;
+  };
+
+struct _LCD8574Bus
+  {
+  char *dev; // Device name, e.g., /dev/i2c-1
+  const Transport *transport;
+  void *handle; // The transport's handle, or NULL if the bus is not open
+  pthread_mutex_t lock; // Held for each transaction
+  LCD8574 *members[LCD_BUS_MAX];
+  int nmembers;
+  BOOL has_worker; // Set if a worker thread does this bus's flushes
+  pthread_t worker;
+  pthread_mutex_t wlock; // Protects the fields below
+  pthread_cond_t wcond; // Signalled when any of them changes
+  int requested; // Count of flushes requested of the worker
+  int completed; // Count of flushes the worker has finished
+  BOOL stop; // Set to make the worker thread exit
+  };
+
+// Counters for lcd8574_get_stats(). They're updated by the application,
+//  writer, and bus worker threads, so they're atomic, but nothing 
+//  depends on their order, so they can be relaxed
+typedef struct _LCD8574Counters
+  {
+  atomic_llong bytes;
+  atomic_llong xfers;
+  atomic_llong failed;
+  atomic_llong commands;
+  atomic_llong data;
+  atomic_llong sleep_us;
+  atomic_llong flushes;
+  atomic_llong resyncs;
+  } LCD8574Counters;
+
+#define LCD_COUNT(self, counter, n) \
+  atomic_fetch_add_explicit (&(self)->counters.counter, (n), \
+    memory_order_relaxed)
+
+// The default limit on the length of a single I2C message. The I2C
+//  adapter might have a lower limit than its driver can report, so 
+//  this value can be changed with lcd8574_set_max_msg()
+#define LCD_MSG_MAX 8192
+
 struct _LCD8574
   {
   int i2c_addr;
-  int fd; // For the /dev/i2c-1 device
+  char *dev; // I2C device for the private bus, if there's no shared one
+  LCD8574Bus *bus; // The bus the PCF8574 is on
+  const Transport *transport; // For the private bus
+  BOOL own_bus; // Set if we created the bus, rather than the caller
   int rows; int cols;
+  int row_addr[LCD_ROWS_MAX]; // DDRAM address of the start of each row
+  int ctl_rows; // The rows this controller drives -- all of them, usually
+  LCD8574 *lower; // The controller for the lower rows of a 40x4, or NULL
   BOOL ready;
+  int max_msg; // Longest message we'll offer to the I2C adapter
+  BYTE tx[LCD_TX_MAX]; // PCF8574 bytes waiting to be sent
+  int tx_len;
+  int tx_wait; // Execution time of the last byte in the tx buffer, usec
+  int tx_commands, tx_data; // What's in the tx buffer, for the counters
+  LCD8574Seg segs[LCD_SEG_MAX]; // Completed segments of the tx buffer
+  int nsegs;
+  int seg_next; // The next segment to send
+  long long ready_at; // Monotonic time (usec) when the LCD will be idle
+  LCD8574Timing timing;
+  LCD8574Wiring wiring;
+  BYTE port[2][2][16]; // PCF8574 output byte for each [rs][e][nibble]
+  BYTE port_idle; // Output byte with E low and data lines released 
+  BOOL busy_poll; // Read the busy flag, rather than waiting for ready_at
+  BOOL fault; // Set when a transaction fails, until we resync the module
+  BOOL warm; // Try to take over the module as it is, in lcd8574_init()
+  char *state_file; // Where the state is left for the next process, or NULL
+  LCD8574Frame frames[LCD_FRAMES]; 
+  int back; // The frame the application draws into -- the shadow
+  int front; // The frame the writer thread is sending
+  atomic_int published; // Index of the latest frame, with LCD_FRAME_NEW 
+  int ddram[LCD_DDRAM_SIZE]; // What we think is in the LCD module's DDRAM
+  int ac; // The LCD module's address counter, or -1 if we don't know
+  int mode; // The display mode last sent, or -1 if we don't know
+  int shift; // How many places the display has been shifted left
+  BYTE cgram[LCD_GLYPHS][8]; // What we think is in the module's CGRAM
+  int cgram_known; // Bit mask of the CGRAM glyphs we know 
+  unsigned glyph_used[LCD_GLYPHS]; // When each glyph was last asked for
+  unsigned glyph_clock;
+  BOOL async; // Set if a writer thread is sending frames
+  pthread_t writer;
+  sem_t kick; // Posted when a frame is published
+  atomic_int stop; // Set to make the writer thread exit
+  int rt_priority; // SCHED_FIFO priority of the writer thread, or 0
+  int rt_cpu; // The CPU the writer thread is pinned to, or -1
+  BOOL rt_lock; // Lock the process's memory when the writer starts
+  int rom; // The LCD module's character ROM, CHARMAP_A00 or CHARMAP_A02
+  LCD8574Counters counters;
+  Histogram *hist; // One for each LCD8574_OP_XXX, or NULL if not enabled
+  Trace *trace; // Every PCF8574 byte, or NULL if not enabled. The lower
+    // controller of a 40x4 module shares the upper one's
+  BYTE trace_e; // The trace flag for our E line, TRACE_E or TRACE_E2
+  };
+
+// The names of the operations, for lcd8574_write_histograms()
+static const char *const lcd8574_op_names[LCD8574_OP_COUNT] =
+  {
+  "write_string", "clear", "set_mode", "flush", "init"
   };
 
+static void lcd8574_use_wiring (LCD8574 *self, const LCD8574Wiring *w);
+
 /*============================================================================
   lcd8574_create
 ============================================================================*/
 LCD8574  *lcd8574_create (int i2c_addr, int rows, int cols)
   {
+  return lcd8574_create_dev (I2C_DEV, i2c_addr, rows, cols);
+  }
+
+/*============================================================================
+  lcd8574_create_dev
+============================================================================*/
+LCD8574  *lcd8574_create_dev (const char *dev, int i2c_addr, int rows, 
+            int cols)
+  {
+  assert (dev != NULL);
   LCD8574 *self = malloc (sizeof (LCD8574));
   memset (self, 0, sizeof (LCD8574));
+  self->dev = strdup (dev);
   self->i2c_addr = i2c_addr;
-  self->fd = -1;
   self->ready = FALSE;
   self->rows = rows;
   self->cols = cols;
+  self->ctl_rows = rows;
+  for (int r = 0; r < LCD_ROWS_MAX; r++)
+    self->row_addr[r] = (r & 1) * LCD_CHARS_PER_ROW + (r >> 1) * cols;
+  self->max_msg = LCD_MSG_MAX;
+  self->timing = *LCD_DEFAULT_TIMING;
+  lcd8574_use_wiring (self, LCD_DEFAULT_WIRING);
+  for (int i = 0; i < LCD_FRAMES; i++)
+    {
+    LCD8574Frame *f = &self->frames[i];
+    f->cells = malloc (rows * cols);
+    memset (f->cells, ' ', rows * cols);
+    f->cursor_row = -1;
+    f->cursor_col = -1;
+    f->mode = LCD_UNKNOWN;
+    f->marquee_row = -1;
+    }
+  self->back = 0;
+  self->front = 1;
+  atomic_init (&self->published, 2);
+  self->ac = LCD_UNKNOWN;
+  self->mode = LCD_UNKNOWN;
+  self->rt_cpu = -1;
+  self->rom = CHARMAP_A00;
+  self->trace_e = TRACE_E;
+  // We know nothing about the LCD module's DDRAM until it is cleared
+  for (int i = 0; i < LCD_DDRAM_SIZE; i++)
+    self->ddram[i] = LCD_UNKNOWN;
   return self;
   }
 
@@ -139,10 +519,66 @@ void lcd8574_destroy (LCD8574 *self)
   if (self)
     {
     lcd8574_uninit (self);
+    if (self->bus)
+      {
+      LCD8574Bus *bus = self->bus;
+      for (int i = 0; i < bus->nmembers; i++)
+        {
+        if (bus->members[i] == self)
+          {
+          bus->members[i] = bus->members[--bus->nmembers];
+          break;
+          }
+        }
+      }
+    for (int i = 0; i < LCD_FRAMES; i++)
+      free (self->frames[i].cells);
+    free (self->hist);
+    trace_destroy (self->trace);
+    free (self->state_file);
+    free (self->dev);
     free (self);
     }
   }
 
+/*============================================================================
+
+  lcd8574_now_ns
+
+============================================================================*/
+static long long lcd8574_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  lcd8574_hist_start
+
+  Get the time at the start of an operation, if we're recording 
+  histograms. Otherwise, don't bother reading the clock.
+
+============================================================================*/
+static long long lcd8574_hist_start (const LCD8574 *self)
+  {
+  return self->hist ? lcd8574_now_ns () : 0;
+  }
+
+/*============================================================================
+
+  lcd8574_hist_end
+
+  Record the time since an operation started
+
+============================================================================*/
+static void lcd8574_hist_end (LCD8574 *self, int op, long long start)
+  {
+  if (self->hist && start)
+    histogram_record (&self->hist[op], lcd8574_now_ns () - start);
+  }
+
 /*============================================================================
 
   lcd8574_set_bit_value
@@ -162,246 +598,3070 @@ static BYTE lcd8574_set_bit_value (BYTE b, int bit, BOOL val)
 
 /*============================================================================
 
-  lcd8574_send_4_bits
+  lcd8574_now_us
 
-  Here's the sequence:
-  
-  1. Ensure the backlight LED line is on, if a value was specified for it
-  2. Set the register select bit, if the caller requires this (this selects
-     between command and data registers)
-  3. Send the four-bit command and the other (register, backlight) 
-     bits on an 8-bit write to the PCF8574, with the E (clock) bit
-     high 
-  3. Repeat with the clock bit low 
+  Monotonic time in microseconds
 
-  This is bit fiddly, because we have to write the PCF8574 in 8-bit
-  words. What we really want to do is set the RS, LED, and data bits,
-  then pulse the E (clock) bit. But we can't, because we can only 
-  change the set of 8 PCF8574 outputs in a single operation.
+============================================================================*/
+static long long lcd8574_now_us (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+
+  lcd8574_exec_time
+
+  Look up how long the LCD module needs to execute the byte n. If rs is 
+  set, n is data, else it is an instruction.
 
 ============================================================================*/
-static void lcd8574_send_4_bits (LCD8574 *self, BOOL rs, BYTE n)
+static int lcd8574_exec_time (const LCD8574 *self, BOOL rs, BYTE n)
   {
-  BYTE b = (n << 4) & 0xF0;
+  if (rs) return self->timing.exec_us[LCD_T_DATA];
+  if (n == 0) return 0;
+  return self->timing.exec_us[31 - __builtin_clz (n)];
+  }
 
-  if (PIN_LED > 0)
-    b = lcd8574_set_bit_value (b, PIN_LED, 1);
-  b = lcd8574_set_bit_value (b, PIN_RS, rs);
+/*============================================================================
+
+  lcd8574_bus_xfer
 
-  // I think we don't need to set E (clock) low every time a command
-  //  is sent. It starts off low, then gets pulse high and then low
-  //  by this method. So long as we don't accidentally set it high
-  //  anywhere else, we don't need to set it low repeatedly. This saves
-  //  a couple of milliseconds on each command.
-  //b = lcd8574_set_bit_value (b, PIN_E, 0);
-  //write (self->fd, &b, 1);
-  //usleep (1000);
+  Carry out a set of I2C messages (at most I2C_RDWR_IOCTL_MAX_MSGS) as
+  one transaction, using the bus's transport, holding the bus lock so
+  that transactions for the displays that share the bus don't 
+  interleave. Each message carries its own slave address; how that 
+  gets to the adapter is the transport's business (see transport.c).
 
-  b = lcd8574_set_bit_value (b, PIN_E, 1);
-  write (self->fd, &b, 1);
-  usleep (1000);
-  b = lcd8574_set_bit_value (b, PIN_E, 0);
-  write (self->fd, &b, 1);
-  usleep (1000);
+  Returns FALSE if any part of the transaction failed. 
+
+============================================================================*/
+static BOOL lcd8574_bus_xfer (LCD8574Bus *self, struct i2c_msg *msgs, int n)
+  {
+  pthread_mutex_lock (&self->lock);
+  BOOL ok = self->transport->xfer (self->handle, msgs, n);
+  pthread_mutex_unlock (&self->lock);
+  return ok;
   }
 
 /*============================================================================
 
-  lcd8574_send_byte
+  lcd8574_port_nibble
 
-  To send a byte in 4-bit mode, we send the high four bits and then the
-  low four bits.
+  Extract the four data bits from a byte read from the PCF8574 
 
 ============================================================================*/
-static void lcd8574_send_byte (LCD8574 *self, BOOL rs, BYTE n)
+static BYTE lcd8574_port_nibble (const LCD8574 *self, BYTE port)
   {
-  lcd8574_send_4_bits (self, rs, (n >> 4) & 0x0F);
-  lcd8574_send_4_bits (self, rs, n & 0x0F);
+  const LCD8574Wiring *w = &self->wiring;
+  return ((port >> w->d4) & 1) | ((port >> w->d5) & 1) << 1
+    | ((port >> w->d6) & 1) << 2 | ((port >> w->d7) & 1) << 3;
   }
 
 /*============================================================================
 
-  lcd8574_write_char_at
+  lcd8574_trace_xfer
 
-  Use the SET_DDRAM_ADDR command to the LCD module to set the 
-  memory address where the char will be written. The send the 
-  char as a byte, with the register-select bit high to indicate this
-  is data, not a command. 
+  Record each byte of a transaction in the trace ring, with the control
+  lines and the data nibble decoded, according to the wiring. Our E
+  line is recorded as TRACE_E2 if we're the lower controller of a 40x4
+  module, so its bytes can be told apart from the upper one's.
 
 ============================================================================*/
-void lcd8574_write_char_at (LCD8574 *self, int row, int col, BYTE c)
+static void lcd8574_trace_xfer (LCD8574 *self, const struct i2c_msg *msgs,
+    int n, long long start, BOOL ok)
   {
-  if (row < self->rows && col < self->cols)
+  const LCD8574Wiring *w = &self->wiring;
+  BYTE flags = TRACE_XFER | (ok ? 0 : TRACE_FAILED);
+  for (int i = 0; i < n; i++)
     {
-    int addr = row * LCD_CHARS_PER_ROW + col; 
-    lcd8574_send_byte (self, 0, CMD_SET_DDRAM_ADDR | addr);
-    lcd8574_send_byte (self, 1, c);
+    flags |= TRACE_MSG;
+    if (msgs[i].flags & I2C_M_RD) flags |= TRACE_READ;
+    for (int j = 0; j < msgs[i].len; j++)
+      {
+      BYTE port = msgs[i].buf[j];
+      BYTE f = flags;
+      if ((port >> w->rs) & 1) f |= TRACE_RS;
+      if (w->rw >= 0 && ((port >> w->rw) & 1)) f |= TRACE_RW;
+      if ((port >> w->e) & 1) f |= self->trace_e;
+      trace_record (self->trace, (uint32_t)start, port, 
+        lcd8574_port_nibble (self, port), f);
+      flags &= TRACE_READ;
+      }
+    flags = 0;
     }
   }
 
 /*============================================================================
 
-  lcd8574_write_string_at
+  lcd8574_xfer
 
-  Write a whole string, wrapping if necessary. The slightly convoluted
-  logic is because the rows of characters are not contiguous in the LCD
-  module's memory. Repeated calls to write_char_at would be easier
-  to implement, but would send a "set address" command for each character,
-  which is wasteful. We only want to set a new address when the text
-  wraps to another line.
+  Carry out a transaction with the display's PCF8574, and count it
 
 ============================================================================*/
-void lcd8574_write_string_at (LCD8574 *self, int row, int col, const BYTE *s,
-        BOOL wrap)
+static BOOL lcd8574_xfer (LCD8574 *self, struct i2c_msg *msgs, int n)
   {
-  if (row < self->rows && col < self->cols)
+  int bytes = 0;
+  for (int i = 0; i < n; i++)
+    if (!(msgs[i].flags & I2C_M_RD)) bytes += msgs[i].len;
+  long long start = self->trace ? lcd8574_now_us () : 0;
+  BOOL ok = lcd8574_bus_xfer (self->bus, msgs, n);
+  if (self->trace) lcd8574_trace_xfer (self, msgs, n, start, ok);
+  LCD_COUNT (self, xfers, 1);
+  LCD_COUNT (self, bytes, bytes);
+  if (!ok) 
     {
-    int addr = row * LCD_CHARS_PER_ROW + col; 
-    lcd8574_send_byte (self, 0, CMD_SET_DDRAM_ADDR | addr);
-    while (*s && row < self->rows && col < self->cols)
-      {
-      lcd8574_send_byte (self, 1, *s);
-      col++;
-      if (col >= self->cols && wrap)
-	{
-	row++;
-	col = 0;
-	addr = row * LCD_CHARS_PER_ROW + col; 
-	lcd8574_send_byte (self, 0, CMD_SET_DDRAM_ADDR | addr);
-	}
-      s++;
-      }
+    LCD_COUNT (self, failed, 1);
+    self->fault = TRUE;
     }
+  return ok;
   }
 
 /*============================================================================
 
-  lcd8574_clear
+  lcd8574_sleep
 
-  Just send the clear command.
+  Sleep while the LCD module is busy, and count the time 
 
 ============================================================================*/
-void lcd8574_clear (LCD8574 *self)
+static void lcd8574_sleep (LCD8574 *self, long long us)
   {
-  lcd8574_send_byte (self, 0, CMD_CLEAR);
+  usleep (us);
+  LCD_COUNT (self, sleep_us, us);
   }
 
 /*============================================================================
 
-  lcd8574_set_cursor
- 
-  This is a bit hacky, because the HD44780 does have a "move cursor"
-  function. The cursor goes right of the last text. So we print an invisible
-  null at the cursor position. The null doesn't print anything (and any
-  existing character is left alone), but the cursor is placed it
-  the specified position. To be frank, I don't know whether all HD44780
-  implementations support this. 
+  lcd8574_read_byte
+
+  Read a byte from the LCD module -- the busy flag and address counter
+  if rs is 0, or the data at the address counter if rs is 1. We set 
+  the data lines high, so the PCF8574 is just weakly pulling them up,
+  and the LCD module can drive them, then set RW high and clock E. In
+  4-bit mode, the upper nibble comes first, and we must clock E again
+  for the lower nibble, even if we don't want it, or the module will 
+  lose its nibble alignment. Finally RW is set low again, before 
+  anything else can raise E. 
+
+  All of this goes into a single transaction. Returns FALSE if the 
+  PCF8574 could not be read.
 
 ============================================================================*/
-void lcd8574_set_cursor (LCD8574 *self, int row, int col)
+static BOOL lcd8574_read_byte (LCD8574 *self, BOOL rs, BYTE *val)
   {
-  lcd8574_write_string_at (self, row, col, (BYTE *)"\0", TRUE);
+  BYTE base = lcd8574_set_bit_value (self->port_idle, self->wiring.rs, rs);
+  BYTE rd = lcd8574_set_bit_value (base, self->wiring.rw, 1);
+  BYTE rd_e = lcd8574_set_bit_value (rd, self->wiring.e, 1);
+
+  BYTE out1[2] = { rd, rd_e };
+  BYTE out2[2] = { rd, rd_e };
+  BYTE out3[2] = { rd, base };
+  BYTE in1 = 0, in2 = 0;
+
+  struct i2c_msg msgs[5] = 
+    {
+    { self->i2c_addr, 0, sizeof (out1), out1 },
+    { self->i2c_addr, I2C_M_RD, 1, &in1 },
+    { self->i2c_addr, 0, sizeof (out2), out2 },
+    { self->i2c_addr, I2C_M_RD, 1, &in2 },
+    { self->i2c_addr, 0, sizeof (out3), out3 },
+    };
+  if (!lcd8574_xfer (self, msgs, 5)) return FALSE;
+
+  *val = (lcd8574_port_nibble (self, in1) << 4) 
+    | lcd8574_port_nibble (self, in2);
+  return TRUE;
   }
 
 /*============================================================================
 
-  lcd8574_set_mode
+  lcd8574_read_busy
 
-  Just send a "control register" command, with the mode bits specified
-  by the caller.
+  Read the busy flag and the address counter. Returns 1 if the LCD 
+  module is busy, 0 if it is not, or -1 if the flag could not be read.
+  If addr is not NULL, it is written with the address counter.
 
 ============================================================================*/
-void lcd8574_set_mode (LCD8574 *self, BYTE mode)
+static int lcd8574_read_busy (LCD8574 *self, int *addr)
   {
-  lcd8574_send_byte (self, 0, CMD_CTRL | mode);
+  BYTE val;
+  if (!lcd8574_read_byte (self, 0, &val)) return -1;
+  if (addr) *addr = val & 0x7F;
+  return (val & 0x80) ? 1 : 0;
   }
 
 /*============================================================================
 
-  lcd8574_init
+  lcd8574_wait_ready
 
-  Initialize the display module
+  Sleep until the LCD module has finished executing whatever we last
+  sent it. Because we track the time at which this will be, we don't
+  sleep at all if the caller has been busy with other things in the
+  meantime.
+
+  If busy-flag polling is enabled, then we poll the flag instead of
+  sleeping, so we can carry on as soon as the module is really done.
+  Each poll takes a good few hundred usec on the bus, so there's no
+  need to sleep between polls. If the PCF8574 can't be read, we fall
+  back to timed delays for good.
 
 ============================================================================*/
-BOOL lcd8574_init (LCD8574 *self, char **error)
+static void lcd8574_wait_ready (LCD8574 *self)
   {
-  assert (self != NULL);
-  int ret = FALSE;
-  // See if we can open the I2C device
-  self->fd = open (I2C_DEV, O_WRONLY);
-  if (self->fd >= 0)
+  long long now = lcd8574_now_us();
+  if (self->ready_at <= now) return;
+
+  if (self->busy_poll)
     {
-    // Set the I2C slave address that was supplied when this
-    //   object was created
-    if (ioctl (self->fd, I2C_SLAVE, self->i2c_addr) >= 0)
+    long long give_up = self->ready_at + LCD_BUSY_TIMEOUT_US;
+    int busy;
+    while ((busy = lcd8574_read_busy (self, NULL)) > 0 
+        && lcd8574_now_us() < give_up)
+      ;
+    if (busy >= 0) 
       {
-      // Set all output PCF8574 lines to zero, because we don't really know
-      //  how they will power up
-      BYTE c = 0;
-      write (self->fd, &c, 1);
-      usleep (35000);
+      self->ready_at = 0;
+      return;
+      }
+    self->busy_poll = FALSE;
+    now = lcd8574_now_us();
+    }
 
-      // Now... this is all a bit nasty...
-      // We need to set 4-bit mode, but the LCD module powers up in 
-      //  eight bit mode. We can't be sure this is the first program
-      //  to use the LCD since power-up, so we don't know what 
-      //  mode it's in. And we need to issue a command to set 4-bit
-      //  mode -- without knowing what mode we're in. So first we have
-      //  to enable 8-bit mode and then, knowing we're in 8-bit mode,
-      //  we must set 4-bit mode. Setting 8-bit mode without knowing the
-      //  current mode can be accomplished by sending the mode-setting
-      //  command as three identical 4-bit commands. If we start in 
-      //  8-bit mode, some of these commands are gibberish 8-bit 
-      //  commands with four of their bits set wrongly. But there's still
-      //  enough coherence for the module to get the message with thi
-      //  command sequence. This method of setting the mode is widely
-      //  used, even though it isn't documented, and it seems to work OK. 
+  long long wait = self->ready_at - now;
+  if (wait > 0) lcd8574_sleep (self, wait);
+  }
 
-      BYTE func = CMD_FUNC | LCD_FUNC_DL; // Set 8-bit mode
-      lcd8574_send_4_bits (self, 0, func >> 4); usleep (35000);
-      lcd8574_send_4_bits (self, 0, func >> 4); usleep (35000);
-      lcd8574_send_4_bits (self, 0, func >> 4); usleep (35000);
-      func = CMD_FUNC | 0; // Set 4-bit mode
-      lcd8574_send_4_bits (self, 0, func >> 4); usleep (35000);
+/*============================================================================
 
-      // Set more than one row (the LCD only has two line modes, 
-      //  "one" or "more that one")
-      func = CMD_FUNC | LCD_FUNC_N ;
-      // NB -- send_byte sends two 4-bit commands in a row
-      lcd8574_send_byte (self, 0, func); 
+  lcd8574_use_wiring
 
-      // Clear display 
-      lcd8574_clear (self);
-      lcd8574_set_mode (self, LCD_MODE_DISPLAY_ON);
+  Select a wiring profile, and work out the PCF8574 output byte for 
+  every combination of register select, clock, and data nibble. Here's 
+  what each byte contains:
+  
+  1. The backlight LED line on, if a value was specified for it
+  2. The register select bit, if the caller requires this (this selects
+     between command and data registers)
+  3. The clock (E) bit
+  4. The four-bit data
 
-      // We might want to set the cursor and shift modes -- but, honestly,
-      //   it's more likely that the user of this class will take care of 
-      //   these things. 
-      //lcd8574_send_byte (self, 0, CMD_ENTRY | LCD_ENTRY_ID);
-      //lcd8574_send_byte (self, 0, CMD_CDSHIFT | LCD_CDSHIFT_RL);
+  This is bit fiddly, because we have to write the PCF8574 in 8-bit
+  words. What we really want to do is set the RS, LED, and data bits,
+  then pulse the E (clock) bit. But we can't, because we can only 
+  change the set of 8 PCF8574 outputs in a single operation. Doing all
+  the fiddling here means that encoding a byte for the LCD module
+  is just a few table lookups.
 
-      ret = TRUE;
-      self->ready = TRUE;
+============================================================================*/
+static void lcd8574_use_wiring (LCD8574 *self, const LCD8574Wiring *w)
+  {
+  self->wiring = *w;
+  BYTE led = 0;
+  if (w->led >= 0)
+    led = lcd8574_set_bit_value (0, w->led, !w->led_active_low);
+  for (int rs = 0; rs < 2; rs++)
+    {
+    for (int e = 0; e < 2; e++)
+      {
+      for (int n = 0; n < 16; n++)
+        {
+        BYTE b = led;
+        b = lcd8574_set_bit_value (b, w->rs, rs);
+        b = lcd8574_set_bit_value (b, w->e, e);
+        b = lcd8574_set_bit_value (b, w->d4, n & 0x01);
+        b = lcd8574_set_bit_value (b, w->d5, n & 0x02);
+        b = lcd8574_set_bit_value (b, w->d6, n & 0x04);
+        b = lcd8574_set_bit_value (b, w->d7, n & 0x08);
+        self->port[rs][e][n] = b;
+        }
       }
-    else
+    }
+  // To read from the LCD module, the PCF8574 outputs on the data lines
+  //  must be high, so they are only weakly pulled up
+  self->port_idle = self->port[0][0][0x0F];
+  }
+
+/*============================================================================
+
+  lcd8574_encode_4_bits
+
+  Look up the two bytes that send a nibble to the LCD module: one with
+  E high, then one with E low. The module latches the data on the 
+  falling edge of E. 
+
+  I think we don't need to set E (clock) low every time a command
+  is sent. It starts off low, then gets pulse high and then low
+  by this method. So long as we don't accidentally set it high
+  anywhere else, we don't need to set it low repeatedly. This saves
+  a couple of milliseconds on each command.
+
+  The two bytes are written to out, and the number of bytes (always 2)
+  is returned, so callers can build up a longer sequence in one buffer.
+
+============================================================================*/
+static int lcd8574_encode_4_bits (const LCD8574 *self, BOOL rs, BYTE n, 
+    BYTE *out)
+  {
+  const BYTE (*t)[16] = self->port[rs != 0];
+  out[0] = t[1][n & 0x0F];
+  out[1] = t[0][n & 0x0F];
+  return 2;
+  }
+
+/*============================================================================
+
+  lcd8574_tx_send
+
+  Send bytes (usually part of the transmit buffer) to the PCF8574. We do 
+  this in one I2C transaction, split into as many messages as the
+  adapter's message size limit requires, unless there are too many 
+  messages for one transaction. The PCF8574 doesn't care whether it gets its bytes in 
+  one message or several -- it just latches each byte onto its outputs 
+  as it arrives.
+
+============================================================================*/
+static void lcd8574_tx_send (LCD8574 *self, const BYTE *buff, int len)
+  {
+  int max = self->max_msg;
+  int done = 0;
+  while (done < len)
+    {
+    struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    int nmsgs = 0;
+    while (done < len && nmsgs < I2C_RDWR_IOCTL_MAX_MSGS)
       {
-      asprintf (error, "Can't intialize I2C device: %s", strerror (errno));
+      int n = len - done;
+      if (n > max) n = max;
+      msgs[nmsgs].addr = self->i2c_addr;
+      msgs[nmsgs].flags = 0;
+      msgs[nmsgs].len = n;
+      msgs[nmsgs].buf = (BYTE *)buff + done;
+      nmsgs++;
+      done += n;
       }
+    lcd8574_xfer (self, msgs, nmsgs);
     }
-  else
+  }
+
+/*============================================================================
+
+  lcd8574_tx_mark
+
+  End the current segment of the transmit buffer, noting how long the
+  LCD will need to execute the last instruction in it.
+
+============================================================================*/
+static void lcd8574_tx_mark (LCD8574 *self)
+  {
+  int start = self->nsegs ? self->segs[self->nsegs - 1].end : 0;
+  if (self->tx_len == start) return;
+  self->segs[self->nsegs].end = self->tx_len;
+  self->segs[self->nsegs].wait = self->tx_wait;
+  self->nsegs++;
+  self->tx_wait = 0;
+  }
+
+/*============================================================================
+
+  lcd8574_tx_run_one
+
+  Send the next segment of the transmit buffer (the caller will have
+  made sure the LCD is ready for it), and note the time at which the
+  LCD will have finished executing it.
+
+============================================================================*/
+static void lcd8574_tx_run_one (LCD8574 *self)
+  {
+  const LCD8574Seg *seg = &self->segs[self->seg_next];
+  int start = self->seg_next ? self->segs[self->seg_next - 1].end : 0;
+  lcd8574_tx_send (self, self->tx + start, seg->end - start);
+  self->ready_at = lcd8574_now_us() + seg->wait;
+  self->seg_next++;
+  }
+
+/*============================================================================
+
+  lcd8574_tx_flush
+
+  Send whatever is left in the transmit buffer, a segment at a time, 
+  waiting for the LCD to be ready for each one. Then empty the buffer.
+
+============================================================================*/
+static void lcd8574_tx_flush (LCD8574 *self)
+  {
+  lcd8574_tx_mark (self);
+  while (self->seg_next < self->nsegs)
     {
-    asprintf (error, "Can't open I2C device: %s", strerror (errno));
+    lcd8574_wait_ready (self);
+    lcd8574_tx_run_one (self);
     }
-  return ret;
+  self->tx_len = 0;
+  self->nsegs = 0;
+  self->seg_next = 0;
+  LCD_COUNT (self, commands, self->tx_commands);
+  LCD_COUNT (self, data, self->tx_data);
+  self->tx_commands = 0;
+  self->tx_data = 0;
   }
 
 /*============================================================================
-  lcd8574_uninit
+
+  lcd8574_gap_us
+
+  The time between one LCD byte and the next, when they're sent in the
+  same transaction, which depends on the transport
+
 ============================================================================*/
-void lcd8574_uninit (LCD8574 *self)
+static int lcd8574_gap_us (const LCD8574 *self)
   {
-  assert (self != NULL);
-  if (self->fd >= 0) close (self->fd);
-  self->ready = FALSE;
+  const Transport *t = self->bus ? self->bus->transport : self->transport;
+  if (!t) t = transport_default ();
+  return t->gap_us;
+  }
+
+/*============================================================================
+
+  lcd8574_tx_byte
+
+  Add the four PCF8574 bytes that send n to the LCD module to the 
+  transmit buffer. Nothing is written to the bus until the buffer
+  is full, or lcd8574_tx_flush() is called.
+
+  We don't need any delays between bytes that are sent this way,
+  if the previous byte executes in less time than it takes to get 
+  the next one onto the bus (see lcd8574_gap_us()). Most instructions
+  do, according to the datasheet. If the previous one doesn't -- clear
+  and home, or anything at all with a slow timing profile -- then 
+  that's the end of a segment, and the LCD must be given time to
+  execute it before the next segment is sent. 
+
+============================================================================*/
+static void lcd8574_tx_byte (LCD8574 *self, BOOL rs, BYTE n)
+  {
+  if (self->tx_len + 4 > LCD_TX_MAX)
+    lcd8574_tx_flush (self);
+  else if (self->tx_wait > lcd8574_gap_us (self))
+    lcd8574_tx_mark (self);
+  BYTE *p = self->tx + self->tx_len;
+  int len = lcd8574_encode_4_bits (self, rs, n >> 4, p);
+  len += lcd8574_encode_4_bits (self, rs, n, p + len);
+  self->tx_len += len;
+  self->tx_wait = lcd8574_exec_time (self, rs, n);
+  if (rs) self->tx_data++; else self->tx_commands++;
+  }
+
+/*============================================================================
+
+  lcd8574_send_4_bits
+
+  Send a single nibble, as one two-byte write to the PCF8574. This is only
+  needed during initialization, when the LCD module might be in 8-bit
+  mode, and the caller takes care of the (long) delays that follow. 
+
+  There's no need to sleep between the E-high and E-low bytes: the 
+  PCF8574 changes its outputs as each byte arrives, and at 100kHz one
+  byte takes about 90usec on the bus. That's far longer than the
+  minimum enable pulse width of the HD44780 (450nsec).
+
+============================================================================*/
+static void lcd8574_send_4_bits (LCD8574 *self, BOOL rs, BYTE n)
+  {
+  lcd8574_wait_ready (self);
+  BYTE buff[2];
+  int len = lcd8574_encode_4_bits (self, rs, n, buff);
+  struct i2c_msg msg = { self->i2c_addr, 0, len, buff };
+  lcd8574_xfer (self, &msg, 1);
   }
 
+/*============================================================================
+
+  lcd8574_send_byte
+
+  To send a byte in 4-bit mode, we send the high four bits and then the
+  low four bits. All four PCF8574 bytes (E-high and E-low for each nibble)
+  go out in a single transaction, so a byte costs one syscall. 
+
+  We don't wait for the instruction to execute here -- the next 
+  transaction will wait, if it comes along too soon.
+
+============================================================================*/
+static void lcd8574_send_byte (LCD8574 *self, BOOL rs, BYTE n)
+  {
+  lcd8574_tx_byte (self, rs, n);
+  lcd8574_tx_flush (self);
+  }
+
+/*============================================================================
+
+  lcd8574_cell_addr
+
+  Work out the DDRAM address of a particular character cell, when the 
+  display is shifted left by the specified number of places. The LCD
+  module's address counter is only seven bits wide. When the display is
+  shifted, each line wraps around within its 40 bytes of DDRAM. Returns
+  -1 if the cell doesn't have an address (because the display is 
+  wider than the module's lines, or has too many rows).
+
+============================================================================*/
+static int lcd8574_cell_addr (const LCD8574 *self, int row, int col, 
+    int shift)
+  {
+  if (row >= LCD_ROWS_MAX) return -1;
+  int start = self->row_addr[row] & (LCD_DDRAM_SIZE - 1); 
+  int line = start & ~(LCD_CHARS_PER_ROW - 1);
+  int off = start - line + col;
+  if (off >= LCD_LINE_LEN) return -1;
+  return line + (off + shift) % LCD_LINE_LEN;
+  }
+
+/*============================================================================
+
+  lcd8574_write_char_at
+
+  Store the character in the shadow framebuffer. Nothing is sent to the
+  LCD module until lcd8574_flush() is called.
+
+============================================================================*/
+void lcd8574_write_char_at (LCD8574 *self, int row, int col, BYTE c)
+  {
+  if (row >= 0 && col >= 0 && row < self->rows && col < self->cols)
+    self->frames[self->back].cells[row * self->cols + col] = c;
+  }
+
+/*============================================================================
+
+  lcd8574_write_string_at
+
+  Write a whole string into the shadow framebuffer, wrapping if 
+  necessary. 
+
+============================================================================*/
+void lcd8574_write_string_at (LCD8574 *self, int row, int col, const BYTE *s,
+        BOOL wrap)
+  {
+  long long start = lcd8574_hist_start (self);
+  if (row >= 0 && col >= 0 && row < self->rows && col < self->cols)
+    {
+    BYTE *cells = self->frames[self->back].cells;
+    while (*s && row < self->rows && col < self->cols)
+      {
+      cells[row * self->cols + col] = *s;
+      col++;
+      if (col >= self->cols && wrap)
+	{
+	row++;
+	col = 0;
+	}
+      s++;
+      }
+    }
+  lcd8574_hist_end (self, LCD8574_OP_WRITE, start);
+  }
+
+/*============================================================================
+
+  lcd8574_write_utf8_at
+
+  Like lcd8574_write_string_at(), but the string is UTF-8, and each 
+  character is written as whatever the module's ROM has for it. If 
+  the ROM doesn't have it, we try for a custom glyph, which will be 
+  uploaded on the next flush. A glyph is written into its cell as soon
+  as we have it, so the glyphs for later characters can't take its
+  slot. It's one pass over the string, and nothing is allocated.
+
+============================================================================*/
+void lcd8574_write_utf8_at (LCD8574 *self, int row, int col, const char *s,
+        BOOL wrap)
+  {
+  long long start = lcd8574_hist_start (self);
+  if (row >= 0 && col >= 0 && row < self->rows && col < self->cols)
+    {
+    BYTE *cells = self->frames[self->back].cells;
+    const BYTE *p = (const BYTE *)s;
+    while (*p && row < self->rows && col < self->cols)
+      {
+      int len;
+      uint32_t cp = charmap_utf8_next (p, &len);
+      p += len;
+      BYTE codes[CHARMAP_CODES_MAX];
+      int n = charmap_encode (self->rom, cp, codes);
+      if (n == 0)
+        {
+        const BYTE *bitmap = charmap_bitmap (cp);
+        int g = bitmap ? lcd8574_glyph (self, bitmap) : -1;
+        codes[0] = g >= 0 ? g : LCD_UTF8_MISSING;
+        n = 1;
+        }
+      for (int i = 0; i < n && row < self->rows && col < self->cols; i++)
+        {
+        cells[row * self->cols + col] = codes[i];
+        col++;
+        if (col >= self->cols && wrap)
+          {
+          row++;
+          col = 0;
+          }
+        }
+      }
+    }
+  lcd8574_hist_end (self, LCD8574_OP_WRITE, start);
+  }
+
+/*============================================================================
+
+  lcd8574_clear
+
+  Fill the shadow framebuffer with spaces. We don't send the clear 
+  command -- that would blank the whole display for 1.5msec, and then
+  the flush would have to rewrite every cell that isn't blank. Instead
+  the flush only has to write the cells that weren't already blank.
+
+============================================================================*/
+void lcd8574_clear (LCD8574 *self)
+  {
+  long long start = lcd8574_hist_start (self);
+  memset (self->frames[self->back].cells, ' ', self->rows * self->cols);
+  lcd8574_hist_end (self, LCD8574_OP_CLEAR, start);
+  }
+
+/*============================================================================
+
+  lcd8574_set_cursor
+ 
+  The HD44780 doesn't have a "move cursor" function -- the cursor 
+  is at whatever the current DDRAM address is. So we just record where 
+  the caller wants it, and the flush sets the DDRAM address there when 
+  it's finished writing text, if it isn't there already. 
+
+============================================================================*/
+void lcd8574_set_cursor (LCD8574 *self, int row, int col)
+  {
+  if (row >= 0 && col >= 0 && row < self->rows && col < self->cols)
+    {
+    LCD8574Frame *f = &self->frames[self->back];
+    f->cursor_row = row;
+    f->cursor_col = col;
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_next_addr
+
+  Work out the DDRAM address that follows addr, when the LCD module
+  increments its address counter after a write. 
+
+============================================================================*/
+static int lcd8574_next_addr (int addr)
+  {
+  if (addr == LCD_LINE_LEN - 1) return LCD_CHARS_PER_ROW;
+  if (addr == LCD_CHARS_PER_ROW + LCD_LINE_LEN - 1) return 0;
+  return addr + 1;
+  }
+
+/*============================================================================
+
+  lcd8574_addr_valid
+
+  Returns TRUE if the DDRAM address is one that the LCD module implements
+
+============================================================================*/
+static BOOL lcd8574_addr_valid (int addr)
+  {
+  return addr >= 0 && addr < LCD_DDRAM_SIZE 
+    && (addr % LCD_CHARS_PER_ROW) < LCD_LINE_LEN;
+  }
+
+/*============================================================================
+
+  lcd8574_bridge_len
+
+  Work out how many cells we would have to rewrite, to get the address
+  counter from where it is now to addr, by auto-increment. Returns -1 if
+  that's more than LCD_BRIDGE_MAX or, because we can only rewrite a cell
+  with what it already holds, if we don't know what any of them contain.
+
+============================================================================*/
+static int lcd8574_bridge_len (const LCD8574 *self, int addr)
+  {
+  int a = self->ac;
+  if (a == LCD_UNKNOWN) return -1;
+  int len = 0;
+  while (a != addr)
+    {
+    if (len >= LCD_BRIDGE_MAX || self->ddram[a] == LCD_UNKNOWN) return -1;
+    a = lcd8574_next_addr (a);
+    len++;
+    }
+  return len;
+  }
+
+/*============================================================================
+
+  lcd8574_marquee_shifted
+
+  Whether the marquee in a frame, if it's on this controller, is to be
+  scrolled by shifting the display. The LCD module shifts every row
+  of a controller together, so that's only worth doing if the other 
+  rows are blank: otherwise, holding them still would mean rewriting 
+  all their cells every step, which costs more than just rewriting the
+  marquee row, with the display unshifted.
+
+============================================================================*/
+static BOOL lcd8574_marquee_shifted (const LCD8574 *self, 
+    const LCD8574Frame *f)
+  {
+  if (f->marquee_row < 0 || f->marquee_row >= self->ctl_rows) return FALSE;
+  for (int row = 0; row < self->ctl_rows; row++)
+    {
+    if (row == f->marquee_row) continue;
+    const BYTE *cells = f->cells + row * self->cols;
+    for (int col = 0; col < self->cols; col++)
+      if (cells[col] != ' ') return FALSE;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_plan_frame
+
+  Work out how to send to the LCD module the cells of a frame that are
+  different from what we know to be in the module's DDRAM, using as few
+  bytes as we can, and put those bytes in the transmit buffer. Sending 
+  them is the caller's job. 
+
+  We work in DDRAM address order, rather than row and column order, 
+  because that's the order in which the LCD module's address counter 
+  moves as characters are written. Where one row ends at the address 
+  where another begins, a run of changed cells can continue from one
+  to the other without a new address. Otherwise, each run of changed
+  cells starts with a set-address command, unless the address counter
+  is already in the right place (which it often is, if the last flush
+  ended just before this run), or it's cheaper to rewrite the unchanged 
+  cells in between.
+
+  The cost of the address command we'd have to send when text reaches
+  the end of a row (which lcd8574_write_string_at() used to do when
+  wrapping) is accounted for in the same way -- it's just another
+  place where the address doesn't follow on.
+
+============================================================================*/
+static void lcd8574_plan_frame (LCD8574 *self, const LCD8574Frame *f)
+  {
+  LCD_COUNT (self, flushes, 1);
+  BOOL shifted = lcd8574_marquee_shifted (self, f);
+  int shift = f->shift;
+  if (f->marquee_row >= 0 && f->marquee_row < self->ctl_rows && !shifted)
+    shift = 0;
+  // Custom characters first, so that they are correct as soon as the
+  //  cells that use them are written. The CGRAM address increments just
+  //  as the DDRAM address does, so glyphs in consecutive slots go in one
+  //  run. Afterwards, the address counter is in CGRAM, so we'll need a
+  //  new DDRAM address before writing any text.
+  int cg_next = -1;
+  for (int g = 0; g < LCD_GLYPHS; g++)
+    {
+    int bit = 1 << g;
+    if (!(f->cgram_used & bit)) continue;
+    if ((self->cgram_known & bit) 
+        && memcmp (self->cgram[g], f->cgram[g], 8) == 0) 
+      continue;
+    if (cg_next != g)
+      lcd8574_tx_byte (self, 0, CMD_SET_CGRAM_ADDR | (g * 8));
+    for (int i = 0; i < 8; i++)
+      lcd8574_tx_byte (self, 1, f->cgram[g][i]);
+    memcpy (self->cgram[g], f->cgram[g], 8);
+    self->cgram_known |= bit;
+    self->ac = LCD_UNKNOWN;
+    cg_next = g + 1;
+    }
+
+  // What the shadow framebuffer wants in each DDRAM cell, if anything
+  int want[LCD_DDRAM_SIZE];
+  for (int i = 0; i < LCD_DDRAM_SIZE; i++)
+    want[i] = LCD_UNKNOWN;
+  for (int row = 0; row < self->ctl_rows; row++)
+    {
+    for (int col = 0; col < self->cols; col++)
+      {
+      int addr = lcd8574_cell_addr (self, row, col, shift);
+      if (lcd8574_addr_valid (addr)) 
+        want[addr] = f->cells[row * self->cols + col];
+      }
+    }
+
+  // A marquee that's scrolled by shifting the display also wants the 
+  //  off-screen part of its line to hold the text that's coming next, 
+  //  unless some other row of the display is using it. The cells are 
+  //  indexed from the shift, not the text position, so when the 
+  //  marquee moves on one place, only the cell that has just scrolled 
+  //  off the screen needs to be reloaded, even when the text wraps. 
+  if (shifted)
+    {
+    int start = lcd8574_cell_addr (self, f->marquee_row, 0, 0);
+    int line = start & ~(LCD_CHARS_PER_ROW - 1);
+    for (int k = 0; k < LCD_LINE_LEN; k++)
+      {
+      int addr = line + (start - line + shift + k) % LCD_LINE_LEN;
+      if (want[addr] == LCD_UNKNOWN)
+        want[addr] = f->marquee[(f->marquee_pos + k) % f->marquee_len];
+      }
+    }
+
+  int addr = 0;
+  for (int i = 0; i < LCD_DDRAM_CELLS; i++, addr = lcd8574_next_addr (addr))
+    {
+    int c = want[addr];
+    if (c == LCD_UNKNOWN || c == self->ddram[addr]) continue;
+    if (self->ac != addr)
+      {
+      if (lcd8574_bridge_len (self, addr) >= 0)
+        {
+        while (self->ac != addr)
+          {
+          lcd8574_tx_byte (self, 1, self->ddram[self->ac]);
+          self->ac = lcd8574_next_addr (self->ac);
+          }
+        }
+      else
+        lcd8574_tx_byte (self, 0, CMD_SET_DDRAM_ADDR | addr);
+      }
+    lcd8574_tx_byte (self, 1, c);
+    self->ddram[addr] = c;
+    self->ac = lcd8574_next_addr (addr);
+    }
+
+  // Shift the display last, so that text coming onto the screen has 
+  //  already been written off-screen. The display can be shifted in 
+  //  either direction, so take the shorter way round.
+  if (shift != self->shift)
+    {
+    int left = (shift - self->shift + LCD_LINE_LEN) % LCD_LINE_LEN;
+    BYTE cmd = CMD_CDSHIFT | LCD_CDSHIFT_SC;
+    int n = left;
+    if (left > LCD_LINE_LEN / 2)
+      {
+      cmd |= LCD_CDSHIFT_RL;
+      n = LCD_LINE_LEN - left;
+      }
+    for (int i = 0; i < n; i++)
+      lcd8574_tx_byte (self, 0, cmd);
+    self->shift = shift;
+    }
+
+  // If the cursor is on the other controller of a 40x4 module, it 
+  //  mustn't show on this one as well
+  int mode = f->mode;
+  if (mode != LCD_UNKNOWN && f->cursor_row >= self->ctl_rows)
+    mode &= ~(LCD_MODE_CURSOR_ON | LCD_MODE_CURSOR_BLINK);
+  if (mode != LCD_UNKNOWN && mode != self->mode)
+    {
+    lcd8574_tx_byte (self, 0, CMD_CTRL | mode);
+    self->mode = mode;
+    }
+
+  // Writing text moves the cursor, so put it back
+  if (f->cursor_row >= 0 && f->cursor_row < self->ctl_rows)
+    {
+    int addr = lcd8574_cell_addr (self, f->cursor_row, f->cursor_col, shift);
+    if (addr >= 0 && self->ac != addr)
+      lcd8574_tx_byte (self, 0, CMD_SET_DDRAM_ADDR | addr);
+    self->ac = addr;
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_split_frame
+
+  Copy the part of a frame that the lower controller of a 40x4 module
+  shows to that controller's own frame. Both controllers get the custom
+  characters, but only the one with the marquee needs to be shifted.
+
+============================================================================*/
+static void lcd8574_split_frame (LCD8574 *self, const LCD8574Frame *f)
+  {
+  LCD8574 *lower = self->lower;
+  LCD8574Frame *to = &lower->frames[lower->back];
+  int top = self->ctl_rows;
+  memcpy (to->cells, f->cells + top * self->cols, lower->rows * lower->cols);
+  BOOL cursor_here = f->cursor_row >= top;
+  to->cursor_row = cursor_here ? f->cursor_row - top : -1;
+  to->cursor_col = cursor_here ? f->cursor_col : -1;
+  to->mode = f->mode;
+  if (to->mode != LCD_UNKNOWN && f->cursor_row >= 0 && !cursor_here)
+    to->mode &= ~(LCD_MODE_CURSOR_ON | LCD_MODE_CURSOR_BLINK);
+  memcpy (to->cgram, f->cgram, sizeof (to->cgram));
+  to->cgram_used = f->cgram_used;
+  to->marquee_row = f->marquee_row >= top ? f->marquee_row - top : -1;
+  to->shift = f->marquee_row >= 0 && to->marquee_row < 0 ? 0 : f->shift;
+  to->marquee_len = f->marquee_len;
+  to->marquee_pos = f->marquee_pos;
+  if (to->marquee_row >= 0) memcpy (to->marquee, f->marquee, f->marquee_len);
+  }
+
+/*============================================================================
+
+  lcd8574_plan_all
+
+  Plan a frame, for both controllers, if there are two, and end each
+  one's last segment. Returns the number of controllers (1 or 2), which
+  are written to ctls.
+
+============================================================================*/
+static int lcd8574_plan_all (LCD8574 *self, const LCD8574Frame *f, 
+    LCD8574 **ctls)
+  {
+  lcd8574_plan_frame (self, f);
+  lcd8574_tx_mark (self);
+  ctls[0] = self;
+  if (!self->lower) return 1;
+  lcd8574_split_frame (self, f);
+  LCD8574 *lower = self->lower;
+  lcd8574_plan_frame (lower, &lower->frames[lower->back]);
+  lcd8574_tx_mark (lower);
+  ctls[1] = lower;
+  return 2;
+  }
+
+/*============================================================================
+
+  lcd8574_poll_ready
+
+  Returns TRUE if the LCD module is ready for its next segment. If 
+  busy-flag polling is enabled, and the time allowed by the timing
+  profile hasn't passed yet, we poll the busy flag, once.
+
+============================================================================*/
+static BOOL lcd8574_poll_ready (LCD8574 *self, long long now)
+  {
+  if (self->ready_at <= now) return TRUE;
+  if (!self->busy_poll) return FALSE;
+  int busy = lcd8574_read_busy (self, NULL);
+  if (busy == 0)
+    {
+    self->ready_at = 0;
+    return TRUE;
+    }
+  if (busy < 0) self->busy_poll = FALSE;
+  return FALSE;
+  }
+
+/*============================================================================
+
+  lcd8574_can_batch
+
+  Returns TRUE if the planned segments of all these controllers can be
+  handed to their transport in one batch: they must all be on open
+  buses with the same transport, one that has a run() method. Busy-flag
+  polling needs a read between segments, so it rules batching out.
+
+============================================================================*/
+static BOOL lcd8574_can_batch (LCD8574 **ctls, int n)
+  {
+  if (n == 0) return FALSE;
+  const Transport *t = ctls[0]->bus->transport;
+  if (!t->run) return FALSE;
+  for (int i = 0; i < n; i++)
+    if (ctls[i]->bus->transport != t || !ctls[i]->bus->handle 
+        || ctls[i]->busy_poll) 
+      return FALSE;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_run_batched
+
+  Send the planned segments of a number of controllers as one batch
+  (see Transport.run). Each controller's segments become a job, split
+  into steps no longer than its max_msg, with the segment's execution 
+  time as the wait after its last step. The transport does the waiting,
+  so nothing sleeps here. The buses are locked for the whole batch, in
+  address order, so that two batches can't deadlock. For a traced 
+  display, the transport records when each step started, which is the 
+  time the trace needs.
+
+============================================================================*/
+static void lcd8574_run_batched (LCD8574 **ctls, int n)
+  {
+  int total = 0;
+  for (int i = 0; i < n; i++)
+    {
+    LCD8574 *m = ctls[i];
+    lcd8574_tx_mark (m);
+    int start = m->seg_next ? m->segs[m->seg_next - 1].end : 0;
+    total += m->nsegs - m->seg_next + (m->tx_len - start) / m->max_msg;
+    }
+  TransportStep steps[total > 0 ? total : 1];
+  long long starts[total > 0 ? total : 1];
+  TransportJob jobs[n];
+  LCD8574Bus *buses[n];
+  int nbuses = 0, k = 0;
+  long long now = lcd8574_now_us();
+  for (int i = 0; i < n; i++)
+    {
+    LCD8574 *m = ctls[i];
+    TransportJob *job = &jobs[i];
+    job->handle = m->bus->handle;
+    job->addr = m->i2c_addr;
+    job->delay_us = m->ready_at > now ? m->ready_at - now : 0;
+    job->steps = steps + k;
+    job->start_us = m->trace ? starts + k : NULL;
+    job->done = 0;
+    for (int s = m->seg_next; s < m->nsegs; s++)
+      {
+      int start = s ? m->segs[s - 1].end : 0;
+      while (start < m->segs[s].end)
+        {
+        int len = m->segs[s].end - start;
+        if (len > m->max_msg) len = m->max_msg;
+        steps[k].buf = m->tx + start;
+        steps[k].len = len;
+        start += len;
+        steps[k].wait_us = start < m->segs[s].end ? 0 : m->segs[s].wait;
+        k++;
+        }
+      }
+    job->nsteps = (steps + k) - job->steps;
+
+    // Insert the bus into the list, keeping it in address order
+    int b = 0;
+    while (b < nbuses && buses[b] < m->bus) b++;
+    if (b < nbuses && buses[b] == m->bus) continue;
+    memmove (buses + b + 1, buses + b, (nbuses - b) * sizeof (LCD8574Bus *));
+    buses[b] = m->bus;
+    nbuses++;
+    }
+
+  for (int b = 0; b < nbuses; b++)
+    pthread_mutex_lock (&buses[b]->lock);
+  ctls[0]->bus->transport->run (jobs, n);
+  for (int b = nbuses - 1; b >= 0; b--)
+    pthread_mutex_unlock (&buses[b]->lock);
+
+  now = lcd8574_now_us();
+  for (int i = 0; i < n; i++)
+    {
+    LCD8574 *m = ctls[i];
+    const TransportJob *job = &jobs[i];
+    // The steps after a failed one weren't attempted
+    int tried = job->done < job->nsteps ? job->done + 1 : job->nsteps;
+    for (int j = 0; j < tried; j++)
+      {
+      struct i2c_msg msg = { m->i2c_addr, 0, job->steps[j].len, 
+        (BYTE *)job->steps[j].buf };
+      if (m->trace) 
+        lcd8574_trace_xfer (m, &msg, 1, job->start_us[j], j < job->done);
+      LCD_COUNT (m, bytes, msg.len);
+      }
+    LCD_COUNT (m, xfers, tried);
+    if (tried > job->done) 
+      {
+      LCD_COUNT (m, failed, 1);
+      m->fault = TRUE;
+      }
+    if (job->nsteps > 0) 
+      m->ready_at = now + job->steps[job->nsteps - 1].wait_us;
+    m->seg_next = m->nsegs;
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_run_segments
+
+  Send the planned segments of a number of controllers, taking each in
+  turn. If a controller is still busy executing its last segment -- a
+  clear, for example -- we move on to the next one, rather than 
+  waiting. We only sleep when every controller with something left to
+  send is busy, and then only until the first of them is ready. 
+
+  If the transport can take them all as one batch, it does the 
+  interleaving, and the waiting, instead.
+
+============================================================================*/
+static void lcd8574_run_segments (LCD8574 **ctls, int n)
+  {
+  if (lcd8574_can_batch (ctls, n)) lcd8574_run_batched (ctls, n);
+  for (;;)
+    {
+    BOOL pending = FALSE, sent = FALSE;
+    long long now = lcd8574_now_us();
+    long long soonest = 0;
+    LCD8574 *sleeper = NULL; // The controller we'll be waiting for
+    for (int i = 0; i < n; i++)
+      {
+      LCD8574 *m = ctls[i];
+      if (m->seg_next >= m->nsegs) continue;
+      pending = TRUE;
+      if (lcd8574_poll_ready (m, now))
+        {
+        lcd8574_tx_run_one (m);
+        sent = TRUE;
+        }
+      else if (soonest == 0 || m->ready_at < soonest)
+        {
+        soonest = m->ready_at;
+        sleeper = m;
+        }
+      }
+    if (!pending) break;
+    if (!sent)
+      {
+      long long wait = soonest - lcd8574_now_us();
+      if (wait > 0) lcd8574_sleep (sleeper, wait);
+      }
+    }
+  // That leaves nothing to send, but the buffers need resetting
+  for (int i = 0; i < n; i++)
+    lcd8574_tx_flush (ctls[i]);
+  }
+
+/*============================================================================
+
+  lcd8574_resync
+
+  Get the LCD module back in step after a failed transaction, without
+  starting again from scratch. A transaction that failed part-way can
+  leave the module with half a byte, so that everything after it is
+  a nibble out, and the module executes garbage. Three 8-bit function
+  sets and a 4-bit one, as lcd8574_init() sends, bring it back to 4-bit
+  mode, in step, whatever state it's in. But the module is already
+  running, so it doesn't need the long waits that follow power-up:
+  each function set takes only as long as any other instruction. The
+  first nibble might complete a garbage home, though, and the garbage
+  before it might have been a clear, so those get the longest wait.
+
+  After that, we can't trust anything we know about the module's RAM, 
+  its entry mode, or its display shift. So we set the entry mode, home
+  the display, and forget what's in DDRAM and CGRAM, so that the next 
+  plan repaints the frame from the shadow. The display isn't cleared,
+  so what was showing stays there, apart from any cells the garbage 
+  hit, until it is repainted. Returns FALSE if the resync itself had
+  a failed transaction.
+
+============================================================================*/
+static BOOL lcd8574_resync (LCD8574 *self)
+  {
+  const LCD8574Timing *t = &self->timing;
+  int slow = t->exec_us[LCD_T_CLEAR] > t->exec_us[LCD_T_HOME] 
+    ? t->exec_us[LCD_T_CLEAR] : t->exec_us[LCD_T_HOME];
+  LCD_COUNT (self, resyncs, 1);
+  self->fault = FALSE;
+  self->ready_at = lcd8574_now_us() + slow;
+  for (int i = 0; i < 4; i++)
+    {
+    BYTE func = i < 3 ? CMD_FUNC | LCD_FUNC_DL : CMD_FUNC;
+    lcd8574_send_4_bits (self, 0, func >> 4);
+    self->ready_at = lcd8574_now_us() + (i == 0 ? slow 
+      : t->exec_us[LCD_T_FUNC]);
+    }
+  lcd8574_tx_byte (self, 0, CMD_FUNC | LCD_FUNC_N);
+  lcd8574_tx_byte (self, 0, CMD_ENTRY | LCD_ENTRY_ID);
+  lcd8574_tx_byte (self, 0, CMD_HOME);
+  lcd8574_tx_flush (self);
+
+  for (int i = 0; i < LCD_DDRAM_SIZE; i++)
+    self->ddram[i] = LCD_UNKNOWN;
+  self->ac = 0;
+  self->shift = 0;
+  self->mode = LCD_UNKNOWN;
+  self->cgram_known = 0;
+  return !self->fault;
+  }
+
+/*============================================================================
+
+  lcd8574_repair
+
+  If a transaction failed while a frame was being sent, to either 
+  controller, resync whichever one it was, and send the frame again. 
+  If the bus keeps failing, we give up after LCD_RESYNC_TRIES, and 
+  leave the fault for the next flush to deal with.
+
+============================================================================*/
+static void lcd8574_repair (LCD8574 *self, const LCD8574Frame *f)
+  {
+  LCD8574 *lower = self->lower;
+  for (int i = 0; i < LCD_RESYNC_TRIES 
+      && (self->fault || (lower && lower->fault)); i++)
+    {
+    BOOL ok = TRUE;
+    if (self->fault) ok = lcd8574_resync (self);
+    if (lower && lower->fault) ok = lcd8574_resync (lower) && ok;
+    if (!ok) continue;
+    LCD8574 *ctls[2];
+    int n = lcd8574_plan_all (self, f, ctls);
+    lcd8574_run_segments (ctls, n);
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_flush_frame
+
+  Send a frame to the LCD module, waiting as necessary. On a 40x4 
+  module, the two controllers are interleaved, so that one can be 
+  sent bytes while the other is busy. A transport that can run 
+  batches gets the whole frame as one. If anything failed, the module
+  is resynced and the frame repainted (see lcd8574_repair).
+
+============================================================================*/
+static void lcd8574_flush_frame (LCD8574 *self, const LCD8574Frame *f)
+  {
+  if (!self->lower && !self->bus->transport->run)
+    {
+    lcd8574_plan_frame (self, f);
+    lcd8574_tx_flush (self);
+    }
+  else
+    {
+    LCD8574 *ctls[2];
+    int n = lcd8574_plan_all (self, f, ctls);
+    lcd8574_run_segments (ctls, n);
+    }
+  lcd8574_repair (self, f);
+  }
+
+/*============================================================================
+
+  lcd8574_writer
+
+  The body of the writer thread, in asynchronous mode. Whenever a 
+  frame is published, take it, and send it. If several frames are 
+  published while we're busy sending, we only ever see the last of
+  them. When we're asked to stop, we finish sending the latest frame
+  first.
+
+============================================================================*/
+static void *lcd8574_writer (void *arg)
+  {
+  LCD8574 *self = arg;
+  for (;;)
+    {
+    while (sem_wait (&self->kick) != 0 && errno == EINTR)
+      ;
+    // Only this thread clears LCD_FRAME_NEW, so if it's set now, it will
+    //  still be set when we exchange frames
+    if (atomic_load (&self->published) & LCD_FRAME_NEW)
+      {
+      self->front = atomic_exchange (&self->published, self->front) 
+        & LCD_FRAME_INDEX;
+      LCD8574Frame *f = &self->frames[self->front];
+      lcd8574_flush_frame (self, f);
+      lcd8574_hist_end (self, LCD8574_OP_FLUSH, f->flushed_at);
+      }
+    else if (atomic_load (&self->stop))
+      break;
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  lcd8574_flush
+
+  In synchronous mode, just send the shadow framebuffer to the LCD. 
+
+  In asynchronous mode, publish the shadow framebuffer for the writer
+  thread, and take back whatever frame was published before (which the 
+  writer thread might never have seen). That frame becomes the new 
+  shadow, and it gets a copy of the frame just published, so that 
+  the application can carry on drawing where it left off. 
+
+============================================================================*/
+void lcd8574_flush (LCD8574 *self)
+  {
+  assert (self != NULL);
+  // Until it's initialized, there's no bus to send the frame on
+  if (!self->ready) return;
+  long long start = lcd8574_hist_start (self);
+  if (!self->async)
+    {
+    lcd8574_flush_frame (self, &self->frames[self->back]);
+    lcd8574_hist_end (self, LCD8574_OP_FLUSH, start);
+    return;
+    }
+  // The writer thread records the flush time, when it has sent the frame
+  self->frames[self->back].flushed_at = start;
+  int done = self->back;
+  self->back = atomic_exchange (&self->published, done | LCD_FRAME_NEW) 
+    & LCD_FRAME_INDEX;
+  LCD8574Frame *from = &self->frames[done];
+  LCD8574Frame *to = &self->frames[self->back];
+  memcpy (to->cells, from->cells, self->rows * self->cols);
+  to->cursor_row = from->cursor_row;
+  to->cursor_col = from->cursor_col;
+  to->mode = from->mode;
+  memcpy (to->cgram, from->cgram, sizeof (to->cgram));
+  to->cgram_used = from->cgram_used;
+  to->shift = from->shift;
+  to->marquee_row = from->marquee_row;
+  to->marquee_len = from->marquee_len;
+  to->marquee_pos = from->marquee_pos;
+  memcpy (to->marquee, from->marquee, from->marquee_len);
+  sem_post (&self->kick);
+  }
+
+/*============================================================================
+
+  lcd8574_start_async
+
+============================================================================*/
+BOOL lcd8574_start_async (LCD8574 *self, char **error)
+  {
+  assert (self != NULL);
+  if (self->async) return TRUE;
+  // The frames, the transmit buffer, and the trace and histograms, if
+  //  enabled, are all allocated already, and a flush only uses the 
+  //  stack. So, once everything is locked into memory, the writer 
+  //  never allocates memory or takes a page fault
+  if (self->rt_lock && mlockall (MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+    if (error)
+      asprintf (error, "Can't lock memory: %s", strerror (errno));
+    return FALSE;
+    }
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  if (self->rt_lock) pthread_attr_setstacksize (&attr, LCD_RT_STACK);
+  if (self->rt_priority > 0)
+    {
+    struct sched_param sp = { .sched_priority = self->rt_priority };
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &sp);
+    }
+  if (self->rt_cpu >= 0)
+    {
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    CPU_SET (self->rt_cpu, &cpus);
+    pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+    }
+  sem_init (&self->kick, 0, 0);
+  atomic_store (&self->stop, 0);
+  int err = pthread_create (&self->writer, &attr, lcd8574_writer, self);
+  pthread_attr_destroy (&attr);
+  if (err != 0)
+    {
+    sem_destroy (&self->kick);
+    if (error)
+      asprintf (error, "Can't start LCD writer thread: %s", strerror (err));
+    return FALSE;
+    }
+  self->async = TRUE;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_set_realtime
+
+============================================================================*/
+BOOL lcd8574_set_realtime (LCD8574 *self, int priority, int cpu, BOOL lock)
+  {
+  assert (self != NULL);
+  if (priority < 0 || priority > sched_get_priority_max (SCHED_FIFO)
+      || cpu < -1 || cpu >= CPU_SETSIZE)
+    return FALSE;
+  self->rt_priority = priority;
+  self->rt_cpu = cpu;
+  self->rt_lock = lock;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_stop_async
+
+============================================================================*/
+void lcd8574_stop_async (LCD8574 *self)
+  {
+  assert (self != NULL);
+  if (!self->async) return;
+  atomic_store (&self->stop, 1);
+  sem_post (&self->kick);
+  pthread_join (self->writer, NULL);
+  sem_destroy (&self->kick);
+  self->async = FALSE;
+  }
+
+
+
+/*============================================================================
+
+  lcd8574_send_mode
+
+  Send the mode now, and record it in the shadow
+
+============================================================================*/
+static void lcd8574_send_mode (LCD8574 *self, BYTE mode)
+  {
+  self->frames[self->back].mode = mode;
+  lcd8574_send_byte (self, 0, CMD_CTRL | mode);
+  self->mode = mode;
+  }
+
+/*============================================================================
+
+  lcd8574_set_mode
+
+  Just send a "control register" command, with the mode bits specified
+  by the caller. In asynchronous mode, the writer thread owns the 
+  I2C device, so we just record the mode in the shadow, and the writer
+  will send it with the next frame. Before the display is initialized,
+  there's nothing to send it to, so the mode also just goes in the
+  shadow.
+
+============================================================================*/
+void lcd8574_set_mode (LCD8574 *self, BYTE mode)
+  {
+  assert (self != NULL);
+  long long start = lcd8574_hist_start (self);
+  if (self->ready && !self->async)
+    lcd8574_send_mode (self, mode);
+  else
+    self->frames[self->back].mode = mode;
+  lcd8574_hist_end (self, LCD8574_OP_MODE, start);
+  }
+
+/*============================================================================
+
+  lcd8574_draw_mode
+
+  Just record the mode in the shadow, whether we're in asynchronous 
+  mode or not. The planner sends it with the next frame, if it differs
+  from what the module has.
+
+============================================================================*/
+void lcd8574_draw_mode (LCD8574 *self, BYTE mode)
+  {
+  assert (self != NULL);
+  self->frames[self->back].mode = mode;
+  }
+
+/*============================================================================
+
+  lcd8574_set_timing
+
+============================================================================*/
+BOOL lcd8574_set_timing (LCD8574 *self, const char *profile)
+  {
+  assert (self != NULL);
+  assert (profile != NULL);
+  for (const LCD8574Timing *t = lcd8574_timings; t->name; t++)
+    {
+    if (strcmp (t->name, profile) == 0)
+      {
+      self->timing = *t;
+      return TRUE;
+      }
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+
+  lcd8574_load_timing
+
+  Read a timing profile written by lcd8574_save_timing(). Each line is
+  a name and a value, in usec; lines starting with # are comments. Any
+  value not given is left as it was.
+
+============================================================================*/
+BOOL lcd8574_load_timing (LCD8574 *self, const char *file, char **error)
+  {
+  assert (self != NULL);
+  assert (file != NULL);
+  FILE *f = fopen (file, "r");
+  if (!f)
+    {
+    if (error)
+      asprintf (error, "Can't open %s: %s", file, strerror (errno));
+    return FALSE;
+    }
+  LCD8574Timing t = self->timing;
+  BOOL ret = TRUE;
+  char line[128];
+  int lineno = 0;
+  while (ret && fgets (line, sizeof (line), f))
+    {
+    lineno++;
+    char key[32];
+    int val;
+    if (line[0] == '#' || line[0] == '\n') continue;
+    ret = sscanf (line, "%31s %d", key, &val) == 2 && val >= 0;
+    if (ret && strcmp (key, "power_up") == 0)
+      t.power_up_us = val;
+    else if (ret && strcmp (key, "reset") == 0)
+      t.reset_us = val;
+    else if (ret)
+      {
+      int i;
+      for (i = 0; i < LCD_T_COUNT; i++)
+        if (strcmp (key, lcd8574_timing_names[i]) == 0) break;
+      if (i < LCD_T_COUNT) t.exec_us[i] = val;
+      else ret = FALSE;
+      }
+    if (!ret && error)
+      asprintf (error, "%s: line %d: bad timing", file, lineno);
+    }
+  fclose (f);
+  if (ret) 
+    {
+    t.name = "file";
+    self->timing = t;
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  lcd8574_save_timing
+
+============================================================================*/
+BOOL lcd8574_save_timing (const LCD8574 *self, const char *file, 
+    char **error)
+  {
+  assert (self != NULL);
+  assert (file != NULL);
+  FILE *f = fopen (file, "w");
+  if (!f)
+    {
+    if (error)
+      asprintf (error, "Can't open %s for writing: %s", file, 
+        strerror (errno));
+    return FALSE;
+    }
+  const LCD8574Timing *t = &self->timing;
+  fprintf (f, "# LCD8574 timing profile (usec), from \"%s\"\n", t->name);
+  fprintf (f, "power_up %d\n", t->power_up_us);
+  fprintf (f, "reset %d\n", t->reset_us);
+  for (int i = 0; i < LCD_T_COUNT; i++)
+    fprintf (f, "%s %d\n", lcd8574_timing_names[i], t->exec_us[i]);
+  BOOL ret = fclose (f) == 0;
+  if (!ret && error)
+    asprintf (error, "Can't write %s: %s", file, strerror (errno));
+  return ret;
+  }
+
+/*============================================================================
+
+  lcd8574_cal_busy
+
+  Send one instruction of the class being calibrated, and time how long
+  the busy flag stays set. Each read of the flag takes a few hundred 
+  usec on the bus, so this is only an upper bound, from which the 
+  search can start. Returns -1 if the flag can't be read.
+
+============================================================================*/
+static int lcd8574_cal_busy (LCD8574 *self, int t)
+  {
+  static const BYTE cmds[LCD_T_COUNT] = { CMD_CLEAR, CMD_HOME, 0, 0, 0, 0,
+    CMD_SET_CGRAM_ADDR, CMD_SET_DDRAM_ADDR, ' ' };
+  lcd8574_wait_ready (self);
+  lcd8574_send_byte (self, t == LCD_T_DATA, cmds[t]);
+  long long start = lcd8574_now_us();
+  int busy;
+  while ((busy = lcd8574_read_busy (self, NULL)) > 0
+      && lcd8574_now_us() - start < LCD_CAL_MAX_US)
+    ;
+  self->ready_at = 0;
+  return busy == 0 ? lcd8574_now_us() - start : -1;
+  }
+
+/*============================================================================
+
+  lcd8574_cal_verify
+
+  Read back n bytes of DDRAM or CGRAM, starting at addr, and compare 
+  them with what should be there. CGRAM rows only have five bits.
+
+============================================================================*/
+static BOOL lcd8574_cal_verify (LCD8574 *self, BOOL cgram, int addr, 
+    const BYTE *want, int n)
+  {
+  lcd8574_send_byte (self, 0, 
+    (cgram ? CMD_SET_CGRAM_ADDR : CMD_SET_DDRAM_ADDR) | addr);
+  lcd8574_wait_ready (self);
+  for (int i = 0; i < n; i++)
+    {
+    BYTE val;
+    if (!lcd8574_read_byte (self, 1, &val)) return FALSE;
+    if ((cgram ? val & 0x1F : val) != want[i]) return FALSE;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_cal_trial
+
+  Find out whether the LCD module reliably executes instructions of 
+  class t in us usec. We send a test pattern that depends on each 
+  instruction having finished before the next arrives, with every 
+  other class of instruction given its safe time, then read back the 
+  RAM to see if the pattern arrived intact. Each trial uses a 
+  different pattern, so that one trial can't pass on what an earlier
+  one left behind.
+
+============================================================================*/
+static BOOL lcd8574_cal_trial (LCD8574 *self, int t, int us, int trial)
+  {
+  BYTE want[LCD_CAL_CELLS];
+  BOOL cgram = FALSE;
+  int n = LCD_CAL_CELLS;
+  // Start from a known state, using safe timings
+  lcd8574_send_byte (self, 0, CMD_SET_DDRAM_ADDR);
+  for (int i = 0; i < LCD_CAL_CELLS; i++)
+    lcd8574_tx_byte (self, 1, ' ');
+  lcd8574_tx_flush (self);
+
+  LCD8574Timing safe = self->timing;
+  self->timing.exec_us[t] = us;
+  lcd8574_wait_ready (self);
+  switch (t)
+    {
+    case LCD_T_DATA:
+      lcd8574_tx_byte (self, 0, CMD_SET_DDRAM_ADDR);
+      for (int i = 0; i < n; i++)
+        {
+        want[i] = 'A' + (i * 7 + trial) % 26;
+        lcd8574_tx_byte (self, 1, want[i]);
+        }
+      break;
+    case LCD_T_DDRAM:
+    case LCD_T_CGRAM:
+      // The addresses jump about, so data that arrives before the 
+      //  address has been set goes into the wrong place
+      cgram = t == LCD_T_CGRAM;
+      for (int i = 0; i < n; i++)
+        {
+        int addr = (i * 5 + trial) % n;
+        want[addr] = cgram ? (i * 3 + trial) & 0x1F : 'a' + (i + trial) % 26;
+        lcd8574_tx_byte (self, 0, 
+          (cgram ? CMD_SET_CGRAM_ADDR : CMD_SET_DDRAM_ADDR) | addr);
+        lcd8574_tx_byte (self, 1, want[addr]);
+        }
+      break;
+    case LCD_T_CLEAR:
+    case LCD_T_HOME:
+      // Both leave the address counter at zero, and the clear blanks
+      //  every cell, so a character written too soon goes astray, or 
+      //  is rubbed out
+      memset (want, ' ', n);
+      if (t == LCD_T_CLEAR)
+        {
+        for (int i = 0; i < n; i++)
+          lcd8574_tx_byte (self, 1, 'X');
+        }
+      else
+        lcd8574_tx_byte (self, 0, CMD_SET_DDRAM_ADDR | (n / 2));
+      lcd8574_tx_byte (self, 0, t == LCD_T_CLEAR ? CMD_CLEAR : CMD_HOME);
+      want[0] = '0' + trial % 10;
+      lcd8574_tx_byte (self, 1, want[0]);
+      break;
+    }
+  lcd8574_tx_flush (self);
+  self->timing = safe;
+  self->ready_at = lcd8574_now_us() + safe.exec_us[t];
+  return lcd8574_cal_verify (self, cgram, 0, want, n);
+  }
+
+/*============================================================================
+
+  lcd8574_cal_passes
+
+  A time only passes if every one of LCD_CAL_TRIALS trials passes
+
+============================================================================*/
+static BOOL lcd8574_cal_passes (LCD8574 *self, int t, int us)
+  {
+  for (int i = 0; i < LCD_CAL_TRIALS; i++)
+    if (!lcd8574_cal_trial (self, t, us, i)) return FALSE;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_calibrate
+
+  Binary-search, for each class of instruction we can test, the 
+  shortest time that passes. The search starts from what the busy flag
+  says, if it can be read, or from the current profile otherwise. The
+  remaining commands (entry mode, display control, shift, and function
+  set) can't be checked by reading back RAM, but the HD44780 executes 
+  them all in the same time as a set-DDRAM-address, so they get its 
+  time. The classes are done in an order such that each test only
+  depends on the times already found.
+
+  Afterwards, we don't know what's in the module's RAM, so we clear it.
+
+============================================================================*/
+BOOL lcd8574_calibrate (LCD8574 *self, int margin_pct, char **error)
+  {
+  assert (self != NULL);
+  static const int order[] = { LCD_T_DATA, LCD_T_DDRAM, LCD_T_CGRAM, 
+    LCD_T_CLEAR, LCD_T_HOME };
+  if (!self->ready || self->async || self->lower || self->wiring.rw < 0)
+    {
+    if (error)
+      asprintf (error, "Calibration needs an initialized, synchronous, "
+        "single-controller display, with R/W connected");
+    return FALSE;
+    }
+  BOOL busy_poll = self->busy_poll;
+  self->busy_poll = FALSE;
+  LCD8574Timing found = self->timing;
+  BOOL ret = TRUE;
+  for (unsigned k = 0; k < sizeof (order) / sizeof (order[0]) && ret; k++)
+    {
+    int t = order[k];
+    int hi = lcd8574_cal_busy (self, t);
+    if (hi < 0) hi = self->timing.exec_us[t];
+    // The busy flag might not tell the truth on some clones, so be
+    //  prepared to go past it
+    while (hi <= LCD_CAL_MAX_US && !lcd8574_cal_passes (self, t, hi))
+      hi = hi * 2 + 1;
+    if (hi > LCD_CAL_MAX_US)
+      {
+      if (error)
+        asprintf (error, "Can't calibrate %s: the LCD module doesn't "
+          "work at any speed", lcd8574_timing_names[t]);
+      ret = FALSE;
+      break;
+      }
+    int lo = -1; // Known to fail, or not tried
+    while (hi - lo > 1)
+      {
+      int mid = (lo + hi) / 2;
+      if (lcd8574_cal_passes (self, t, mid)) hi = mid;
+      else lo = mid;
+      }
+    found.exec_us[t] = hi + (hi * margin_pct + 99) / 100;
+    // Later tests can rely on this class being quicker
+    self->timing.exec_us[t] = found.exec_us[t];
+    }
+  self->busy_poll = busy_poll;
+  if (ret)
+    {
+    found.exec_us[LCD_T_ENTRY] = found.exec_us[LCD_T_DDRAM];
+    found.exec_us[LCD_T_CTRL] = found.exec_us[LCD_T_DDRAM];
+    found.exec_us[LCD_T_SHIFT] = found.exec_us[LCD_T_DDRAM];
+    found.exec_us[LCD_T_FUNC] = found.exec_us[LCD_T_DDRAM];
+    found.name = "calibrated";
+    self->timing = found;
+    }
+
+  lcd8574_send_byte (self, 0, CMD_CLEAR);
+  for (int i = 0; i < LCD_DDRAM_SIZE; i++)
+    self->ddram[i] = ' ';
+  self->ac = 0;
+  self->shift = 0;
+  self->cgram_known = 0;
+  return ret;
+  }
+
+/*============================================================================
+
+  lcd8574_set_busy_poll
+
+============================================================================*/
+void lcd8574_set_busy_poll (LCD8574 *self, BOOL poll)
+  {
+  assert (self != NULL);
+  self->busy_poll = poll && self->wiring.rw >= 0;
+  }
+
+/*============================================================================
+
+  lcd8574_set_wiring
+
+============================================================================*/
+BOOL lcd8574_set_wiring (LCD8574 *self, const char *profile)
+  {
+  assert (self != NULL);
+  assert (profile != NULL);
+  for (const LCD8574Wiring *w = lcd8574_wirings; w->name; w++)
+    {
+    if (strcmp (w->name, profile) == 0)
+      {
+      lcd8574_use_wiring (self, w);
+      if (w->rw < 0) self->busy_poll = FALSE;
+      return TRUE;
+      }
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+
+  lcd8574_set_max_msg
+
+============================================================================*/
+void lcd8574_set_max_msg (LCD8574 *self, int len)
+  {
+  assert (self != NULL);
+  if (len > 0) self->max_msg = len;
+  }
+
+/*============================================================================
+
+  lcd8574_get_stats
+
+============================================================================*/
+void lcd8574_get_stats (const LCD8574 *self, LCD8574Stats *stats)
+  {
+  assert (self != NULL);
+  assert (stats != NULL);
+  const LCD8574Counters *c = &self->counters;
+  stats->bytes = atomic_load_explicit (&c->bytes, memory_order_relaxed);
+  stats->xfers = atomic_load_explicit (&c->xfers, memory_order_relaxed);
+  stats->failed = atomic_load_explicit (&c->failed, memory_order_relaxed);
+  stats->commands = atomic_load_explicit (&c->commands, 
+    memory_order_relaxed);
+  stats->data = atomic_load_explicit (&c->data, memory_order_relaxed);
+  stats->sleep_us = atomic_load_explicit (&c->sleep_us, 
+    memory_order_relaxed);
+  stats->flushes = atomic_load_explicit (&c->flushes, memory_order_relaxed);
+  stats->resyncs = atomic_load_explicit (&c->resyncs, memory_order_relaxed);
+  // The lower controller of a 40x4 module is flushed along with us, so
+  //  it's only its traffic that counts
+  if (self->lower)
+    {
+    LCD8574Stats lower;
+    lcd8574_get_stats (self->lower, &lower);
+    stats->bytes += lower.bytes;
+    stats->xfers += lower.xfers;
+    stats->failed += lower.failed;
+    stats->commands += lower.commands;
+    stats->data += lower.data;
+    stats->sleep_us += lower.sleep_us;
+    stats->resyncs += lower.resyncs;
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_reset_stats
+
+============================================================================*/
+void lcd8574_reset_stats (LCD8574 *self)
+  {
+  assert (self != NULL);
+  LCD8574Counters *c = &self->counters;
+  atomic_store_explicit (&c->bytes, 0, memory_order_relaxed);
+  atomic_store_explicit (&c->xfers, 0, memory_order_relaxed);
+  atomic_store_explicit (&c->failed, 0, memory_order_relaxed);
+  atomic_store_explicit (&c->commands, 0, memory_order_relaxed);
+  atomic_store_explicit (&c->data, 0, memory_order_relaxed);
+  atomic_store_explicit (&c->sleep_us, 0, memory_order_relaxed);
+  atomic_store_explicit (&c->flushes, 0, memory_order_relaxed);
+  atomic_store_explicit (&c->resyncs, 0, memory_order_relaxed);
+  if (self->lower) lcd8574_reset_stats (self->lower);
+  }
+
+/*============================================================================
+
+  lcd8574_enable_histograms
+
+============================================================================*/
+void lcd8574_enable_histograms (LCD8574 *self)
+  {
+  assert (self != NULL);
+  if (!self->hist)
+    self->hist = calloc (LCD8574_OP_COUNT, sizeof (Histogram));
+  }
+
+/*============================================================================
+
+  lcd8574_get_latency
+
+============================================================================*/
+long long lcd8574_get_latency (const LCD8574 *self, int op, double p)
+  {
+  assert (self != NULL);
+  if (!self->hist || op < 0 || op >= LCD8574_OP_COUNT) return -1;
+  return histogram_percentile (&self->hist[op], p);
+  }
+
+/*============================================================================
+
+  lcd8574_write_histograms
+
+============================================================================*/
+void lcd8574_write_histograms (const LCD8574 *self, FILE *f)
+  {
+  assert (self != NULL);
+  if (!self->hist) return;
+  histogram_write_header (f);
+  for (int op = 0; op < LCD8574_OP_COUNT; op++)
+    histogram_write (&self->hist[op], lcd8574_op_names[op], f);
+  }
+
+/*============================================================================
+
+  lcd8574_reset_histograms
+
+============================================================================*/
+void lcd8574_reset_histograms (LCD8574 *self)
+  {
+  assert (self != NULL);
+  if (!self->hist) return;
+  for (int op = 0; op < LCD8574_OP_COUNT; op++)
+    histogram_reset (&self->hist[op]);
+  }
+
+/*============================================================================
+
+  lcd8574_enable_trace
+
+============================================================================*/
+void lcd8574_enable_trace (LCD8574 *self, int entries)
+  {
+  assert (self != NULL);
+  if (!self->trace && entries > 0) self->trace = trace_create (entries);
+  if (self->lower) self->lower->trace = self->trace;
+  }
+
+/*============================================================================
+
+  lcd8574_write_trace
+
+============================================================================*/
+BOOL lcd8574_write_trace (const LCD8574 *self, const char *file, 
+        char **error)
+  {
+  assert (self != NULL);
+  assert (file != NULL);
+  if (!self->trace)
+    {
+    if (error) asprintf (error, "Tracing is not enabled");
+    return FALSE;
+    }
+  FILE *f = fopen (file, "w");
+  BOOL ok = f && trace_write (self->trace, f, self->rows, self->cols,
+    self->i2c_addr);
+  if (f && fclose (f) != 0) ok = FALSE;
+  if (!ok && error)
+    asprintf (error, "Can't write trace %s: %s", file, strerror (errno));
+  return ok;
+  }
+
+/*============================================================================
+
+  lcd8574_set_transport
+
+============================================================================*/
+BOOL lcd8574_set_transport (LCD8574 *self, const char *name)
+  {
+  assert (self != NULL);
+  assert (name != NULL);
+  const Transport *t = transport_find (name);
+  if (!t) return FALSE;
+  self->transport = t;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_get_rows
+
+============================================================================*/
+int lcd8574_get_rows (const LCD8574 *self)
+  {
+  assert (self != NULL);
+  return self->rows;
+  }
+
+/*============================================================================
+
+  lcd8574_get_cols
+
+============================================================================*/
+int lcd8574_get_cols (const LCD8574 *self)
+  {
+  assert (self != NULL);
+  return self->cols;
+  }
+
+/*============================================================================
+
+  lcd8574_set_rom
+
+============================================================================*/
+BOOL lcd8574_set_rom (LCD8574 *self, const char *rom)
+  {
+  assert (self != NULL);
+  assert (rom != NULL);
+  int r = charmap_find (rom);
+  if (r < 0) return FALSE;
+  self->rom = r;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_set_row_offsets
+
+============================================================================*/
+void lcd8574_set_row_offsets (LCD8574 *self, const int *offsets)
+  {
+  assert (self != NULL);
+  assert (offsets != NULL);
+  for (int r = 0; r < self->rows && r < LCD_ROWS_MAX; r++)
+    self->row_addr[r] = offsets[r] & (LCD_DDRAM_SIZE - 1);
+  }
+
+/*============================================================================
+
+  lcd8574_set_warm_init
+
+============================================================================*/
+void lcd8574_set_warm_init (LCD8574 *self, BOOL warm, const char *state_file)
+  {
+  assert (self != NULL);
+  self->warm = warm;
+  free (self->state_file);
+  self->state_file = state_file ? strdup (state_file) : NULL;
+  }
+
+/*============================================================================
+
+  lcd8574_read_boot_id
+
+  Read the kernel's boot ID, which is different every time the 
+  system starts. Returns an empty string if it can't be read.
+
+============================================================================*/
+static void lcd8574_read_boot_id (char *id, int len)
+  {
+  memset (id, 0, len);
+  FILE *f = fopen (LCD_BOOT_ID, "r");
+  if (f)
+    {
+    if (!fgets (id, len, f)) id[0] = 0;
+    fclose (f);
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_load_state
+
+  Read the state file left by the last process to use this display, 
+  and check that it really is about this display, since this system
+  was started. The file is removed once it has been read: if this 
+  process doesn't exit cleanly, and leave a new one, the next process 
+  can't be sure what the module is showing.
+
+============================================================================*/
+static BOOL lcd8574_load_state (LCD8574 *self, LCD8574State *st)
+  {
+  FILE *f = fopen (self->state_file, "r");
+  if (!f) return FALSE;
+  BOOL ok = fread (st, sizeof (LCD8574State), 1, f) == 1;
+  fclose (f);
+  unlink (self->state_file);
+
+  // What's in the file is used to index our tables, so one that is 
+  //  corrupt, or from an older version, mustn't get past here
+  for (int i = 0; ok && i < LCD_DDRAM_SIZE; i++)
+    ok = st->ddram[i] >= LCD_UNKNOWN && st->ddram[i] <= 0xFF;
+
+  char boot_id[sizeof (st->boot_id)];
+  lcd8574_read_boot_id (boot_id, sizeof (boot_id));
+  st->boot_id[sizeof (st->boot_id) - 1] = 0;
+  return ok && st->magic == LCD_STATE_MAGIC 
+    && boot_id[0] && strcmp (st->boot_id, boot_id) == 0
+    && strncmp (st->dev, self->bus->dev, sizeof (st->dev)) == 0
+    && st->i2c_addr == self->i2c_addr 
+    && st->rows == self->rows && st->cols == self->cols
+    && st->ac >= 0 && st->ac < LCD_DDRAM_SIZE 
+    && (st->mode & ~(LCD_MODE_DISPLAY_ON | LCD_MODE_CURSOR_ON 
+      | LCD_MODE_CURSOR_BLINK)) == 0
+    && st->shift >= 0 && st->shift < LCD_LINE_LEN
+    && (st->cgram_known & ~((1 << LCD_GLYPHS) - 1)) == 0;
+  }
+
+/*============================================================================
+
+  lcd8574_save_state
+
+  Write what we know about the LCD module for the next process, if we
+  know enough for it to be useful.
+
+============================================================================*/
+static void lcd8574_save_state (LCD8574 *self)
+  {
+  if (self->ac < 0 || self->mode < 0) return;
+  LCD8574State st;
+  memset (&st, 0, sizeof (LCD8574State));
+  st.magic = LCD_STATE_MAGIC;
+  lcd8574_read_boot_id (st.boot_id, sizeof (st.boot_id));
+  strncpy (st.dev, self->bus->dev, sizeof (st.dev) - 1);
+  st.i2c_addr = self->i2c_addr;
+  st.rows = self->rows;
+  st.cols = self->cols;
+  st.ac = self->ac;
+  st.mode = self->mode;
+  st.shift = self->shift;
+  memcpy (st.ddram, self->ddram, sizeof (st.ddram));
+  memcpy (st.cgram, self->cgram, sizeof (st.cgram));
+  st.cgram_known = self->cgram_known;
+  FILE *f = fopen (self->state_file, "w");
+  if (f)
+    {
+    fwrite (&st, sizeof (LCD8574State), 1, f);
+    fclose (f);
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_read_ddram
+
+  Read what the LCD module is showing into our copy of its DDRAM, a 
+  row at a time. The address counter moves on by itself after each
+  read, and the time each read takes on the bus is longer than the 
+  module needs to fetch the next byte.
+
+============================================================================*/
+static BOOL lcd8574_read_ddram (LCD8574 *self)
+  {
+  for (int r = 0; r < self->ctl_rows; r++)
+    {
+    int addr = lcd8574_cell_addr (self, r, 0, 0);
+    lcd8574_send_byte (self, 0, CMD_SET_DDRAM_ADDR | addr);
+    lcd8574_wait_ready (self);
+    for (int c = 0; c < self->cols; c++)
+      {
+      addr = lcd8574_cell_addr (self, r, c, 0);
+      if (addr < 0) break;
+      BYTE val;
+      if (!lcd8574_read_byte (self, 1, &val)) return FALSE;
+      self->ddram[addr] = val;
+      }
+    }
+  self->ac = LCD_UNKNOWN;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_warm_start
+
+  Try to take over the LCD module in whatever state the last process
+  left it, without the slow 8-bit/4-bit resync, or clearing the 
+  display. 
+
+  If the module's RW pin is wired, we can check that it is in 4-bit
+  mode, and in step with us, by setting the address counter and 
+  reading it back. If the last process left a state file, and the
+  address counter is where it says, we believe the rest of it. 
+  Otherwise we read back what the module is showing, and home the
+  display, since we can't read the display shift. 
+
+  Without the RW pin, all we have is the state file, and we have to
+  trust it. That's only safe if no other program uses the display 
+  between the two processes that use warm initialization.
+
+  Returns FALSE if the module must be initialized from scratch.
+
+============================================================================*/
+static BOOL lcd8574_warm_start (LCD8574 *self)
+  {
+  LCD8574State st;
+  BOOL have_state = self->state_file && lcd8574_load_state (self, &st);
+  if (self->wiring.rw >= 0)
+    {
+    int ac;
+    if (lcd8574_read_busy (self, &ac) != 0) return FALSE;
+    if (have_state && ac != st.ac) have_state = FALSE;
+    lcd8574_send_byte (self, 0, CMD_SET_DDRAM_ADDR | LCD_WARM_PROBE);
+    lcd8574_wait_ready (self);
+    if (lcd8574_read_busy (self, &ac) != 0 || ac != LCD_WARM_PROBE) 
+      return FALSE;
+    self->ac = LCD_WARM_PROBE;
+    if (!have_state)
+      {
+      if (!lcd8574_read_ddram (self)) return FALSE;
+      lcd8574_send_byte (self, 0, CMD_HOME);
+      self->ac = 0;
+      self->shift = 0;
+      }
+    }
+  else if (have_state)
+    self->ac = st.ac;
+  else
+    return FALSE;
+
+  if (have_state)
+    {
+    memcpy (self->ddram, st.ddram, sizeof (self->ddram));
+    memcpy (self->cgram, st.cgram, sizeof (self->cgram));
+    self->cgram_known = st.cgram_known;
+    self->mode = st.mode;
+    self->shift = st.shift;
+    }
+
+  // Adopt what the module is showing as the contents of every frame, 
+  //  so the first flush only has to send what the application changes
+  for (int i = 0; i < LCD_FRAMES; i++)
+    {
+    LCD8574Frame *f = &self->frames[i];
+    for (int r = 0; r < self->rows; r++)
+      {
+      for (int c = 0; c < self->cols; c++)
+        {
+        int addr = lcd8574_cell_addr (self, r, c, self->shift);
+        int val = addr < 0 ? LCD_UNKNOWN : self->ddram[addr];
+        f->cells[r * self->cols + c] = val < 0 ? ' ' : val;
+        }
+      }
+    f->mode = self->mode;
+    f->shift = self->shift;
+    memcpy (f->cgram, self->cgram, sizeof (f->cgram));
+    f->cgram_used = self->cgram_known;
+    }
+  if (self->mode < 0)
+    lcd8574_send_mode (self, LCD_MODE_DISPLAY_ON);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_wiring_standard
+
+  Whether the lines that carry commands and data are wired as in the 
+  "standard" profile. RW and the backlight don't matter.
+
+============================================================================*/
+static BOOL lcd8574_wiring_standard (const LCD8574Wiring *w)
+  {
+  return w->rs == PIN_RS && w->e == PIN_E && w->e2 < 0
+    && w->d4 == PIN_D4 && w->d5 == PIN_D5 && w->d6 == PIN_D6 
+    && w->d7 == PIN_D7;
+  }
+
+/*============================================================================
+
+  lcd8574_init_lower
+
+  Set up the second controller of a 40x4 module, which drives the lower
+  rows. It's just another LCD8574, on the same bus, and at the same 
+  address, whose E is the first controller's E2. It isn't a member of 
+  the bus: its frames are flushed along with ours. It records into our
+  trace ring, if there is one, so the trace has both controllers' 
+  bytes, in the order they were sent.
+
+============================================================================*/
+static BOOL lcd8574_init_lower (LCD8574 *self, char **error)
+  {
+  LCD8574 *lower = lcd8574_create_dev (self->dev, self->i2c_addr, 
+    self->rows - self->ctl_rows, self->cols);
+  LCD8574Wiring w = self->wiring;
+  w.e = w.e2;
+  w.e2 = -1;
+  lcd8574_use_wiring (lower, &w);
+  lower->timing = self->timing;
+  lower->busy_poll = self->busy_poll;
+  lower->max_msg = self->max_msg;
+  lower->bus = self->bus;
+  lower->trace = self->trace;
+  lower->trace_e = TRACE_E2;
+  if (!lcd8574_init (lower, error))
+    {
+    lower->bus = NULL;
+    lower->trace = NULL;
+    lcd8574_destroy (lower);
+    return FALSE;
+    }
+  self->lower = lower;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_init
+
+  Initialize the display module
+
+============================================================================*/
+BOOL lcd8574_init (LCD8574 *self, char **error)
+  {
+  assert (self != NULL);
+  long long start = lcd8574_hist_start (self);
+  int ret = FALSE;
+  BOOL dual = self->wiring.e2 >= 0 && self->rows > LCD_CTL_ROWS;
+  self->ctl_rows = dual ? LCD_CTL_ROWS : self->rows;
+  // If we haven't been given a shared bus, we need one of our own
+  if (!self->bus)
+    {
+    self->bus = lcd8574_bus_create (self->dev);
+    if (self->transport) self->bus->transport = self->transport;
+    self->own_bus = TRUE;
+    }
+  // A transport that does its own wiring can't do any other, and 
+  //  can't read the busy flag, or what the module is showing
+  const Transport *t = self->bus->transport;
+  if (t->standard_only)
+    {
+    self->busy_poll = FALSE;
+    self->warm = FALSE;
+    }
+  if (t->standard_only && !lcd8574_wiring_standard (&self->wiring))
+    {
+    asprintf (error, "The %s transport needs the standard wiring, not %s",
+      t->name, self->wiring.name);
+    }
+  // See if we can open the I2C device
+  else if (lcd8574_bus_init (self->bus, NULL))
+    {
+    // Check that the I2C slave address that was supplied when this
+    //   object was created is acceptable
+    BOOL addr_ok;
+    pthread_mutex_lock (&self->bus->lock);
+    addr_ok = self->bus->transport->probe (self->bus->handle, 
+      self->i2c_addr);
+    pthread_mutex_unlock (&self->bus->lock);
+    if (addr_ok && self->warm && !dual && lcd8574_warm_start (self))
+      {
+      ret = TRUE;
+      self->ready = TRUE;
+      }
+    else if (addr_ok)
+      {
+      // A failed warm start can leave a fault, but we're about to 
+      //  resync the module anyway
+      self->fault = FALSE;
+      // Set all output PCF8574 lines to zero, because we don't really know
+      //  how they will power up
+      BYTE c = 0;
+      struct i2c_msg msg = { self->i2c_addr, 0, 1, &c };
+      lcd8574_xfer (self, &msg, 1);
+      int reset_us = self->timing.reset_us;
+      lcd8574_sleep (self, self->timing.power_up_us);
+
+      // Now... this is all a bit nasty...
+      // We need to set 4-bit mode, but the LCD module powers up in 
+      //  eight bit mode. We can't be sure this is the first program
+      //  to use the LCD since power-up, so we don't know what 
+      //  mode it's in. And we need to issue a command to set 4-bit
+      //  mode -- without knowing what mode we're in. So first we have
+      //  to enable 8-bit mode and then, knowing we're in 8-bit mode,
+      //  we must set 4-bit mode. Setting 8-bit mode without knowing the
+      //  current mode can be accomplished by sending the mode-setting
+      //  command as three identical 4-bit commands. If we start in 
+      //  8-bit mode, some of these commands are gibberish 8-bit 
+      //  commands with four of their bits set wrongly. But there's still
+      //  enough coherence for the module to get the message with thi
+      //  command sequence. This method of setting the mode is widely
+      //  used, even though it isn't documented, and it seems to work OK. 
+
+      BYTE func = CMD_FUNC | LCD_FUNC_DL; // Set 8-bit mode
+      lcd8574_send_4_bits (self, 0, func >> 4); lcd8574_sleep (self, reset_us);
+      lcd8574_send_4_bits (self, 0, func >> 4); lcd8574_sleep (self, reset_us);
+      lcd8574_send_4_bits (self, 0, func >> 4); lcd8574_sleep (self, reset_us);
+      func = CMD_FUNC | 0; // Set 4-bit mode
+      lcd8574_send_4_bits (self, 0, func >> 4); lcd8574_sleep (self, reset_us);
+
+      // Set more than one row (the LCD only has two line modes, 
+      //  "one" or "more that one")
+      func = CMD_FUNC | LCD_FUNC_N ;
+      // NB -- send_byte sends two 4-bit commands in a row
+      lcd8574_send_byte (self, 0, func); 
+
+      // Clear display, after which we know what's in the whole of DDRAM.
+      lcd8574_send_byte (self, 0, CMD_CLEAR);
+      for (int i = 0; i < LCD_DDRAM_SIZE; i++)
+        self->ddram[i] = ' ';
+      self->ac = 0;
+      self->shift = 0;
+      self->cgram_known = 0;
+      lcd8574_send_mode (self, LCD_MODE_DISPLAY_ON);
+
+      // We might want to set the cursor and shift modes -- but, honestly,
+      //   it's more likely that the user of this class will take care of 
+      //   these things. 
+      //lcd8574_send_byte (self, 0, CMD_ENTRY | LCD_ENTRY_ID);
+      //lcd8574_send_byte (self, 0, CMD_CDSHIFT | LCD_CDSHIFT_RL);
+
+      ret = dual ? lcd8574_init_lower (self, error) : TRUE;
+      self->ready = ret;
+      }
+    else
+      {
+      asprintf (error, "Can't intialize I2C device: %s", strerror (errno));
+      }
+    }
+  else
+    {
+    asprintf (error, "Can't open I2C device: %s", strerror (errno));
+    }
+  if (ret) lcd8574_hist_end (self, LCD8574_OP_INIT, start);
+  return ret;
+  }
+
+/*============================================================================
+  lcd8574_uninit
+============================================================================*/
+void lcd8574_uninit (LCD8574 *self)
+  {
+  assert (self != NULL);
+  lcd8574_stop_async (self);
+  if (self->ready && self->warm && self->state_file && self->bus 
+      && !self->lower)
+    lcd8574_save_state (self);
+  // The lower controller uses our bus, and our trace, so must go first
+  if (self->lower) self->lower->trace = NULL;
+  lcd8574_destroy (self->lower);
+  self->lower = NULL;
+  if (self->own_bus)
+    {
+    lcd8574_bus_destroy (self->bus);
+    self->bus = NULL;
+    self->own_bus = FALSE;
+    }
+  self->ready = FALSE;
+  }
+
+/*============================================================================
+  lcd8574_bus_create
+============================================================================*/
+LCD8574Bus *lcd8574_bus_create (const char *dev)
+  {
+  assert (dev != NULL);
+  LCD8574Bus *self = malloc (sizeof (LCD8574Bus));
+  memset (self, 0, sizeof (LCD8574Bus));
+  self->dev = strdup (dev);
+  self->transport = transport_default ();
+  pthread_mutex_init (&self->lock, NULL);
+  pthread_mutex_init (&self->wlock, NULL);
+  pthread_cond_init (&self->wcond, NULL);
+  return self;
+  }
+
+/*============================================================================
+  lcd8574_bus_destroy
+============================================================================*/
+void lcd8574_bus_destroy (LCD8574Bus *self)
+  {
+  if (self)
+    {
+    lcd8574_bus_stop_worker (self);
+    lcd8574_bus_uninit (self);
+    for (int i = 0; i < self->nmembers; i++)
+      self->members[i]->bus = NULL;
+    pthread_cond_destroy (&self->wcond);
+    pthread_mutex_destroy (&self->wlock);
+    pthread_mutex_destroy (&self->lock);
+    free (self->dev);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  lcd8574_bus_init
+============================================================================*/
+BOOL lcd8574_bus_init (LCD8574Bus *self, char **error)
+  {
+  assert (self != NULL);
+  if (self->handle) return TRUE;
+  self->handle = self->transport->open (self->dev);
+  if (!self->handle)
+    {
+    if (error)
+      asprintf (error, "Can't open I2C device %s: %s", self->dev, 
+        strerror (errno));
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+  lcd8574_bus_uninit
+============================================================================*/
+void lcd8574_bus_uninit (LCD8574Bus *self)
+  {
+  assert (self != NULL);
+  if (self->handle) self->transport->close (self->handle);
+  self->handle = NULL;
+  }
+
+/*============================================================================
+  lcd8574_bus_set_transport
+============================================================================*/
+BOOL lcd8574_bus_set_transport (LCD8574Bus *self, const char *name)
+  {
+  assert (self != NULL);
+  assert (name != NULL);
+  const Transport *t = transport_find (name);
+  if (!t || self->handle) return FALSE;
+  self->transport = t;
+  return TRUE;
+  }
+
+/*============================================================================
+  lcd8574_bus_get_counts
+============================================================================*/
+void lcd8574_bus_get_counts (const LCD8574Bus *self, 
+        LCD8574BusCounts *counts)
+  {
+  assert (self != NULL);
+  memset (counts, 0, sizeof (LCD8574BusCounts));
+  if (self->handle) self->transport->counts (self->handle, counts);
+  }
+
+/*============================================================================
+  lcd8574_bus_get_record
+============================================================================*/
+const BYTE *lcd8574_bus_get_record (const LCD8574Bus *self, int *len)
+  {
+  assert (self != NULL);
+  *len = 0;
+  if (!self->handle || !self->transport->record) return NULL;
+  return self->transport->record (self->handle, len);
+  }
+
+/*============================================================================
+  lcd8574_bus_reset_counts
+============================================================================*/
+void lcd8574_bus_reset_counts (LCD8574Bus *self)
+  {
+  assert (self != NULL);
+  if (self->handle && self->transport->reset) 
+    self->transport->reset (self->handle);
+  }
+
+/*============================================================================
+  lcd8574_set_bus
+============================================================================*/
+BOOL lcd8574_set_bus (LCD8574 *self, LCD8574Bus *bus)
+  {
+  assert (self != NULL);
+  assert (bus != NULL);
+  assert (self->bus == NULL);
+  if (bus->nmembers >= LCD_BUS_MAX) return FALSE;
+  bus->members[bus->nmembers++] = self;
+  self->bus = bus;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcd8574_bus_plan
+
+  Plan the flush of every (synchronous) display on the bus, writing 
+  the controllers that have segments to send into ctls, which must have
+  room for 2 * LCD_BUS_MAX. Returns the number written.
+
+============================================================================*/
+static int lcd8574_bus_plan (LCD8574Bus *self, LCD8574 **ctls)
+  {
+  int n = 0;
+  for (int i = 0; i < self->nmembers; i++)
+    {
+    LCD8574 *m = self->members[i];
+    if (!m->ready || m->async) continue;
+    n += lcd8574_plan_all (m, &m->frames[m->back], ctls + n);
+    }
+  return n;
+  }
+
+/*============================================================================
+
+  lcd8574_bus_repair
+
+  Repair, as lcd8574_repair() describes, every display on the bus that 
+  lcd8574_bus_plan() would have planned
+
+============================================================================*/
+static void lcd8574_bus_repair (LCD8574Bus *self)
+  {
+  for (int i = 0; i < self->nmembers; i++)
+    {
+    LCD8574 *m = self->members[i];
+    if (!m->ready || m->async) continue;
+    lcd8574_repair (m, &m->frames[m->back]);
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_bus_flush
+
+  Flush every (synchronous) display on the bus. First we work out what
+  has to be sent to each display, then we send it a segment at a time,
+  taking each display (and each controller of a 40x4) in turn, as 
+  lcd8574_run_segments() describes.
+
+============================================================================*/
+void lcd8574_bus_flush (LCD8574Bus *self)
+  {
+  assert (self != NULL);
+  LCD8574 *ctls[2 * LCD_BUS_MAX];
+  int n = lcd8574_bus_plan (self, ctls);
+  lcd8574_run_segments (ctls, n);
+  lcd8574_bus_repair (self);
+  }
+
+/*============================================================================
+
+  lcd8574_bus_worker
+
+  The body of a bus's worker thread. Each time a flush is requested, 
+  flush the bus, and tell anybody who's waiting that it's done. If 
+  several flushes were requested while we were busy, one flush covers
+  all of them.
+
+============================================================================*/
+static void *lcd8574_bus_worker (void *arg)
+  {
+  LCD8574Bus *self = arg;
+  pthread_mutex_lock (&self->wlock);
+  for (;;)
+    {
+    while (!self->stop && self->completed == self->requested)
+      pthread_cond_wait (&self->wcond, &self->wlock);
+    if (self->completed == self->requested) break;
+    int target = self->requested;
+    pthread_mutex_unlock (&self->wlock);
+    lcd8574_bus_flush (self);
+    pthread_mutex_lock (&self->wlock);
+    self->completed = target;
+    pthread_cond_broadcast (&self->wcond);
+    }
+  pthread_mutex_unlock (&self->wlock);
+  return NULL;
+  }
+
+/*============================================================================
+  lcd8574_bus_start_worker
+============================================================================*/
+BOOL lcd8574_bus_start_worker (LCD8574Bus *self, char **error)
+  {
+  assert (self != NULL);
+  if (self->has_worker) return TRUE;
+  self->stop = FALSE;
+  int err = pthread_create (&self->worker, NULL, lcd8574_bus_worker, self);
+  if (err != 0)
+    {
+    if (error)
+      asprintf (error, "Can't start worker for %s: %s", self->dev, 
+        strerror (err));
+    return FALSE;
+    }
+  self->has_worker = TRUE;
+  return TRUE;
+  }
+
+/*============================================================================
+  lcd8574_bus_stop_worker
+============================================================================*/
+void lcd8574_bus_stop_worker (LCD8574Bus *self)
+  {
+  assert (self != NULL);
+  if (!self->has_worker) return;
+  pthread_mutex_lock (&self->wlock);
+  self->stop = TRUE;
+  pthread_cond_broadcast (&self->wcond);
+  pthread_mutex_unlock (&self->wlock);
+  pthread_join (self->worker, NULL);
+  self->has_worker = FALSE;
+  }
+
+/*============================================================================
+
+  lcd8574_bus_flush_start
+
+  Ask the worker thread to flush the bus. If there's no worker, just
+  do the flush here.
+
+============================================================================*/
+void lcd8574_bus_flush_start (LCD8574Bus *self)
+  {
+  assert (self != NULL);
+  if (!self->has_worker)
+    {
+    lcd8574_bus_flush (self);
+    return;
+    }
+  pthread_mutex_lock (&self->wlock);
+  self->requested++;
+  pthread_cond_broadcast (&self->wcond);
+  pthread_mutex_unlock (&self->wlock);
+  }
+
+/*============================================================================
+  lcd8574_bus_flush_wait
+============================================================================*/
+void lcd8574_bus_flush_wait (LCD8574Bus *self)
+  {
+  assert (self != NULL);
+  if (!self->has_worker) return;
+  pthread_mutex_lock (&self->wlock);
+  while (self->completed != self->requested)
+    pthread_cond_wait (&self->wcond, &self->wlock);
+  pthread_mutex_unlock (&self->wlock);
+  }
+
+/*============================================================================
+
+  lcd8574_buses_flush
+
+  Flush a set of buses in parallel, if they have worker threads, and 
+  wait for them all to finish. The buses that don't have workers are
+  flushed together, here, so that one bus's displays can be sent to 
+  while another's are busy -- and, with the i2c-uring transport, so
+  that every bus is written at once.
+
+============================================================================*/
+void lcd8574_buses_flush (LCD8574Bus **buses, int n)
+  {
+  LCD8574 *ctls[n * 2 * LCD_BUS_MAX + 1];
+  int nctls = 0;
+  for (int i = 0; i < n; i++)
+    {
+    if (buses[i]->has_worker)
+      lcd8574_bus_flush_start (buses[i]);
+    else
+      nctls += lcd8574_bus_plan (buses[i], ctls + nctls);
+    }
+  lcd8574_run_segments (ctls, nctls);
+  for (int i = 0; i < n; i++)
+    if (!buses[i]->has_worker) lcd8574_bus_repair (buses[i]);
+  for (int i = 0; i < n; i++)
+    lcd8574_bus_flush_wait (buses[i]);
+  }
+
+/*============================================================================
+
+  lcd8574_dlist_create
+
+  Compile a screen template. We build up the bytes in the transmit 
+  buffer, exactly as a flush would if every cell were unknown, and
+  then take a copy of the buffer, and the segments it has been divided
+  into. As we go, we note where in the buffer each cell's data is, so 
+  that fields can be patched later.
+
+============================================================================*/
+LCD8574DisplayList *lcd8574_dlist_create (LCD8574 *self, 
+    const char *const *rows)
+  {
+  assert (self != NULL);
+  assert (rows != NULL);
+  int ncells = self->rows * self->cols;
+  // A display list has to fit into the transmit buffer, with an 
+  //  address command for every row
+  if (self->async || self->lower || (ncells + self->rows) * 4 > LCD_TX_MAX) 
+    return NULL;
+
+  LCD8574DisplayList *dl = malloc (sizeof (LCD8574DisplayList));
+  memset (dl, 0, sizeof (LCD8574DisplayList));
+  dl->lcd = self;
+  dl->cells = malloc (ncells);
+  dl->cell_off = malloc (ncells * sizeof (int));
+  memset (dl->cells, ' ', ncells);
+  for (int row = 0; row < self->rows && rows[row]; row++)
+    {
+    const char *t = rows[row];
+    for (int col = 0; col < self->cols && t[col]; col++)
+      dl->cells[row * self->cols + col] = t[col];
+    }
+
+  int cell_at[LCD_DDRAM_SIZE];
+  for (int i = 0; i < LCD_DDRAM_SIZE; i++)
+    cell_at[i] = -1;
+  for (int row = 0; row < self->rows; row++)
+    {
+    for (int col = 0; col < self->cols; col++)
+      {
+      int cell = row * self->cols + col;
+      int addr = lcd8574_cell_addr (self, row, col, 0);
+      dl->cell_off[cell] = -1;
+      if (lcd8574_addr_valid (addr)) cell_at[addr] = cell;
+      }
+    }
+
+  int ac = LCD_UNKNOWN;
+  int addr = 0;
+  for (int i = 0; i < LCD_DDRAM_CELLS; i++, addr = lcd8574_next_addr (addr))
+    {
+    int cell = cell_at[addr];
+    if (cell < 0) continue;
+    if (ac != addr)
+      lcd8574_tx_byte (self, 0, CMD_SET_DDRAM_ADDR | addr);
+    dl->cell_off[cell] = self->tx_len;
+    lcd8574_tx_byte (self, 1, dl->cells[cell]);
+    ac = lcd8574_next_addr (addr);
+    }
+  lcd8574_tx_mark (self);
+  dl->end_ac = ac;
+
+  dl->len = self->tx_len;
+  dl->bytes = malloc (dl->len);
+  memcpy (dl->bytes, self->tx, dl->len);
+  dl->nsegs = self->nsegs;
+  dl->segs = malloc (dl->nsegs * sizeof (LCD8574Seg));
+  memcpy (dl->segs, self->segs, dl->nsegs * sizeof (LCD8574Seg));
+  dl->commands = self->tx_commands;
+  dl->data = self->tx_data;
+  self->tx_len = 0;
+  self->nsegs = 0;
+  self->seg_next = 0;
+  self->tx_commands = 0;
+  self->tx_data = 0;
+  return dl;
+  }
+
+/*============================================================================
+  lcd8574_dlist_destroy
+============================================================================*/
+void lcd8574_dlist_destroy (LCD8574DisplayList *self)
+  {
+  if (self)
+    {
+    free (self->cells);
+    free (self->cell_off);
+    free (self->bytes);
+    free (self->segs);
+    free (self->fields);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  lcd8574_dlist_add_field
+============================================================================*/
+int lcd8574_dlist_add_field (LCD8574DisplayList *self, int row, int col, 
+      int width)
+  {
+  assert (self != NULL);
+  const LCD8574 *lcd = self->lcd;
+  if (row < 0 || col < 0 || width <= 0 || row >= lcd->rows 
+      || col + width > lcd->cols) 
+    return -1;
+  self->fields = realloc (self->fields, 
+    (self->nfields + 1) * sizeof (*self->fields));
+  self->fields[self->nfields][0] = row;
+  self->fields[self->nfields][1] = col;
+  self->fields[self->nfields][2] = width;
+  return self->nfields++;
+  }
+
+/*============================================================================
+
+  lcd8574_dlist_set_field
+
+  Patch the text of a field into the compiled bytes. This is just the 
+  usual table lookups for each character -- nothing is allocated, and
+  nothing is sent to the LCD.
+
+============================================================================*/
+void lcd8574_dlist_set_field (LCD8574DisplayList *self, int field, 
+      const char *text)
+  {
+  assert (self != NULL);
+  assert (text != NULL);
+  if (field < 0 || field >= self->nfields) return;
+  const LCD8574 *lcd = self->lcd;
+  int cell = self->fields[field][0] * lcd->cols + self->fields[field][1];
+  int width = self->fields[field][2];
+  for (int i = 0; i < width; i++, cell++)
+    {
+    BYTE c = *text ? (BYTE)*text++ : ' ';
+    self->cells[cell] = c;
+    int off = self->cell_off[cell];
+    if (off < 0) continue;
+    BYTE *p = self->bytes + off;
+    int len = lcd8574_encode_4_bits (lcd, 1, c >> 4, p);
+    lcd8574_encode_4_bits (lcd, 1, c, p + len);
+    }
+  }
+
+/*============================================================================
+
+  lcd8574_dlist_play
+
+  Send a compiled display list to the LCD module. With the usual timing
+  profiles, the whole list is one segment, and so one I2C transaction.
+  Afterwards, the whole screen is known to match the display list, so 
+  we update the shadow framebuffer, and what we know of DDRAM, to
+  match.
+
+============================================================================*/
+void lcd8574_dlist_play (LCD8574 *self, const LCD8574DisplayList *dl)
+  {
+  assert (self != NULL);
+  assert (dl != NULL);
+  assert (dl->lcd == self);
+  if (self->async || !self->ready) return;
+
+  // Display lists are compiled for an unshifted display
+  LCD8574Frame *f = &self->frames[self->back];
+  f->marquee_row = -1;
+  f->shift = 0;
+  if (self->shift != 0)
+    {
+    lcd8574_plan_frame (self, f);
+    lcd8574_tx_flush (self);
+    }
+
+  int start = 0;
+  for (int i = 0; i < dl->nsegs; i++)
+    {
+    lcd8574_wait_ready (self);
+    lcd8574_tx_send (self, dl->bytes + start, dl->segs[i].end - start);
+    self->ready_at = lcd8574_now_us() + dl->segs[i].wait;
+    start = dl->segs[i].end;
+    }
+  LCD_COUNT (self, commands, dl->commands);
+  LCD_COUNT (self, data, dl->data);
+  LCD_COUNT (self, flushes, 1);
+
+  BYTE *cells = f->cells;
+  memcpy (cells, dl->cells, self->rows * self->cols);
+  for (int row = 0; row < self->rows; row++)
+    {
+    for (int col = 0; col < self->cols; col++)
+      {
+      int addr = lcd8574_cell_addr (self, row, col, 0);
+      if (lcd8574_addr_valid (addr)) 
+        self->ddram[addr] = cells[row * self->cols + col];
+      }
+    }
+  self->ac = dl->end_ac;
+  }
+
+/*============================================================================
+
+  lcd8574_glyph
+
+  Find a custom character slot containing a particular bitmap. If there
+  isn't one, we store the bitmap in a free slot or, if there are no 
+  free slots, the least-recently used slot that isn't displayed in 
+  any cell of the shadow framebuffer. The bitmap is only uploaded to
+  the LCD module on the next flush, along with any other new glyphs.
+
+============================================================================*/
+int lcd8574_glyph (LCD8574 *self, const BYTE *bitmap)
+  {
+  assert (self != NULL);
+  assert (bitmap != NULL);
+  LCD8574Frame *f = &self->frames[self->back];
+  BYTE g[8];
+  for (int i = 0; i < 8; i++)
+    g[i] = bitmap[i] & 0x1F;
+  self->glyph_clock++;
+
+  for (int slot = 0; slot < LCD_GLYPHS; slot++)
+    {
+    if ((f->cgram_used & (1 << slot)) && memcmp (f->cgram[slot], g, 8) == 0)
+      {
+      self->glyph_used[slot] = self->glyph_clock;
+      return slot;
+      }
+    }
+
+  int victim = -1;
+  for (int slot = 0; slot < LCD_GLYPHS && victim < 0; slot++)
+    if (!(f->cgram_used & (1 << slot))) victim = slot;
+
+  if (victim < 0)
+    {
+    int shown = 0;
+    for (int i = 0; i < self->rows * self->cols; i++)
+      if (f->cells[i] < LCD_GLYPH_CODES) 
+        shown |= 1 << (f->cells[i] % LCD_GLYPHS);
+    for (int slot = 0; slot < LCD_GLYPHS; slot++)
+      {
+      if (shown & (1 << slot)) continue;
+      if (victim < 0 || self->glyph_used[slot] < self->glyph_used[victim])
+        victim = slot;
+      }
+    }
+  if (victim < 0) return -1;
+
+  memcpy (f->cgram[victim], g, 8);
+  f->cgram_used |= 1 << victim;
+  self->glyph_used[victim] = self->glyph_clock;
+  return victim;
+  }
+
+/*============================================================================
+
+  lcd8574_marquee_show
+
+  Copy the visible part of the marquee into its row of the shadow
+  framebuffer
+
+============================================================================*/
+static void lcd8574_marquee_show (LCD8574 *self, LCD8574Frame *f)
+  {
+  BYTE *cells = f->cells + f->marquee_row * self->cols;
+  for (int col = 0; col < self->cols; col++)
+    cells[col] = f->marquee[(f->marquee_pos + col) % f->marquee_len];
+  }
+
+/*============================================================================
+
+  lcd8574_marquee_start
+
+  The display shift command moves each line of the display around its 
+  40 bytes of DDRAM. Text shorter than that is padded out with spaces,
+  so that it doesn't repeat within the line, and each step needs no
+  new character at all. The display stays where it is shifted to; 
+  each step moves it on one place.
+
+============================================================================*/
+BOOL lcd8574_marquee_start (LCD8574 *self, int row, const BYTE *text)
+  {
+  assert (self != NULL);
+  assert (text != NULL);
+  int len = strlen ((const char *)text);
+  if (row < 0 || row >= self->rows || len > LCD_MARQUEE_MAX 
+      || self->cols > LCD_LINE_LEN) 
+    return FALSE;
+  LCD8574Frame *f = &self->frames[self->back];
+  memcpy (f->marquee, text, len);
+  if (len < LCD_LINE_LEN)
+    {
+    memset (f->marquee + len, ' ', LCD_LINE_LEN - len);
+    len = LCD_LINE_LEN;
+    }
+  f->marquee_len = len;
+  f->marquee_pos = 0;
+  f->marquee_row = row;
+  lcd8574_marquee_show (self, f);
+  return TRUE;
+  }
+
+/*============================================================================
+  lcd8574_marquee_step
+============================================================================*/
+void lcd8574_marquee_step (LCD8574 *self)
+  {
+  assert (self != NULL);
+  LCD8574Frame *f = &self->frames[self->back];
+  if (f->marquee_row < 0) return;
+  f->marquee_pos = (f->marquee_pos + 1) % f->marquee_len;
+  f->shift = (f->shift + 1) % LCD_LINE_LEN;
+  lcd8574_marquee_show (self, f);
+  }
+
+/*============================================================================
+  lcd8574_marquee_stop
+============================================================================*/
+void lcd8574_marquee_stop (LCD8574 *self)
+  {
+  assert (self != NULL);
+  LCD8574Frame *f = &self->frames[self->back];
+  f->marquee_row = -1;
+  f->shift = 0;
+  }
@@ -8,8 +8,8 @@
   eight digitial outputs. 
 
   There are many ways to connect the PCF8574 to the HD8840. Please see
-  the definitions at the top of lcd8574.c, to see typical connections 
-  (or edit this file if your connections are different).
+  the definitions at the top of lcd8574.c, to see typical connections.
+  Other wirings can be selected by name, with lcd8574_set_wiring().
 
   This "class" provides the most basic functions available for the
   HD88470 LCD module -- initialization, writing text at specific
@@ -21,8 +21,10 @@
   because the module is essentially useless with it switched off. If a
   pin is wired to the backlight, the code will turn it permanently on. 
   In addition, although both the PCF8574 and the HD44780 have data-read
-  operations, this code makes on use of them. In the modules R/W pin
-  in connected, it is set permanently low, for write mode. 
+  operations, this code makes no use of them by default. If the module's
+  R/W pin is connected, it is held low, for write mode, unless busy-flag
+  polling is enabled with lcd8574_set_busy_poll(), or warm 
+  initialization with lcd8574_set_warm_init(). 
 
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
@@ -30,6 +32,7 @@
   ==========================================================================*/
 #pragma once
 
+#include <stdio.h>
 #include "defs.h"
 
 
@@ -42,6 +45,12 @@
 struct LCD8574;
 typedef struct _LCD8574 LCD8574;
 
+struct LCD8574Bus;
+typedef struct _LCD8574Bus LCD8574Bus;
+
+struct LCD8574DisplayList;
+typedef struct _LCD8574DisplayList LCD8574DisplayList;
+
 BEGIN_DECLS
 
 /** Initialize the LCD8574 object with the numbers of the three GPIO
@@ -52,6 +61,12 @@ BEGIN_DECLS
     ends or bottom of the LCD.  */
 LCD8574  *lcd8574_create (int i2c_addr, int rows, int cols);
 
+/** As _create(), but the I2C device to use is specified (rather than 
+    the default, /dev/i2c-1). This is ignored if the display is later 
+    put on a shared bus using lcd8574_set_bus(). */
+LCD8574  *lcd8574_create_dev (const char *dev, int i2c_addr, int rows, 
+            int cols);
+
 /** Clean up this object. This method implicitly calls _uninit(). */
 void      lcd8574_destroy (LCD8574 *self);
 
@@ -70,7 +85,8 @@ void      lcd8574_uninit (LCD8574 *self);
 /** Write a character at the specified position. Note that the LCD device 
     has, by default, a character set that is a kind of modified ASCII. 
     The method will do nothing if the specific row and column are out of
-    range. */
+    range. Like all the drawing methods, this only updates the shadow
+    framebuffer -- nothing is shown until lcd8574_flush() is called. */
 void      lcd8574_write_char_at (LCD8574 *self, int row, int col, BYTE c);
 
 /** Write a string of ASCII(-ish) characters, starting at the specified
@@ -80,8 +96,52 @@ void      lcd8574_write_char_at (LCD8574 *self, int row, int col, BYTE c);
 void      lcd8574_write_string_at (LCD8574 *self, int row, int col, 
             const BYTE *s, BOOL wrap);
 
+/** Write a UTF-8 string, as _write_string_at() does, showing each 
+    character as the module's character ROM (see lcd8574_set_rom()) 
+    has it. Katakana with a voiced mark take two cells, as they do in 
+    the ROM. Some characters the ROM lacks, such as accented letters 
+    on an A00 module, are shown using custom glyphs, if the glyph cache
+    has room (see lcd8574_glyph()); anything else is shown as '?'. */
+void      lcd8574_write_utf8_at (LCD8574 *self, int row, int col, 
+            const char *s, BOOL wrap);
+
+/** Fill the shadow framebuffer with spaces. */
 void      lcd8574_clear (LCD8574 *self);
 
+/** Send to the LCD module only those character cells that have changed 
+    since they were last sent. In asynchronous mode, this method just 
+    hands the frame to the writer thread, and returns immediately. 
+    Until _init() has succeeded, it does nothing. */
+void      lcd8574_flush (LCD8574 *self);
+
+/** Start asynchronous mode. A writer thread is started, which owns the
+    I2C device from then on. The drawing methods and _set_mode() only 
+    change the shadow framebuffer, and _flush() publishes it to the writer 
+    thread without blocking. If frames are published faster than the
+    writer can send them, the writer skips to the latest one. This
+    method should be called after _init(), and can fail if the thread
+    cannot be started. */
+BOOL      lcd8574_start_async (LCD8574 *self, char **error);
+
+/** Set how the writer thread of asynchronous mode is scheduled, so that
+    a busy system doesn't stretch the gaps in an update. If priority is
+    more than zero, the writer runs with that SCHED_FIFO priority 
+    (1-99); if cpu is not -1, it is pinned to that CPU; and if lock is
+    TRUE, all the process's memory, present and future, is locked into
+    RAM, so that a flush never waits for a page fault. The flush path
+    doesn't allocate memory. The first two need CAP_SYS_NICE, and the 
+    third CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK; without them,
+    _start_async() fails. This method should be called before 
+    _start_async(), and returns FALSE if priority or cpu is out of 
+    range. */
+BOOL      lcd8574_set_realtime (LCD8574 *self, int priority, int cpu, 
+            BOOL lock);
+
+/** Leave asynchronous mode. This method waits for the writer thread to
+    send the last frame that was published, and stop. It is called
+    implicitly by _uninit(). */
+void      lcd8574_stop_async (LCD8574 *self);
+
 /** Sets the display mode control register. This allows the display to
     be turned on and off, and the cursor mode to be set. These functions
     don't naturally go together -- they just happen to be sent to the
@@ -90,11 +150,342 @@ void      lcd8574_clear (LCD8574 *self);
     hugely convenient. */ 
 void      lcd8574_set_mode (LCD8574 *self, BYTE mode);
 
+/** Like _set_mode(), but the mode only goes into the shadow framebuffer,
+    as the drawing methods do, even in synchronous mode, and is sent 
+    with the next flush -- and not at all, if it's changed back first. 
+    For applications whose flushes are paced, so that the bus traffic 
+    they cause is bounded. */
+void      lcd8574_draw_mode (LCD8574 *self, BYTE mode);
+
 /** Set the cursor position. The cursor must have been set visible for
     this method to show any effect. Note that the HD44780 LCD module does
     not have a specific method to set the cursor position -- it just follows
-    the text. The method I use is a hack. */
+    the text. So the cursor is moved to this position at the end of each 
+    flush. */
 void      lcd8574_set_cursor (LCD8574 *self, int row, int col);
 
+/** Select the timing profile that determines how long the driver waits
+    for the LCD module to execute each instruction. The profiles are
+    "datasheet" (the default), "conservative" for slow clone modules, 
+    and "fast-clone" for modules that are faster than the datasheet
+    says. This method should be called after _create() and before 
+    _init(). Returns FALSE if the profile name is not known. */
+BOOL      lcd8574_set_timing (LCD8574 *self, const char *profile);
+
+/** Load a timing profile from a file written by lcd8574_save_timing(),
+    in place of one of the built-in profiles. This method should be
+    called after _create() and before _init(). If it fails, the timing
+    is unchanged, and *error, if not NULL, is written with an error 
+    message that the caller should free. */
+BOOL      lcd8574_load_timing (LCD8574 *self, const char *file, 
+            char **error);
+
+/** Save the current timing profile -- usually, one found by 
+    lcd8574_calibrate() -- to a file. */
+BOOL      lcd8574_save_timing (const LCD8574 *self, const char *file, 
+            char **error);
+
+/** Find the shortest time the LCD module reliably takes to execute 
+    each kind of instruction, and use those times, plus margin_pct 
+    percent, as the timing profile. Each time is found by a binary
+    search, starting from what the busy flag reports, if it can be 
+    read; at each step, a test pattern is written with that time, and
+    read back to see if it arrived intact. So the module's R/W pin must
+    be wired to the PCF8574. The times include whatever the transport
+    and bus take, so a profile is only good for the bus it was measured
+    on. This method must be called after _init(), in synchronous mode,
+    and takes a few seconds. Afterwards, the display is cleared, and 
+    the next flush redraws it. */
+BOOL      lcd8574_calibrate (LCD8574 *self, int margin_pct, char **error);
+
+/** Enable or disable busy-flag polling. When enabled, the driver reads
+    the HD44780 busy flag through the PCF8574 rather than waiting for the
+    time the timing profile allows, so it can continue as soon as each
+    instruction has really finished. This needs the module's R/W pin to 
+    be wired to the PCF8574 -- if PIN_RW is -1, this method does
+    nothing. If the busy flag can't be read, the driver falls back to
+    timed waits. */
+void      lcd8574_set_busy_poll (LCD8574 *self, BOOL poll);
+
+/** Select the way the LCD module is wired to the PCF8574 outputs. The
+    profiles are "standard" (the default, and the most common), "mjkdz"
+    (mjkdz and GY-LCD backpacks), "standard-norw" (the standard wiring
+    with the module's R/W pin tied low), and "dual-e" (for 40x4 modules
+    with two controllers: the standard wiring, but with the second
+    controller's E on the PCF8574 output that would be R/W). With
+    "dual-e", and more than two rows, the two controllers are flushed
+    together, each being sent bytes while the other is busy. Display lists
+    and warm initialization are not available for such modules. This
+    method should be called after _create() and before _init(). Returns
+    FALSE if the profile name is not known. */
+BOOL      lcd8574_set_wiring (LCD8574 *self, const char *profile);
+
+/** Enable or disable warm initialization. When enabled, _init() tries
+    to take over the LCD module as the last process left it -- skipping
+    the resync and the clear, which take tens of milliseconds -- and
+    adopts what the module is showing as the contents of the shadow
+    framebuffer. If the R/W pin is wired, the module's state is checked
+    by reading it back; otherwise we depend on the state that the last
+    process wrote to state_file in _uninit(). state_file can be NULL,
+    in which case nothing is saved, and a warm start is only possible
+    with R/W wired. If the module's state can't be confirmed, the
+    usual full initialization is done. This method should be called 
+    after _create() and before _init(). */
+void      lcd8574_set_warm_init (LCD8574 *self, BOOL warm, 
+            const char *state_file);
+
+/** Counts of what the driver has done for one display, since it was
+    created, or the counts were last reset */
+typedef struct _LCD8574Stats
+  {
+  long long bytes; // PCF8574 bytes written
+  long long xfers; // I2C transactions -- one ioctl() each, usually
+  long long failed; // Transactions that failed
+  long long commands; // LCD instructions sent
+  long long data; // LCD data bytes sent
+  long long sleep_us; // Time spent sleeping, waiting for the LCD module
+  long long flushes; // Frames sent
+  long long resyncs; // Times the LCD module was resynced after a failure
+  } LCD8574Stats;
+
+/** Read the display's counters. The counters are updated without
+    locks, so they can be read at any time, from any thread, but a
+    set of counts read while the display is being updated might not
+    all belong to the same instant. */
+void      lcd8574_get_stats (const LCD8574 *self, LCD8574Stats *stats);
+
+/** Set all the display's counters to zero */
+void      lcd8574_reset_stats (LCD8574 *self);
+
+/** Operations whose latency can be recorded, with 
+    lcd8574_enable_histograms(). In asynchronous mode, the flush latency
+    is from the call to lcd8574_flush() to the end of the transfer to 
+    the LCD module. */
+#define LCD8574_OP_WRITE   0 // lcd8574_write_string_at()
+#define LCD8574_OP_CLEAR   1 // lcd8574_clear()
+#define LCD8574_OP_MODE    2 // lcd8574_set_mode()
+#define LCD8574_OP_FLUSH   3 // lcd8574_flush()
+#define LCD8574_OP_INIT    4 // lcd8574_init()
+#define LCD8574_OP_COUNT   5
+
+/** Start recording a latency histogram for each of the LCD8574_OP_XXX
+    operations, timed with CLOCK_MONOTONIC. This takes a few kB of 
+    memory, and adds two clock reads to each operation. It should be 
+    called after _create() and before _init(). */
+void      lcd8574_enable_histograms (LCD8574 *self);
+
+/** Get the latency (nsec) below which the fraction p (0-1) of the 
+    recorded op operations completed. Returns -1 if histograms are not 
+    enabled, and 0 if there have been no such operations. */
+long long lcd8574_get_latency (const LCD8574 *self, int op, double p);
+
+/** Write a summary of the histograms to f, one line per operation */
+void      lcd8574_write_histograms (const LCD8574 *self, FILE *f);
+
+/** Forget everything in the histograms */
+void      lcd8574_reset_histograms (LCD8574 *self);
+
+/** Start recording every PCF8574 byte in a ring buffer with room for
+    at least the specified number of bytes -- eight bytes of memory 
+    each. Recording involves no allocation or syscalls, so it can be
+    left on. It should be called after _create() and before _init(). 
+    On a 40x4 module, both controllers record into the same ring. */
+void      lcd8574_enable_trace (LCD8574 *self, int entries);
+
+/** Write the trace ring to a file, in the format that lcd8574-trace 
+    reads. Returns FALSE, and writes *error, if tracing is not enabled,
+    or the file can't be written. */
+BOOL      lcd8574_write_trace (const LCD8574 *self, const char *file, 
+            char **error);
+
+/** Select the transport for the display's private bus -- see 
+    lcd8574_bus_set_transport(). This method should be called after 
+    _create() and before _init(). It has no effect on a shared bus. */
+BOOL      lcd8574_set_transport (LCD8574 *self, const char *name);
+
+/** Get the number of rows and columns the display was created with */
+int       lcd8574_get_rows (const LCD8574 *self);
+int       lcd8574_get_cols (const LCD8574 *self);
+
+/** Select the LCD module's character ROM, for lcd8574_write_utf8_at():
+    "a00" (the default), the common one, with katakana, or "a02", with
+    European characters. The ROM code is usually printed on the 
+    controller chip, for example HD44780UA00. Returns FALSE if the 
+    name is not known. */
+BOOL      lcd8574_set_rom (LCD8574 *self, const char *rom);
+
+/** Set the DDRAM address of the start of each row. By default, the 
+    first two rows start at 0x00 and 0x40, and the third and fourth
+    follow on from them -- at 0x14 and 0x54 on a 20x4 display, or 0x10
+    and 0x50 on a 16x4. This method is only needed for modules that 
+    are addressed in some other way. offsets must have an entry for 
+    each row (up to four). It should be called after _create() and 
+    before _init(), and has no effect on the lower rows of a "dual-e"
+    module. */
+void      lcd8574_set_row_offsets (LCD8574 *self, const int *offsets);
+
+/** Set the longest I2C message that will be offered to the I2C adapter.
+    Text is sent as one I2C_RDWR transaction, split into messages no
+    longer than this. The default is 8192 bytes, which is the limit of
+    the i2c-dev driver, but some adapters have lower limits. */
+void      lcd8574_set_max_msg (LCD8574 *self, int len);
+
+/** Counts of what has been sent over a bus. Only the "mock", "model",
+    and "gpio" transports keep these. For gpio, xfers counts ioctls, 
+    and bytes counts PCF8574 bytes, as if there were one. */
+typedef struct _LCD8574BusCounts
+  {
+  long long xfers; // Transactions -- one syscall each, for i2c-dev
+  long long bytes; // Bytes written to the bus, not including addresses
+  long long reads; // Bytes read from the bus
+  long long bus_us; // Time (usec) the bus was busy, for the model
+  } LCD8574BusCounts;
+
+/** Create a bus object, which owns the I2C device with the specified 
+    name (e.g., /dev/i2c-1), so that several displays can share it. 
+    Note that this method only stores values, and will always succeed. */
+LCD8574Bus *lcd8574_bus_create (const char *dev);
+
+/** Clean up the bus object. This method implicitly calls _uninit(). It
+    should be called after the displays on the bus have been destroyed. */
+void      lcd8574_bus_destroy (LCD8574Bus *self);
+
+/** Open the I2C device. This method can fail, and if it does, and 
+    *error is not NULL, it is written with an error message that the
+    caller should free. It is called implicitly by lcd8574_init(), if 
+    the bus is not already open. */
+BOOL      lcd8574_bus_init (LCD8574Bus *self, char **error);
+
+/** Close the I2C device */
+void      lcd8574_bus_uninit (LCD8574Bus *self);
+
+/** Select the transport that carries the bus's I2C transactions:
+    "i2c-dev" (the default) uses the kernel's i2c-dev driver; "mock"
+    records the bytes that would have been sent, without sending them
+    anywhere; and "model" does the same, but takes as long as a 100kHz bus
+    would. For the mock and the model, the device name is ignored. "gpio"
+    drives the LCD module's pins directly from GPIO lines, with no
+    PCF8574; its device name is the GPIO chip, then the lines for RS, E,
+    and D4-D7 (or, for 8-bit mode, D0-D7), like this:
+    "/dev/gpiochip0:7,8,25,24,23,18". On a Raspberry Pi, the chip can be
+    "/dev/gpiomem", to write the GPIO registers directly, with no
+    syscalls. The display must use the standard wiring profile (or
+    "standard-norw"), or _init() fails; RW must be tied low, so the busy
+    flag can't be read, and warm initialization is not possible, so both
+    are turned off. The I2C address is ignored. "i2c-uring" is i2c-dev,
+    but flushes are sent using io_uring, with the LCD module's execution
+    times as kernel timeouts, so the flushing thread doesn't sleep, and
+    lcd8574_buses_flush() writes every bus at once, from one thread; it
+    needs Linux 5.16 or later, and on older kernels _bus_init() fails, so
+    the application can use "i2c-dev" instead. This method must be called
+    before _bus_init(), and fails if the transport name is not known. */
+BOOL      lcd8574_bus_set_transport (LCD8574Bus *self, const char *name);
+
+/** Read the bus counts (see LCD8574BusCounts) */
+void      lcd8574_bus_get_counts (const LCD8574Bus *self, 
+            LCD8574BusCounts *counts);
+
+/** Get the bytes the "mock" or "model" transport has recorded (up to 
+    64kB) since the last reset. Returns NULL for the i2c-dev transport. */
+const BYTE *lcd8574_bus_get_record (const LCD8574Bus *self, int *len);
+
+/** Clear the bus counts and the recording */
+void      lcd8574_bus_reset_counts (LCD8574Bus *self);
+
+/** Put a display on a shared bus, rather than the private bus it would
+    otherwise use. This method must be called after lcd8574_create()
+    and before lcd8574_init(). It fails if the bus already has as many 
+    displays as it can handle (16). */
+BOOL      lcd8574_set_bus (LCD8574 *self, LCD8574Bus *bus);
+
+/** Flush all the displays on the bus that are not in asynchronous 
+    mode. Transfers to different displays are interleaved, so that 
+    while one display is busy executing an instruction, another can 
+    be sent its data. */
+void      lcd8574_bus_flush (LCD8574Bus *self);
+
+/** Start a worker thread for this bus, which does the bus's flushes 
+    when asked to by _bus_flush_start(). With a worker on each bus, 
+    displays on different I2C adapters are updated in parallel. 
+    This method can fail if the thread cannot be started. */
+BOOL      lcd8574_bus_start_worker (LCD8574Bus *self, char **error);
+
+/** Stop the worker thread, after it has finished any flush in progress.
+    This method is called implicitly by _bus_destroy(). */
+void      lcd8574_bus_stop_worker (LCD8574Bus *self);
+
+/** Ask the bus's worker thread to flush the bus, and return without
+    waiting. If there is no worker, the flush is done before this method
+    returns. The caller should not draw on the bus's displays until
+    _bus_flush_wait() has returned. */
+void      lcd8574_bus_flush_start (LCD8574Bus *self);
+
+/** Wait for all flushes requested of the bus's worker to be done. */
+void      lcd8574_bus_flush_wait (LCD8574Bus *self);
+
+/** Flush a set of buses, in parallel, and wait until all of them have
+    finished. Buses with worker threads are flushed by their workers;
+    the rest are flushed together, by the caller. */
+void      lcd8574_buses_flush (LCD8574Bus **buses, int n);
+
+/** Get the character code (0-7) of a custom character with the specified
+    bitmap, which is eight bytes, one for each row of the character, 
+    top first, with the five pixels of each row in the low five bits. 
+    The driver caches up to eight bitmaps in the LCD module's CGRAM; 
+    if this one isn't cached, it replaces the least-recently used 
+    bitmap that isn't on the screen. New bitmaps are uploaded on the 
+    next flush. Returns -1 if all eight custom characters are in use 
+    on the screen. */
+int       lcd8574_glyph (LCD8574 *self, const BYTE *bitmap);
+
+/** Start a marquee -- text that scrolls from right to left along one row. 
+    The text (up to 256 characters) is loaded into the LCD module's 
+    memory, including the part that is off the screen, and is scrolled
+    using the module's display shift command, so each step usually costs
+    only one command byte, plus one character if the text is longer than
+    40 characters. Because the LCD module shifts all rows together, 
+    that's only done while the other rows are blank; otherwise the 
+    display is left unshifted, and each step rewrites the marquee row.
+    This method only changes the shadow framebuffer,
+    and returns FALSE if the row or the text length is out of range. */
+BOOL      lcd8574_marquee_start (LCD8574 *self, int row, const BYTE *text);
+
+/** Move the marquee one place to the left. Call _flush() to show it. */
+void      lcd8574_marquee_step (LCD8574 *self);
+
+/** Stop the marquee, and return the display to its unshifted position.
+    The marquee row keeps whatever text it is showing. */
+void      lcd8574_marquee_stop (LCD8574 *self);
+
+/** Compile a screen template into a display list: the exact bytes that 
+    must be sent to the PCF8574 to draw it. rows is an array of strings,
+    one for each row of the display; a NULL entry ends the array early, 
+    and short rows are padded with spaces. The display list can only
+    be played on the display it was compiled for, and the display must
+    be initialized, and not in asynchronous mode. The method returns
+    NULL if the display is in asynchronous mode, or too big for a
+    display list. */
+LCD8574DisplayList *lcd8574_dlist_create (LCD8574 *self, 
+            const char *const *rows);
+
+/** Clean up a display list. */
+void      lcd8574_dlist_destroy (LCD8574DisplayList *self);
+
+/** Mark part of a row of a display list as a field, whose text can be 
+    changed with _dlist_set_field(). Returns a field number, or -1 if 
+    the field does not fit on the display. */
+int       lcd8574_dlist_add_field (LCD8574DisplayList *self, int row, 
+            int col, int width);
+
+/** Change the text in a field. The text is truncated or padded with
+    spaces to the width of the field. Only the compiled bytes are 
+    changed; nothing is sent to the display. */
+void      lcd8574_dlist_set_field (LCD8574DisplayList *self, int field, 
+            const char *text);
+
+/** Send a display list to the display. The shadow framebuffer is updated
+    to match what is now on the display. Any marquee is stopped. */
+void      lcd8574_dlist_play (LCD8574 *self, const LCD8574DisplayList *dl);
+
 END_DECLS
 
@@ -0,0 +1,488 @@
+/*============================================================================
+
+    lcdd.c
+
+    Implementation of the display daemon that is specified in lcdd.h,
+    and of the client side of its protocol.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "defs.h"
+#include "lcd8574.h"
+#include "lcdd.h"
+#include "lcdshm.h"
+
+// How many times we'll try to get a consistent copy of the shared
+//  framebuffer in one tick, before leaving it until the next one
+#define LCDD_SHM_TRIES 100
+
+// Set by the signal handler, to make lcdd_run() return
+static volatile sig_atomic_t lcdd_quit = 0;
+// Set by the signal handler, to make lcdd_run() write the statistics
+static volatile sig_atomic_t lcdd_dump = 0;
+// Set by the signal handler, to make lcdd_run() write the trace
+static volatile sig_atomic_t lcdd_dump_trace = 0;
+
+/*============================================================================
+
+  lcdd_on_signal
+
+============================================================================*/
+static void lcdd_on_signal (int sig)
+  {
+  if (sig == SIGUSR1)
+    lcdd_dump = 1;
+  else if (sig == SIGUSR2)
+    lcdd_dump_trace = 1;
+  else
+    lcdd_quit = 1;
+  }
+
+/*============================================================================
+
+  lcdd_write_stats
+
+  Write the display's counters and histograms to stats_file or, if it 
+  is NULL, to stderr. The file is written under a temporary name, and 
+  then renamed, so anything reading it never sees half of it.
+
+============================================================================*/
+static void lcdd_write_stats (LCD8574 *lcd, const char *stats_file)
+  {
+  char *tmp = NULL;
+  FILE *f = stderr;
+  if (stats_file)
+    {
+    asprintf (&tmp, "%s.tmp", stats_file);
+    f = fopen (tmp, "w");
+    if (!f)
+      {
+      free (tmp);
+      return;
+      }
+    }
+
+  LCD8574Stats st;
+  lcd8574_get_stats (lcd, &st);
+  fprintf (f, "bytes %lld\nxfers %lld\nfailed %lld\ncommands %lld\n"
+    "data %lld\nsleep_us %lld\nflushes %lld\nresyncs %lld\n", st.bytes, 
+    st.xfers, st.failed, st.commands, st.data, st.sleep_us, st.flushes, 
+    st.resyncs);
+  lcd8574_write_histograms (lcd, f);
+
+  if (stats_file)
+    {
+    fclose (f);
+    rename (tmp, stats_file);
+    free (tmp);
+    }
+  }
+
+/*============================================================================
+
+  lcdd_now_us
+
+============================================================================*/
+static long long lcdd_now_us (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+
+  lcdd_make_addr
+
+  Fill in a Unix socket address. Returns FALSE if the path is too long.
+
+============================================================================*/
+static BOOL lcdd_make_addr (struct sockaddr_un *addr, const char *path)
+  {
+  memset (addr, 0, sizeof (struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr->sun_path)) return FALSE;
+  strcpy (addr->sun_path, path);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcdd_check_stale
+
+  See whether there's something at addr that would stop us binding. A
+  socket left behind by a daemon that didn't exit cleanly refuses
+  connections, and we remove it; a daemon that's still running accepts
+  them, and we leave it alone. Anything else -- including a file that 
+  isn't a socket, which refuses connections as well -- is left for 
+  bind() to complain about. Returns FALSE, and writes *error, if a daemon is
+  already listening.
+
+============================================================================*/
+static BOOL lcdd_check_stale (const struct sockaddr_un *addr, 
+    char **error)
+  {
+  int fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return TRUE;
+  BOOL ret = TRUE;
+  if (connect (fd, (const struct sockaddr *)addr, sizeof (*addr)) == 0)
+    {
+    asprintf (error, "Daemon already running on %s", addr->sun_path);
+    ret = FALSE;
+    }
+  else if (errno == ECONNREFUSED)
+    {
+    struct stat sb;
+    if (lstat (addr->sun_path, &sb) == 0 && S_ISSOCK (sb.st_mode))
+      unlink (addr->sun_path);
+    }
+  close (fd);
+  return ret;
+  }
+
+/*============================================================================
+
+  lcdd_apply
+
+  Apply one update from a client to the shadow framebuffer. Returns
+  TRUE if the update was understood. Nothing is sent to the LCD module.
+
+============================================================================*/
+static BOOL lcdd_apply (LCD8574 *lcd, const BYTE *msg, int len)
+  {
+  if (len < (int)sizeof (LCDDHeader)) return FALSE;
+  const LCDDHeader *h = (const LCDDHeader *)msg;
+  switch (h->op)
+    {
+    case LCDD_OP_TEXT:
+      {
+      BYTE text[LCDD_MSG_MAX + 1];
+      int n = len - sizeof (LCDDHeader);
+      memcpy (text, msg + sizeof (LCDDHeader), n);
+      text[n] = 0;
+      lcd8574_write_utf8_at (lcd, h->row, h->col, (char *)text, 
+        h->arg != 0);
+      return TRUE;
+      }
+    case LCDD_OP_CLEAR:
+      lcd8574_clear (lcd);
+      return TRUE;
+    case LCDD_OP_MODE:
+      // Sent with the next paced flush, however many clients send
+      lcd8574_draw_mode (lcd, h->arg & (LCD_MODE_DISPLAY_ON 
+        | LCD_MODE_CURSOR_ON | LCD_MODE_CURSOR_BLINK));
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+
+  lcdd_shm_create
+
+  Create and map the shared-memory framebuffer, filled with spaces. The
+  magic number goes in last, so a producer can't map it before it is 
+  ready.
+
+============================================================================*/
+static LCDShm *lcdd_shm_create (const char *name, int rows, int cols,
+    int mode, char **error)
+  {
+  if (rows > LCDSHM_ROWS_MAX || cols > LCDSHM_COLS_MAX)
+    {
+    asprintf (error, "Display is too large for shared memory");
+    return NULL;
+    }
+  shm_unlink (name);
+  int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, mode);
+  // The umask applies to shm_open(), and a group that is meant to be 
+  //  able to write would usually lose that
+  if (fd >= 0 && fchmod (fd, mode) < 0)
+    {
+    close (fd);
+    shm_unlink (name);
+    fd = -1;
+    }
+  if (fd < 0)
+    {
+    asprintf (error, "Can't create shared memory %s: %s", name, 
+      strerror (errno));
+    return NULL;
+    }
+  size_t size = lcdshm_size (rows, cols);
+  LCDShm *fb = MAP_FAILED;
+  if (ftruncate (fd, size) == 0)
+    fb = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (fb == MAP_FAILED)
+    {
+    asprintf (error, "Can't map shared memory %s: %s", name, 
+      strerror (errno));
+    shm_unlink (name);
+    return NULL;
+    }
+  fb->rows = rows;
+  fb->cols = cols;
+  atomic_init (&fb->seq, 0);
+  for (int r = 0; r < LCDSHM_ROWS_MAX; r++)
+    atomic_init (&fb->dirty[r], 0);
+  memset (fb->cells, ' ', rows * cols);
+  atomic_store (&fb->magic, LCDSHM_MAGIC);
+  return fb;
+  }
+
+/*============================================================================
+
+  lcdd_shm_apply
+
+  Copy the cells that producers have changed into the shadow 
+  framebuffer. We take the dirty bits, and copy the rows they belong
+  to, while the sequence counter is even and doesn't change. If a 
+  producer gets in the way, we try again, keeping the bits we've 
+  already taken. If we can't get a consistent copy at all -- a producer
+  that died in the middle of an update would leave the counter odd --
+  the bits are put back for the next tick. Returns TRUE if any cells 
+  were changed.
+
+============================================================================*/
+static BOOL lcdd_shm_apply (LCD8574 *lcd, LCDShm *fb)
+  {
+  uint64_t pending[LCDSHM_ROWS_MAX] = { 0 };
+  char cells[LCDSHM_ROWS_MAX * LCDSHM_COLS_MAX];
+  int rows = fb->rows, cols = fb->cols;
+
+  for (int tries = 0; tries < LCDD_SHM_TRIES; tries++)
+    {
+    unsigned seq = atomic_load_explicit (&fb->seq, memory_order_acquire);
+    if (seq & 1)
+      {
+      sched_yield ();
+      continue;
+      }
+    BOOL any = FALSE;
+    for (int r = 0; r < rows; r++)
+      {
+      pending[r] |= atomic_exchange_explicit (&fb->dirty[r], 0, 
+        memory_order_acquire);
+      if (pending[r]) 
+        {
+        memcpy (cells + r * cols, fb->cells + r * cols, cols);
+        any = TRUE;
+        }
+      }
+    atomic_thread_fence (memory_order_acquire);
+    if (atomic_load_explicit (&fb->seq, memory_order_relaxed) != seq)
+      continue;
+
+    for (int r = 0; r < rows; r++)
+      for (int c = 0; c < cols; c++)
+        if (pending[r] & ((uint64_t)1 << c))
+          lcd8574_write_char_at (lcd, r, c, cells[r * cols + c]);
+    return any;
+    }
+
+  for (int r = 0; r < rows; r++)
+    if (pending[r])
+      atomic_fetch_or (&fb->dirty[r], pending[r]);
+  return FALSE;
+  }
+
+/*============================================================================
+
+  lcdd_run
+
+  Wait for datagrams until the next tick, merging each one into the
+  shadow framebuffer as it arrives. At each tick, flush the display if
+  any update has arrived since the last one. Clients that update more
+  often than the frame rate just overwrite each other's cells in the
+  shadow, and only the final state gets to the LCD module. If we fall
+  behind -- because the flush was slow, say -- we skip the ticks we
+  missed, rather than flushing several times in a row to catch up.
+
+============================================================================*/
+BOOL lcdd_run (LCD8574 *lcd, const LCDDConfig *config, char **error)
+  {
+  const char *path = config->socket;
+  const char *shm_name = config->shm_name;
+  const char *stats_file = config->stats_file;
+  int rate = config->rate;
+  struct sockaddr_un addr;
+  if (!lcdd_make_addr (&addr, path))
+    {
+    asprintf (error, "Socket name too long: %s", path);
+    return FALSE;
+    }
+  int fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    {
+    asprintf (error, "Can't create socket: %s", strerror (errno));
+    return FALSE;
+    }
+  if (!lcdd_check_stale (&addr, error))
+    {
+    close (fd);
+    return FALSE;
+    }
+  if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+    {
+    asprintf (error, "Can't bind socket %s: %s", path, strerror (errno));
+    close (fd);
+    return FALSE;
+    }
+  // Anybody who can write the socket can write to the display, and the 
+  //  umask might well have let everybody do that
+  if (chmod (path, config->socket_mode ? config->socket_mode 
+        : LCDD_SOCKET_MODE) < 0)
+    {
+    asprintf (error, "Can't set permissions on socket %s: %s", path, 
+      strerror (errno));
+    close (fd);
+    unlink (path);
+    return FALSE;
+    }
+
+  LCDShm *fb = NULL;
+  if (shm_name)
+    {
+    fb = lcdd_shm_create (shm_name, lcd8574_get_rows (lcd), 
+      lcd8574_get_cols (lcd), 
+      config->shm_mode ? config->shm_mode : LCDD_SHM_MODE, error);
+    if (!fb)
+      {
+      close (fd);
+      unlink (path);
+      return FALSE;
+      }
+    }
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = lcdd_on_signal;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGUSR1, &sa, NULL);
+  sigaction (SIGUSR2, &sa, NULL);
+
+  if (rate <= 0) rate = LCDD_RATE;
+  long long period = 1000000 / rate;
+  long long next = lcdd_now_us() + period;
+  BOOL dirty = FALSE;
+  lcdd_quit = 0;
+
+  while (!lcdd_quit)
+    {
+    if (lcdd_dump)
+      {
+      lcdd_dump = 0;
+      lcdd_write_stats (lcd, stats_file);
+      }
+    if (lcdd_dump_trace)
+      {
+      lcdd_dump_trace = 0;
+      char *terr = NULL;
+      if (config->trace_file 
+          && !lcd8574_write_trace (lcd, config->trace_file, &terr))
+        {
+        fprintf (stderr, "lcdd: %s\n", terr);
+        free (terr);
+        }
+      }
+    long long now = lcdd_now_us();
+    if (now >= next)
+      {
+      if (fb && lcdd_shm_apply (lcd, fb)) dirty = TRUE;
+      if (dirty) lcd8574_flush (lcd);
+      dirty = FALSE;
+      next += period;
+      if (next <= now) next = now + period;
+      continue;
+      }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    long long wait = next - now;
+    struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+    if (ppoll (&pfd, 1, &ts, NULL) <= 0) continue;
+
+    // Take everything that has arrived, not just one datagram, so a
+    //  burst of updates costs only one wakeup
+    BYTE msg[LCDD_MSG_MAX];
+    int len;
+    while ((len = recv (fd, msg, sizeof (msg), MSG_DONTWAIT)) >= 0)
+      {
+      if (lcdd_apply (lcd, msg, len)) dirty = TRUE;
+      }
+    }
+
+  if (stats_file) lcdd_write_stats (lcd, stats_file);
+  if (fb)
+    {
+    lcdshm_close (fb);
+    shm_unlink (shm_name);
+    }
+  close (fd);
+  unlink (path);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  lcdd_send
+
+============================================================================*/
+BOOL lcdd_send (const char *path, int op, int row, int col, int arg,
+        const char *text, char **error)
+  {
+  struct sockaddr_un addr;
+  if (!lcdd_make_addr (&addr, path))
+    {
+    asprintf (error, "Socket name too long: %s", path);
+    return FALSE;
+    }
+
+  BYTE msg[LCDD_MSG_MAX];
+  LCDDHeader *h = (LCDDHeader *)msg;
+  h->op = op;
+  h->row = row;
+  h->col = col;
+  h->arg = arg;
+  int len = sizeof (LCDDHeader);
+  if (text)
+    {
+    int n = strlen (text);
+    if (n > LCDD_MSG_MAX - len) n = LCDD_MSG_MAX - len;
+    memcpy (msg + len, text, n);
+    len += n;
+    }
+
+  BOOL ret = FALSE;
+  int fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0)
+    {
+    if (sendto (fd, msg, len, 0, (struct sockaddr *)&addr,
+          sizeof (addr)) == len)
+      ret = TRUE;
+    else
+      asprintf (error, "Can't send to %s: %s", path, strerror (errno));
+    close (fd);
+    }
+  else
+    {
+    asprintf (error, "Can't create socket: %s", strerror (errno));
+    }
+  return ret;
+  }
+
@@ -0,0 +1,103 @@
+/*============================================================================
+
+    lcdd.h
+
+    The display daemon, which owns an LCD8574 and draws on it on behalf
+    of other processes. Clients send region updates to the daemon's
+    Unix datagram socket. The daemon merges them into the display's
+    shadow framebuffer, and flushes at a fixed frame rate, so the bus
+    traffic never exceeds one frame per tick, however many clients
+    there are, and however often they send updates.
+
+    Each datagram holds one update: an LCDDHeader, followed (for
+    LCDD_OP_TEXT) by the text, in UTF-8, which is not NUL-terminated --
+    its length is whatever is left of the datagram.
+
+    The daemon can also offer a shared-memory framebuffer (see
+    lcdshm.h), for producers that update too often to pay for a
+    syscall each time.
+
+    On SIGUSR1, the daemon writes the display's counters and latency
+    histograms to its stats file or, if it doesn't have one, to stderr.
+    On SIGUSR2, it writes the display's trace ring to its trace file.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "lcd8574.h"
+
+// The socket that the daemon listens on, unless told otherwise
+#define LCDD_SOCKET "/tmp/lcdd.sock"
+
+// The permissions of the socket, unless told otherwise. As with the
+//  shared memory, anybody who can write it can write to the display
+#define LCDD_SOCKET_MODE 0660
+
+// The default frame rate, in flushes per second
+#define LCDD_RATE 20
+
+// The permissions of the shared-memory framebuffer, unless told 
+//  otherwise. Anybody who can write it can write to the display, so 
+//  it's only for the daemon's user, and its group
+#define LCDD_SHM_MODE 0660
+
+// The longest datagram the daemon will accept
+#define LCDD_MSG_MAX 256
+
+// Update operations
+// Write text at row, col. If arg is non-zero, the text wraps onto
+//  the next row
+#define LCDD_OP_TEXT  1
+// Clear the display
+#define LCDD_OP_CLEAR 2
+// Set the display mode (LCD_MODE_XXX bits) to arg
+#define LCDD_OP_MODE  3
+
+typedef struct _LCDDHeader
+  {
+  BYTE op;
+  BYTE row;
+  BYTE col;
+  BYTE arg;
+  } LCDDHeader;
+
+typedef struct _LCDDConfig
+  {
+  const char *socket; // The socket to listen on
+  int socket_mode; // Its permissions, or 0 for LCDD_SOCKET_MODE
+  const char *shm_name; // Shared-memory framebuffer, or NULL for none
+  int shm_mode; // Its permissions, or 0 for LCDD_SHM_MODE
+  const char *stats_file; // Where the statistics go, or NULL for stderr
+  const char *trace_file; // Where the trace goes, or NULL for nowhere
+  int rate; // Flushes per second
+  } LCDDConfig;
+
+BEGIN_DECLS
+
+/** Run the daemon until it is sent SIGINT or SIGTERM, applying updates
+    from the socket to lcd, which must already have been initialized, and
+    flushing it rate times a second, if anything has changed. The socket
+    gets the permissions socket_mode, whatever the umask. A stale socket
+    left by a daemon that has died is replaced, but not one that a running
+    daemon is still listening on. If shm_name is not NULL, a shared-memory
+    framebuffer of that name is created as well, with the permissions
+    shm_mode (whatever the umask), and its changes are picked up at each
+    tick. If stats_file is not NULL, the statistics are written to it on
+    SIGUSR1, and when the daemon exits. If trace_file is not NULL, and the
+    display has tracing enabled, the trace is written to it on SIGUSR2.
+    Returns FALSE, and writes *error (which the caller should free) if the
+    socket or the shared memory can't be set up, or another daemon is
+    already running on the socket. */
+BOOL      lcdd_run (LCD8574 *lcd, const LCDDConfig *config, char **error);
+
+/** Send one update to the daemon listening at path. text can be NULL,
+    except for LCDD_OP_TEXT. Returns FALSE, and writes *error, if the
+    update can't be sent. */
+BOOL      lcdd_send (const char *path, int op, int row, int col, int arg,
+            const char *text, char **error);
+
+END_DECLS
+
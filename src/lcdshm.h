@@ -0,0 +1,125 @@
+/*============================================================================
+
+    lcdshm.h
+
+    The shared-memory framebuffer that the display daemon offers to
+    local producers, which are too busy to make a syscall for every
+    update. A producer maps the segment, and writes character cells
+    straight into it; the daemon picks up the changes at its next tick.
+
+    The segment holds the rows x cols cell array, a sequence counter,
+    and a bitmap for each row of the cells that have changed. The
+    counter is a seqlock: a producer makes it odd before changing any
+    cells, and even again afterwards, and the daemon copies the cells
+    again if the counter changed while it was copying them. So neither
+    side ever takes a lock, or waits for the other, and a producer's
+    update costs a few stores and two atomic increments.
+
+    There must only be one producer writing to the segment at a time,
+    because each writer's begin/end pair has to be seen on its own.
+
+    This file is all that a producer needs -- it doesn't have to link
+    with anything else in this program. For example:
+
+      LCDShm *fb = lcdshm_open (LCDSHM_NAME);
+      lcdshm_begin (fb);
+      lcdshm_put (fb, 0, 0, "T=21.5C", 7);
+      lcdshm_end (fb);
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The segment the daemon creates, unless told otherwise
+#define LCDSHM_NAME "/lcdd"
+
+// Written into the header, once the rest of it has been set up
+#define LCDSHM_MAGIC 0x4C434453
+
+// The largest display the segment can describe. Each row's dirty
+//  bitmap is one 64-bit word
+#define LCDSHM_ROWS_MAX 4
+#define LCDSHM_COLS_MAX 64
+
+typedef struct _LCDShm
+  {
+  atomic_uint magic;
+  int rows, cols;
+  atomic_uint seq; // Odd while a producer is writing
+  atomic_uint_least64_t dirty[LCDSHM_ROWS_MAX]; // Changed cells of each row
+  char cells[]; // rows x cols
+  } LCDShm;
+
+/** The size of the segment for a particular display */
+static inline size_t lcdshm_size (int rows, int cols)
+  {
+  return sizeof (LCDShm) + rows * cols;
+  }
+
+/** Map the segment that the daemon has created. Returns NULL if it
+    doesn't exist, or it isn't ready yet. */
+static inline LCDShm *lcdshm_open (const char *name)
+  {
+  int fd = shm_open (name, O_RDWR, 0);
+  if (fd < 0) return NULL;
+  struct stat sb;
+  LCDShm *fb = NULL;
+  if (fstat (fd, &sb) == 0 && sb.st_size >= (off_t)sizeof (LCDShm))
+    {
+    fb = mmap (NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fb == MAP_FAILED)
+      fb = NULL;
+    else if (atomic_load (&fb->magic) != LCDSHM_MAGIC
+        || (off_t)lcdshm_size (fb->rows, fb->cols) > sb.st_size)
+      {
+      munmap (fb, sb.st_size);
+      fb = NULL;
+      }
+    }
+  close (fd);
+  return fb;
+  }
+
+/** Unmap the segment */
+static inline void lcdshm_close (LCDShm *fb)
+  {
+  if (fb) munmap (fb, lcdshm_size (fb->rows, fb->cols));
+  }
+
+/** Start an update. Any number of _put() calls can follow, before
+    _end() */
+static inline void lcdshm_begin (LCDShm *fb)
+  {
+  atomic_fetch_add_explicit (&fb->seq, 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  }
+
+/** Write len characters at row, col, clipped to the end of the row.
+    This must come between _begin() and _end(). */
+static inline void lcdshm_put (LCDShm *fb, int row, int col,
+    const char *s, int len)
+  {
+  if (row < 0 || row >= fb->rows || col < 0 || col >= fb->cols) return;
+  if (len > fb->cols - col) len = fb->cols - col;
+  if (len <= 0) return;
+  memcpy (fb->cells + row * fb->cols + col, s, len);
+  uint64_t mask = (len >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << len) - 1)
+    << col;
+  atomic_fetch_or_explicit (&fb->dirty[row], mask, memory_order_relaxed);
+  }
+
+/** Finish an update */
+static inline void lcdshm_end (LCDShm *fb)
+  {
+  atomic_fetch_add_explicit (&fb->seq, 1, memory_order_release);
+  }
+
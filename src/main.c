@@ -1,26 +1,186 @@
 /*============================================================================
-  
+
     main.c
 
-    A test driver for the LCD8574 "class". It just displays the current
-    time and date on the LCD.
+    A test driver for the LCD8574 "class". By default, it just displays
+    the current time and date on the LCD. With -d, it runs as a daemon
+    that owns the LCD, and draws on it on behalf of other processes;
+    with -p or -c, it is a client of that daemon.
 
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
-#include "defs.h" 
-#include "lcd8574.h" 
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include "defs.h"
+#include "lcd8574.h"
+#include "lcdd.h"
+#include "lcdshm.h"
 
 #define I2C_ADDR 0x27
 #define ROWS 2
 #define COLS 16
+// Size of the daemon's trace ring, in PCF8574 bytes
+#define TRACE_ENTRIES 65536
+// Safety margin for -C, in percent
+#define CAL_MARGIN 20
+
+
+/*============================================================================
+
+  show_usage
 
+============================================================================*/
+static void show_usage (const char *argv0)
+  {
+  printf ("Usage: %s [options]                show the time and date\n",
+    argv0);
+  printf ("       %s -d [options]             run the display daemon\n",
+    argv0);
+  printf ("       %s -p row,col [options] text write text via the daemon\n",
+    argv0);
+  printf ("       %s -c [options]             clear via the daemon\n",
+    argv0);
+  printf ("  -A cpu     daemon: pin the LCD writer thread to a CPU\n");
+  printf ("  -C file    calibrate the LCD timing, and save it in file\n");
+  printf ("  -D dev     device: I2C bus, or gpio chip and lines, e.g.,\n");
+  printf ("             /dev/gpiochip0:rs,e,d4,d5,d6,d7 (/dev/i2c-1)\n");
+  printf ("  -F prio    daemon: run the LCD writer thread SCHED_FIFO, at "
+    "prio\n");
+  printf ("  -L         daemon: lock all memory into RAM\n");
+  printf ("  -m name    daemon shared-memory framebuffer, e.g., %s\n",
+    LCDSHM_NAME);
+  printf ("  -O rom     LCD character ROM, for UTF-8 text: a00 or a02 "
+    "(a00)\n");
+  printf ("  -P file    load the LCD timing from file\n");
+  printf ("  -R file    daemon trace file, written on SIGUSR2\n");
+  printf ("  -r rate    daemon frame rate, per second (%d)\n", LCDD_RATE);
+  printf ("  -s socket  daemon socket (%s)\n", LCDD_SOCKET);
+  printf ("  -S file    daemon statistics file, written on SIGUSR1\n");
+  printf ("  -T name    transport: i2c-dev, i2c-uring, mock, model, or gpio "
+    "(i2c-dev)\n");
+  printf ("  -W file    warm-start the LCD, saving its state in file\n");
+  }
+
+/*============================================================================
+
+  clock_arm
+
+  Set the timer to expire on every second boundary of the real-time 
+  clock, starting with the next one. The timer is absolute, so the 
+  ticks don't drift, however long each update takes. If the clock is
+  set, the timer is cancelled, so we can re-arm it. Returns FALSE, with
+  errno set, on failure.
+
+============================================================================*/
+static BOOL clock_arm (int fd)
+  {
+  struct itimerspec its;
+  clock_gettime (CLOCK_REALTIME, &its.it_value);
+  its.it_value.tv_sec++;
+  its.it_value.tv_nsec = 0;
+  its.it_interval.tv_sec = 1;
+  its.it_interval.tv_nsec = 0;
+  return timerfd_settime (fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, 
+    &its, NULL) == 0;
+  }
+
+/*============================================================================
+
+  run_clock
+
+  Show the time and date, updating on each second boundary. In between,
+  the process sleeps in read(), so there's one wakeup a second, and 
+  nothing else. Once a minute, we report how many wakeups there were, 
+  how many ticks were missed, and the bus bytes each tick cost.
+
+============================================================================*/
+static BOOL run_clock (LCD8574 *hc, char **error)
+  {
+  int fd = timerfd_create (CLOCK_REALTIME, TFD_CLOEXEC);
+  if (fd < 0 || !clock_arm (fd))
+    {
+    asprintf (error, "Can't set up the clock timer: %s", strerror (errno));
+    if (fd >= 0) close (fd);
+    return FALSE;
+    }
+  lcd8574_clear (hc);
+  int wakeups = 0, missed = 0;
+  LCD8574Stats st;
+  lcd8574_get_stats (hc, &st);
+  long long bytes = st.bytes;
+  int last_min = -1;
+  while (TRUE)
+    {
+    // Write the whole output into the shadow framebuffer. The flush
+    //  only sends the character cells that have changed since the
+    //  last update -- usually just one or two digits of the time.
+    char s[50];
+    time_t t = time (NULL);
+    struct tm *tm = localtime (&t);
+    sprintf (s, "%02d:%02d:%02d", tm->tm_hour, tm->tm_min, tm->tm_sec);
+    lcd8574_write_string_at (hc, 0, 0, (BYTE *)s, FALSE);
+    sprintf (s, "%04d/%02d/%02d", tm->tm_year + 1900, tm->tm_mon + 1,
+      tm->tm_mday);
+    lcd8574_write_string_at (hc, 1, 0, (BYTE *)s, FALSE);
+    lcd8574_flush (hc);
+
+    // Report when the minute changes, rather than at second 0, since
+    //  that tick might be the one that was missed
+    if (tm->tm_min != last_min && last_min >= 0 && wakeups > 0)
+      {
+      lcd8574_get_stats (hc, &st);
+      printf ("%02d:%02d wakeups/min %d, missed ticks %d, bytes/tick %.1f\n", 
+        tm->tm_hour, tm->tm_min, wakeups, missed, 
+        (double)(st.bytes - bytes) / wakeups);
+      fflush (stdout);
+      bytes = st.bytes;
+      wakeups = missed = 0;
+      }
+    last_min = tm->tm_min;
+
+    uint64_t expired;
+    while (read (fd, &expired, sizeof (expired)) != sizeof (expired))
+      {
+      // The clock was set, so the second boundaries have moved
+      if (errno == ECANCELED && clock_arm (fd)) continue;
+      if (errno == EINTR) continue;
+      asprintf (error, "Clock timer failed: %s", strerror (errno));
+      close (fd);
+      return FALSE;
+      }
+    wakeups++;
+    missed += expired - 1;
+    }
+  }
+
+/*============================================================================
+
+  run_client
+
+  Join the text arguments with spaces, and send them to the daemon
+
+============================================================================*/
+static BOOL run_client (const char *socket, int op, int row, int col,
+    int argc, char **argv, char **error)
+  {
+  char text[LCDD_MSG_MAX];
+  text[0] = 0;
+  for (int i = 0; i < argc; i++)
+    {
+    if (i > 0) strncat (text, " ", sizeof (text) - strlen (text) - 1);
+    strncat (text, argv[i], sizeof (text) - strlen (text) - 1);
+    }
+  return lcdd_send (socket, op, row, col, 0,
+    op == LCDD_OP_TEXT ? text : NULL, error);
+  }
 
 /*============================================================================
 
@@ -29,42 +189,148 @@
 ============================================================================*/
 int main (int argc, char **argv)
   {
-  argc = argc; argv = argv; // Suppress warnings
+  BOOL daemon = FALSE;
+  int op = 0, row = 0, col = 0;
+  int rate = LCDD_RATE;
+  const char *socket = LCDD_SOCKET;
+  const char *state_file = NULL;
+  const char *shm_name = NULL;
+  const char *transport = NULL;
+  const char *dev = NULL;
+  const char *cal_file = NULL;
+  const char *timing_file = NULL;
+  const char *stats_file = NULL;
+  const char *trace_file = NULL;
+  const char *rom = NULL;
+  int rt_priority = 0, rt_cpu = -1;
+  BOOL rt_lock = FALSE;
+  int opt;
+  while ((opt = getopt (argc, argv, "A:cC:dD:F:hLm:O:p:P:r:R:s:S:T:W:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'A': rt_cpu = atoi (optarg); break;
+      case 'c': op = LCDD_OP_CLEAR; break;
+      case 'C': cal_file = optarg; break;
+      case 'd': daemon = TRUE; break;
+      case 'D': dev = optarg; break;
+      case 'F': rt_priority = atoi (optarg); break;
+      case 'L': rt_lock = TRUE; break;
+      case 'm': shm_name = optarg; break;
+      case 'O': rom = optarg; break;
+      case 'p':
+        op = LCDD_OP_TEXT;
+        if (sscanf (optarg, "%d,%d", &row, &col) != 2)
+          {
+          fprintf (stderr, "%s: bad position: %s\n", argv[0], optarg);
+          return 1;
+          }
+        break;
+      case 'P': timing_file = optarg; break;
+      case 'r': rate = atoi (optarg); break;
+      case 'R': trace_file = optarg; break;
+      case 's': socket = optarg; break;
+      case 'S': stats_file = optarg; break;
+      case 'T': transport = optarg; break;
+      case 'W': state_file = optarg; break;
+      case 'h': show_usage (argv[0]); return 0;
+      default: show_usage (argv[0]); return 1;
+      }
+    }
 
-  // Set up the LCD8574 instance with the three GPIO pin numbers.
-  LCD8574 *hc = lcd8574_create (I2C_ADDR, ROWS, COLS);
   char *error = NULL;
+  if (op)
+    {
+    if (run_client (socket, op, row, col, argc - optind, argv + optind,
+          &error))
+      return 0;
+    fprintf (stderr, "%s: %s\n", argv[0], error);
+    free (error);
+    return 1;
+    }
+
+  // Set up the LCD8574 instance with the I2C address and geometry
+  LCD8574 *hc = dev ? lcd8574_create_dev (dev, I2C_ADDR, ROWS, COLS)
+    : lcd8574_create (I2C_ADDR, ROWS, COLS);
+  if (state_file) lcd8574_set_warm_init (hc, TRUE, state_file);
+  if (transport && !lcd8574_set_transport (hc, transport))
+    {
+    fprintf (stderr, "%s: unknown transport: %s\n", argv[0], transport);
+    lcd8574_destroy (hc);
+    return 1;
+    }
+  if (rom && !lcd8574_set_rom (hc, rom))
+    {
+    fprintf (stderr, "%s: unknown character ROM: %s\n", argv[0], rom);
+    lcd8574_destroy (hc);
+    return 1;
+    }
+  if (!lcd8574_set_realtime (hc, rt_priority, rt_cpu, rt_lock))
+    {
+    fprintf (stderr, "%s: bad priority or CPU\n", argv[0]);
+    lcd8574_destroy (hc);
+    return 1;
+    }
+  if (timing_file && !lcd8574_load_timing (hc, timing_file, &error))
+    {
+    fprintf (stderr, "%s: %s\n", argv[0], error);
+    free (error);
+    lcd8574_destroy (hc);
+    return 1;
+    }
+  if (daemon) lcd8574_enable_histograms (hc);
+  if (daemon && trace_file) lcd8574_enable_trace (hc, TRACE_ENTRIES);
+  int ret = 0;
   if (lcd8574_init (hc, &error))
     {
-    // Note that because the text we're writing is a fixed length,
-    //  there's no need to clear the display before refreshing it --
-    //  we just write the old text on top of the new. This causes
-    //  less flicker than a full refresh.
-    lcd8574_clear (hc);
-    while (TRUE)
+    if (cal_file)
+      {
+      if (!lcd8574_calibrate (hc, CAL_MARGIN, &error)
+          || !lcd8574_save_timing (hc, cal_file, &error))
+        {
+        fprintf (stderr, "%s: %s\n", argv[0], error);
+        free (error);
+        ret = 1;
+        }
+      }
+    else if (daemon)
       {
-      // Write the whole output. In a real appliation, we'd only write
-      //  the character cells that had changed between updates, to
-      //  save time and reduce flicker
-      char s[50];
-      time_t t = time (NULL);
-      struct tm *tm = localtime (&t);
-      sprintf (s, "%02d:%02d:%02d", tm->tm_hour, tm->tm_min, tm->tm_sec);
-      lcd8574_write_string_at (hc, 0, 0, (BYTE *)s, FALSE);
-      sprintf (s, "%04d/%02d/%02d", tm->tm_year + 1900, tm->tm_mon + 1, 
-        tm->tm_mday);
-      lcd8574_write_string_at (hc, 1, 0, (BYTE *)s, FALSE);
-      usleep (1000000);
+      // With a writer thread, a slow flush doesn't hold up the
+      //  daemon's socket. If we can't have one, we flush synchronously
+      //  -- unless it was asked to run in real time, since then the
+      //  timing matters
+      BOOL rt = rt_priority > 0 || rt_cpu >= 0 || rt_lock;
+      LCDDConfig config = { socket, 0, shm_name, 0, stats_file, 
+        trace_file, rate };
+      if (!lcd8574_start_async (hc, rt ? &error : NULL) && rt)
+        {
+        fprintf (stderr, "%s: %s\n", argv[0], error);
+        free (error);
+        ret = 1;
+        }
+      else if (!lcdd_run (hc, &config, &error))
+        {
+        fprintf (stderr, "%s: %s\n", argv[0], error);
+        free (error);
+        ret = 1;
+        }
+      }
+    else if (!run_clock (hc, &error))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      ret = 1;
       }
 
     lcd8574_uninit (hc);
-    lcd8574_destroy (hc);
     }
   else
     {
     fprintf (stderr, "%s: %s\n", argv[0], error);
     free (error);
+    ret = 1;
     }
+  lcd8574_destroy (hc);
+  return ret;
   }
 
-
@@ -0,0 +1,105 @@
+/*============================================================================
+
+  trace.c
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "defs.h"
+#include "trace.h"
+
+struct _Trace
+  {
+  TraceEntry *entries;
+  uint64_t mask; // The size of the ring, less one
+  atomic_uint_least64_t head; // Count of entries ever recorded
+  };
+
+/*============================================================================
+
+  trace_create
+
+============================================================================*/
+Trace *trace_create (int entries)
+  {
+  uint64_t size = 1;
+  while (size < (uint64_t)entries) size <<= 1;
+  Trace *self = malloc (sizeof (Trace));
+  self->entries = calloc (size, sizeof (TraceEntry));
+  self->mask = size - 1;
+  atomic_init (&self->head, 0);
+  return self;
+  }
+
+/*============================================================================
+
+  trace_destroy
+
+============================================================================*/
+void trace_destroy (Trace *self)
+  {
+  if (self)
+    {
+    free (self->entries);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  trace_record
+
+============================================================================*/
+void trace_record (Trace *self, uint32_t t_us, BYTE port, BYTE nibble,
+        BYTE flags)
+  {
+  uint64_t i = atomic_fetch_add_explicit (&self->head, 1, 
+    memory_order_relaxed);
+  TraceEntry *e = &self->entries[i & self->mask];
+  e->t_us = t_us;
+  e->port = port;
+  e->nibble = nibble;
+  e->flags = flags;
+  e->reserved = 0;
+  }
+
+/*============================================================================
+
+  trace_write
+
+============================================================================*/
+BOOL trace_write (const Trace *self, FILE *f, int rows, int cols, 
+        int i2c_addr)
+  {
+  uint64_t head = atomic_load_explicit (&self->head, memory_order_acquire);
+  uint64_t size = self->mask + 1;
+  uint64_t count = head < size ? head : size;
+  uint64_t start = head - count;
+
+  TraceHeader h;
+  memset (&h, 0, sizeof (TraceHeader));
+  memcpy (h.magic, TRACE_MAGIC, 4);
+  h.version = TRACE_VERSION;
+  h.count = count;
+  h.lost = start;
+  h.rows = rows;
+  h.cols = cols;
+  h.i2c_addr = i2c_addr;
+  if (fwrite (&h, sizeof (TraceHeader), 1, f) != 1) return FALSE;
+
+  // The ring might wrap around in the middle of the entries we want,
+  //  so write them in two pieces
+  uint64_t first = start & self->mask;
+  uint64_t n1 = size - first < count ? size - first : count;
+  if (fwrite (self->entries + first, sizeof (TraceEntry), n1, f) != n1)
+    return FALSE;
+  if (count > n1 && fwrite (self->entries, sizeof (TraceEntry), 
+        count - n1, f) != count - n1)
+    return FALSE;
+  return TRUE;
+  }
@@ -0,0 +1,89 @@
+/*============================================================================
+
+  trace.h
+
+  A fixed-size, in-memory ring buffer of every byte that the LCD8574
+  driver sends to (or reads from) the PCF8574, each with a timestamp, 
+  and the state of the RS, RW, and E lines already decoded. Recording
+  an entry is a few stores, with no allocation and no syscalls, so the
+  trace can be left on in production. When something goes wrong, the
+  ring can be written to a file in the binary format defined here, and
+  analysed offline by lcd8574-trace.
+
+  On a 40x4 module, both controllers record into the same ring; the
+  second controller's E line is recorded as TRACE_E2, rather than 
+  TRACE_E.
+
+  The timestamp is the time at which the transaction containing the
+  byte was started. The analysis tool works out when each byte was on
+  the bus from its position in the transaction, and the bus clock rate.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "defs.h"
+
+#define TRACE_MAGIC "LCDT"
+#define TRACE_VERSION 1
+
+// Entry flags
+#define TRACE_RS     0x01 // Register select was high
+#define TRACE_RW     0x02 // RW was high (read)
+#define TRACE_E      0x04 // E was high
+#define TRACE_READ   0x08 // The byte was read from the PCF8574, not written
+#define TRACE_MSG    0x10 // The first byte of an I2C message
+#define TRACE_XFER   0x20 // The first byte of a transaction
+#define TRACE_FAILED 0x40 // The transaction failed
+#define TRACE_E2     0x80 // E of the lower controller of a 40x4 was high
+
+typedef struct _TraceEntry
+  {
+  uint32_t t_us; // Low 32 bits of CLOCK_MONOTONIC, usec
+  uint8_t port; // The PCF8574 byte
+  uint8_t nibble; // The four data lines, decoded
+  uint8_t flags;
+  uint8_t reserved;
+  } TraceEntry;
+
+// The file starts with this header, followed by count entries, oldest
+//  first
+typedef struct _TraceHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t count; // Entries in the file
+  uint32_t lost; // Entries that were overwritten before the file was written
+  uint16_t rows, cols; // Display geometry
+  uint16_t i2c_addr;
+  uint16_t reserved;
+  } TraceHeader;
+
+struct _Trace;
+typedef struct _Trace Trace;
+
+BEGIN_DECLS
+
+/** Create a ring buffer with room for at least the specified number of
+    entries (rounded up to a power of two) */
+Trace    *trace_create (int entries);
+
+void      trace_destroy (Trace *self);
+
+/** Add an entry, overwriting the oldest if the ring is full. Entries
+    may be recorded from several threads at once. */
+void      trace_record (Trace *self, uint32_t t_us, BYTE port, BYTE nibble,
+            BYTE flags);
+
+/** Write the ring to f, with a header describing the display. If 
+    entries are being recorded while this happens, the newest ones
+    might be incomplete. Returns FALSE, with errno set, if the file
+    can't be written. */
+BOOL      trace_write (const Trace *self, FILE *f, int rows, int cols, 
+            int i2c_addr);
+
+END_DECLS
@@ -0,0 +1,1079 @@
+/*============================================================================
+
+    transport.c
+
+    The transports specified in transport.h: i2c-dev, i2c-uring, mock,
+    model, and gpio.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "defs.h"
+#include "gpiopin.h"
+#include "transport.h"
+
+// The most bytes the mock will remember between resets. After that,
+//  it just counts them
+#define TRANSPORT_RECORD_MAX 65536
+
+// The bus clock rate that the model works to (standard mode)
+#define TRANSPORT_MODEL_HZ 100000
+
+// Bus clocks for each byte, including the acknowledge bit
+#define TRANSPORT_BYTE_CLOCKS 9
+
+// Bus clocks for a start (or repeated start) and a stop condition
+#define TRANSPORT_START_STOP_CLOCKS 2
+
+typedef struct _I2CDev
+  {
+  int fd;
+  BOOL no_rdwr; // Set if the adapter refused an I2C_RDWR transaction
+  int slave; // The address last set using I2C_SLAVE, or -1
+  } I2CDev;
+
+// The PCF8574 outputs that the gpio transport understands. These are 
+//  the "standard" wiring; RW and the backlight are ignored. The driver
+//  won't use this transport with any other wiring
+#define TRANSPORT_PORT_RS 0
+#define TRANSPORT_PORT_E 2
+#define TRANSPORT_PORT_D4 4
+
+// The order of the lines in the gpio transport's device name, and in
+//  its GPIOPinGroup: RS, E, then the data lines from the lowest up
+#define TRANSPORT_LINE_RS 0
+#define TRANSPORT_LINE_E 1
+#define TRANSPORT_LINE_D 2
+
+// When the GPIO lines are set through mapped registers, rather than 
+//  ioctls, we have to provide the HD44780's timings ourselves (nsec):
+//  E must stay high or low for at least 450nsec, and RS and the data 
+//  must be settled 195nsec before E falls
+#define TRANSPORT_E_NS 500
+#define TRANSPORT_SETUP_NS 200
+
+// Function set, and its data-length bit
+#define TRANSPORT_CMD_FUNC 0x20
+#define TRANSPORT_FUNC_DL 0x10
+
+typedef struct _GPIOBus
+  {
+  GPIOPinGroup *pins;
+  BOOL bits8; // Set if all eight data lines are connected
+  BOOL mapped; // Set if the lines are set through the GPIO registers
+  long long hold_until; // When the lines may next change (nsec), if mapped
+  uint64_t lines; // What the lines are set to now
+  BOOL e; // The E output in the last PCF8574 byte
+  BOOL resync; // Set while the driver thinks the LCD is in 8-bit mode
+  BOOL have_hi; // Set if we have the first nibble of a byte
+  BYTE hi;
+  LCD8574BusCounts counts;
+  } GPIOBus;
+
+// The size of the io_uring shared by all the i2c-uring buses. That's
+//  enough for dozens of displays to have a write, and a timeout, in 
+//  flight at once
+#define TRANSPORT_RING_ENTRIES 1024
+
+// The most I2C addresses an i2c-uring bus can have displays at
+#define TRANSPORT_ADDR_MAX 16
+
+typedef struct _Ring
+  {
+  int fd; // -1 until set up
+  int users; // The number of i2c-uring buses that are open
+  pthread_mutex_t lock; // Held while the ring is in use
+  unsigned entries;
+  void *ring_mem; // The submission and completion rings, mapped together
+  size_t ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_tail, *sq_array;
+  unsigned sq_mask;
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  } Ring;
+
+static Ring ring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+typedef struct _URingBus
+  {
+  I2CDev i2c; // For single transactions, as i2c-dev
+  char *dev;
+  int addrs[TRANSPORT_ADDR_MAX]; // The addresses that have been probed
+  int addr_fd[TRANSPORT_ADDR_MAX]; // A descriptor set to each address
+  int naddrs;
+  } URingBus;
+
+typedef struct _Mock
+  {
+  BOOL model; // Set if we take as long as the bus would
+  LCD8574BusCounts counts;
+  BYTE record[TRANSPORT_RECORD_MAX];
+  int record_len;
+  } Mock;
+
+/*============================================================================
+
+  i2cdev_open
+
+============================================================================*/
+static void *i2cdev_open (const char *dev)
+  {
+  int fd = open (dev, O_RDWR);
+  if (fd < 0) return NULL;
+  I2CDev *self = malloc (sizeof (I2CDev));
+  self->fd = fd;
+  self->no_rdwr = FALSE;
+  self->slave = -1;
+  return self;
+  }
+
+/*============================================================================
+
+  i2cdev_close
+
+============================================================================*/
+static void i2cdev_close (void *handle)
+  {
+  I2CDev *self = handle;
+  close (self->fd);
+  free (self);
+  }
+
+/*============================================================================
+
+  i2cdev_probe
+
+  The i2c-dev driver can't really tell if there's a device at an
+  address without talking to it, but it does reject addresses that
+  are out of range, or claimed by a kernel driver.
+
+============================================================================*/
+static BOOL i2cdev_probe (void *handle, int addr)
+  {
+  I2CDev *self = handle;
+  BOOL ok = ioctl (self->fd, I2C_SLAVE, addr) >= 0;
+  self->slave = ok ? addr : -1;
+  return ok;
+  }
+
+/*============================================================================
+
+  i2cdev_xfer
+
+  Send the messages as one I2C_RDWR transaction. If the adapter can't
+  do combined transactions, fall back to a write() or read() for each
+  message; that's more syscalls, but the bytes are the same.
+
+============================================================================*/
+static BOOL i2cdev_xfer (void *handle, struct i2c_msg *msgs, int n)
+  {
+  I2CDev *self = handle;
+  BOOL ok = FALSE;
+  if (!self->no_rdwr)
+    {
+    struct i2c_rdwr_ioctl_data data = { msgs, n };
+    ok = ioctl (self->fd, I2C_RDWR, &data) >= 0;
+    if (!ok && (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL))
+      self->no_rdwr = TRUE;
+    }
+  if (self->no_rdwr)
+    {
+    ok = TRUE;
+    for (int i = 0; i < n && ok; i++)
+      {
+      if (self->slave != msgs[i].addr)
+        {
+        if (ioctl (self->fd, I2C_SLAVE, msgs[i].addr) < 0)
+          {
+          ok = FALSE;
+          break;
+          }
+        self->slave = msgs[i].addr;
+        }
+      if (msgs[i].flags & I2C_M_RD)
+        ok = read (self->fd, msgs[i].buf, msgs[i].len) == msgs[i].len;
+      else
+        ok = write (self->fd, msgs[i].buf, msgs[i].len) == msgs[i].len;
+      }
+    }
+  return ok;
+  }
+
+/*============================================================================
+
+  mock_open
+
+  The mock doesn't need a device, so dev is ignored
+
+============================================================================*/
+static void *mock_open (const char *dev)
+  {
+  (void)dev;
+  Mock *self = malloc (sizeof (Mock));
+  memset (self, 0, sizeof (Mock));
+  return self;
+  }
+
+/*============================================================================
+
+  model_open
+
+============================================================================*/
+static void *model_open (const char *dev)
+  {
+  Mock *self = mock_open (dev);
+  self->model = TRUE;
+  return self;
+  }
+
+/*============================================================================
+
+  mock_close
+
+============================================================================*/
+static void mock_close (void *handle)
+  {
+  free (handle);
+  }
+
+/*============================================================================
+
+  mock_probe
+
+  There's a device at every address
+
+============================================================================*/
+static BOOL mock_probe (void *handle, int addr)
+  {
+  (void)handle; (void)addr;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  transport_now_us
+
+  CLOCK_MONOTONIC, in usec, as the driver has it
+
+============================================================================*/
+static long long transport_now_us (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+
+  mock_xfer
+
+  Record the bytes written, and answer reads with zeros -- which looks
+  to the driver like an LCD module that is never busy. The model works
+  out how many bus clocks the transaction would take, and spins until
+  that time has passed. It has to spin, rather than sleep, because
+  most transactions take less time than the scheduler can sleep for
+  accurately.
+
+============================================================================*/
+static BOOL mock_xfer (void *handle, struct i2c_msg *msgs, int n)
+  {
+  Mock *self = handle;
+  long long clocks = 0;
+  for (int i = 0; i < n; i++)
+    {
+    if (msgs[i].flags & I2C_M_RD)
+      {
+      memset (msgs[i].buf, 0, msgs[i].len);
+      self->counts.reads += msgs[i].len;
+      }
+    else
+      {
+      int len = msgs[i].len;
+      if (len > TRANSPORT_RECORD_MAX - self->record_len)
+        len = TRANSPORT_RECORD_MAX - self->record_len;
+      memcpy (self->record + self->record_len, msgs[i].buf, len);
+      self->record_len += len;
+      self->counts.bytes += msgs[i].len;
+      }
+    clocks += TRANSPORT_BYTE_CLOCKS * (1 + msgs[i].len);
+    }
+  clocks += TRANSPORT_START_STOP_CLOCKS * n;
+  self->counts.xfers++;
+
+  if (self->model)
+    {
+    long long us = clocks * 1000000 / TRANSPORT_MODEL_HZ;
+    long long until = transport_now_us() + us;
+    while (transport_now_us() < until)
+      ;
+    self->counts.bus_us += us;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  mock_counts
+
+============================================================================*/
+static void mock_counts (void *handle, LCD8574BusCounts *counts)
+  {
+  Mock *self = handle;
+  *counts = self->counts;
+  }
+
+/*============================================================================
+
+  mock_record
+
+============================================================================*/
+static const BYTE *mock_record (void *handle, int *len)
+  {
+  Mock *self = handle;
+  *len = self->record_len;
+  return self->record;
+  }
+
+/*============================================================================
+
+  mock_reset
+
+============================================================================*/
+static void mock_reset (void *handle)
+  {
+  Mock *self = handle;
+  self->record_len = 0;
+  memset (&self->counts, 0, sizeof (LCD8574BusCounts));
+  }
+
+/*============================================================================
+
+  i2cdev_counts
+
+============================================================================*/
+static void i2cdev_counts (void *handle, LCD8574BusCounts *counts)
+  {
+  (void)handle;
+  memset (counts, 0, sizeof (LCD8574BusCounts));
+  }
+
+/*============================================================================
+
+  gpio_open
+
+  The device name is the GPIO chip, then the line numbers of RS, E, and
+  the data lines, lowest first -- four of them (D4-D7) in 4-bit mode, 
+  or eight (D0-D7) in 8-bit mode. For example:
+
+    /dev/gpiochip0:7,8,25,24,23,18
+
+  On a Raspberry Pi, the chip can be /dev/gpiomem, in which case the 
+  registers are written directly (see gpiopin.h), and the line numbers
+  are BCM GPIO numbers.
+
+  RW must be tied to 0V: the LCD module works at 5V, and could damage
+  GPIO inputs that aren't 5V-tolerant if it were allowed to drive them.
+
+============================================================================*/
+static void *gpio_open (const char *dev)
+  {
+  char chip[64];
+  const char *colon = strchr (dev, ':');
+  if (!colon || colon - dev >= (int)sizeof (chip))
+    {
+    errno = EINVAL;
+    return NULL;
+    }
+  memcpy (chip, dev, colon - dev);
+  chip[colon - dev] = 0;
+
+  int pins[TRANSPORT_LINE_D + 8];
+  int n = 0;
+  const char *p = colon + 1;
+  char *end;
+  while (n < TRANSPORT_LINE_D + 8)
+    {
+    pins[n++] = strtol (p, &end, 10);
+    if (end == p || (*end != ',' && *end != 0)) n = 0;
+    if (end == p || *end != ',') break;
+    p = end + 1;
+    }
+  if (*end != 0 || (n != TRANSPORT_LINE_D + 4 && n != TRANSPORT_LINE_D + 8))
+    {
+    errno = EINVAL;
+    return NULL;
+    }
+
+  GPIOPinGroup *pins_group = gpiopin_group_create (chip, pins, n);
+  if (!gpiopin_group_init (pins_group, NULL))
+    {
+    int e = errno;
+    gpiopin_group_destroy (pins_group);
+    errno = e;
+    return NULL;
+    }
+  GPIOBus *self = malloc (sizeof (GPIOBus));
+  memset (self, 0, sizeof (GPIOBus));
+  self->pins = pins_group;
+  self->bits8 = n == TRANSPORT_LINE_D + 8;
+  self->mapped = gpiopin_group_is_mapped (pins_group);
+  return self;
+  }
+
+/*============================================================================
+
+  gpio_close
+
+============================================================================*/
+static void gpio_close (void *handle)
+  {
+  GPIOBus *self = handle;
+  gpiopin_group_destroy (self->pins);
+  free (self);
+  }
+
+/*============================================================================
+
+  gpio_now_ns
+
+============================================================================*/
+static long long gpio_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  gpio_set
+
+  Set the lines, if any of them has changed, and hold them for at least
+  hold_ns. Each ioctl takes a microsecond or so, which is longer than 
+  any hold the HD44780 needs, so the holds only matter when the lines 
+  are set through the registers. Then the spin is a few hundred nsec, 
+  far too short to sleep for.
+
+============================================================================*/
+static void gpio_set (GPIOBus *self, uint64_t lines, int hold_ns)
+  {
+  uint64_t mask = lines ^ self->lines;
+  if (!mask) return;
+  if (self->mapped)
+    while (gpio_now_ns () < self->hold_until)
+      ;
+  gpiopin_group_set (self->pins, mask, lines);
+  if (self->mapped) self->hold_until = gpio_now_ns () + hold_ns;
+  self->lines = lines;
+  self->counts.xfers++;
+  }
+
+/*============================================================================
+
+  gpio_write
+
+  Put RS and the data on the lines with E unchanged, then change E. 
+  RS must be stable before E rises, and the data before E falls.
+
+============================================================================*/
+static void gpio_write (GPIOBus *self, BOOL rs, BYTE data, BOOL e)
+  {
+  uint64_t e_bit = 1 << TRANSPORT_LINE_E;
+  uint64_t lines = ((uint64_t)rs << TRANSPORT_LINE_RS) 
+    | ((uint64_t)data << TRANSPORT_LINE_D);
+  if (!e) gpio_set (self, self->lines & ~e_bit, TRANSPORT_E_NS);
+  gpio_set (self, lines | (self->lines & e_bit), TRANSPORT_SETUP_NS);
+  if (e) gpio_set (self, self->lines | e_bit, TRANSPORT_E_NS);
+  }
+
+/*============================================================================
+
+  gpio_clock_8
+
+  Send a byte in 8-bit mode: one pulse of E, rather than two
+
+============================================================================*/
+static void gpio_clock_8 (GPIOBus *self, BOOL rs, BYTE b)
+  {
+  gpio_write (self, rs, b, TRUE);
+  gpio_write (self, rs, b, FALSE);
+  }
+
+/*============================================================================
+
+  gpio_nibble_8
+
+  In 8-bit mode, the driver still sends 4-bit nibbles, so we pair them
+  up, and send each pair as one byte. But the driver also sets the LCD 
+  to 4-bit mode, and we have to stop that from happening. So, when the 
+  driver starts its resync -- a lone command nibble 0x3, which is never
+  the first half of a real command -- we send the resync's nibbles as
+  8-bit commands, but turn the final "set 4-bit mode" into another
+  "set 8-bit mode". After that, we set the data-length bit in every
+  function set.
+
+============================================================================*/
+static void gpio_nibble_8 (GPIOBus *self, BOOL rs, BYTE n)
+  {
+  BYTE resync = (TRANSPORT_CMD_FUNC | TRANSPORT_FUNC_DL) >> 4;
+  if (!rs && (self->resync || !self->have_hi) 
+      && (n == resync || (self->resync && n == TRANSPORT_CMD_FUNC >> 4)))
+    {
+    self->resync = n == resync;
+    self->have_hi = FALSE;
+    gpio_clock_8 (self, 0, resync << 4);
+    return;
+    }
+  self->resync = FALSE;
+  if (!self->have_hi)
+    {
+    self->hi = n;
+    self->have_hi = TRUE;
+    return;
+    }
+  self->have_hi = FALSE;
+  BYTE b = (self->hi << 4) | n;
+  if (!rs && (b & 0xE0) == TRANSPORT_CMD_FUNC) b |= TRANSPORT_FUNC_DL;
+  gpio_clock_8 (self, rs, b);
+  }
+
+/*============================================================================
+
+  gpio_xfer
+
+  Set the lines from each PCF8574 byte in turn. In 4-bit mode, that's
+  just a matter of copying RS, E, and D4-D7 onto the lines. In 8-bit 
+  mode, we wait for each falling edge of E, when the LCD would have 
+  latched a nibble, and let gpio_nibble_8() deal with it. 
+
+  There's no way to read the LCD module, so transactions with reads 
+  fail, without sending anything. The driver then falls back to timed
+  delays, and cold initialization.
+
+============================================================================*/
+static BOOL gpio_xfer (void *handle, struct i2c_msg *msgs, int n)
+  {
+  GPIOBus *self = handle;
+  for (int i = 0; i < n; i++)
+    {
+    if (msgs[i].flags & I2C_M_RD)
+      {
+      errno = EOPNOTSUPP;
+      return FALSE;
+      }
+    }
+  for (int i = 0; i < n; i++)
+    {
+    for (int j = 0; j < msgs[i].len; j++)
+      {
+      BYTE port = msgs[i].buf[j];
+      BOOL rs = (port >> TRANSPORT_PORT_RS) & 1;
+      BOOL e = (port >> TRANSPORT_PORT_E) & 1;
+      BYTE nibble = (port >> TRANSPORT_PORT_D4) & 0x0F;
+      if (!self->bits8)
+        gpio_write (self, rs, nibble, e);
+      else if (self->e && !e)
+        gpio_nibble_8 (self, rs, nibble);
+      self->e = e;
+      }
+    self->counts.bytes += msgs[i].len;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  gpio_counts
+
+  xfers counts ioctls, which is what matters for the GPIO transport --
+  or, with mapped registers, changes to the lines
+
+============================================================================*/
+static void gpio_counts (void *handle, LCD8574BusCounts *counts)
+  {
+  GPIOBus *self = handle;
+  *counts = self->counts;
+  }
+
+/*============================================================================
+
+  gpio_reset
+
+============================================================================*/
+static void gpio_reset (void *handle)
+  {
+  GPIOBus *self = handle;
+  memset (&self->counts, 0, sizeof (LCD8574BusCounts));
+  }
+
+/*============================================================================
+
+  ring_sqe
+
+  Get the next submission queue entry, cleared, with the link flag set.
+  The caller must make sure there's room. We're the only producer, and
+  the kernel only reads the tail, so the tail is only published when 
+  the batch is submitted (see ring_submit).
+
+============================================================================*/
+static struct io_uring_sqe *ring_sqe (unsigned *tail, __u64 user_data)
+  {
+  unsigned i = (*tail)++ & ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[i];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = user_data;
+  ring.sq_array[i] = i;
+  return sqe;
+  }
+
+/*============================================================================
+
+  ring_submit
+
+  Submit n entries, and wait for at least wait of them to complete. 
+  Returns FALSE if the kernel wouldn't take them.
+
+============================================================================*/
+static BOOL ring_submit (unsigned tail, unsigned n, unsigned wait)
+  {
+  __atomic_store_n (ring.sq_tail, tail, __ATOMIC_RELEASE);
+  unsigned to_submit = n, waiting = wait;
+  while (to_submit > 0 || waiting > 0)
+    {
+    int ret = syscall (__NR_io_uring_enter, ring.fd, to_submit, waiting,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) return FALSE;
+    to_submit -= ret;
+    unsigned head = *ring.cq_head;
+    unsigned ready = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE) - head;
+    waiting = ready >= wait ? 0 : wait - ready;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  ring_wait
+
+  Wait for at least n more completions than have been collected
+
+============================================================================*/
+static BOOL ring_wait (unsigned n)
+  {
+  return ring_submit (*ring.sq_tail, 0, n);
+  }
+
+/*============================================================================
+
+  ring_check_timeout
+
+  Find out whether the kernel supports IORING_TIMEOUT_ETIME_SUCCESS 
+  (Linux 5.16), which uring_run needs. There's no feature bit for it, 
+  so we submit a timeout that expires at once, with the flag set. A 
+  kernel that knows the flag completes it with -ETIME; an older one 
+  rejects it with -EINVAL.
+
+============================================================================*/
+static BOOL ring_check_timeout (void)
+  {
+  struct __kernel_timespec ts = { 0, 0 };
+  unsigned tail = *ring.sq_tail;
+  struct io_uring_sqe *sqe = ring_sqe (&tail, 0);
+  sqe->flags = 0;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (__u64)(uintptr_t)&ts;
+  sqe->len = 1;
+  sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+  if (!ring_submit (tail, 1, 1)) return FALSE;
+  unsigned head = *ring.cq_head;
+  int res = ring.cqes[head & ring.cq_mask].res;
+  __atomic_store_n (ring.cq_head, head + 1, __ATOMIC_RELEASE);
+  return res == -ETIME;
+  }
+
+/*============================================================================
+
+  ring_setup
+
+  Set up the io_uring that all i2c-uring buses share, if it isn't set
+  up already. We use the raw system calls, rather than liburing, which
+  isn't always installed. Returns FALSE, with errno set, if the kernel
+  won't give us a ring.
+
+============================================================================*/
+static BOOL ring_setup (void)
+  {
+  if (ring.users++ > 0) return TRUE;
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  ring.fd = syscall (__NR_io_uring_setup, TRANSPORT_RING_ENTRIES, &p);
+  if (ring.fd < 0)
+    {
+    ring.users = 0;
+    return FALSE;
+    }
+  // We map both rings with one mmap(), which needs Linux 5.4
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+    close (ring.fd);
+    ring.fd = -1;
+    ring.users = 0;
+    errno = ENOSYS;
+    return FALSE;
+    }
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  ring.ring_len = sq_len > cq_len ? sq_len : cq_len;
+  ring.ring_mem = mmap (NULL, ring.ring_len, PROT_READ | PROT_WRITE, 
+    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring.sqes = mmap (NULL, ring.sqes_len, PROT_READ | PROT_WRITE, 
+    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (ring.ring_mem == MAP_FAILED || ring.sqes == MAP_FAILED)
+    {
+    int e = errno;
+    if (ring.ring_mem != MAP_FAILED) munmap (ring.ring_mem, ring.ring_len);
+    if (ring.sqes != MAP_FAILED) munmap (ring.sqes, ring.sqes_len);
+    close (ring.fd);
+    ring.fd = -1;
+    ring.users = 0;
+    errno = e;
+    return FALSE;
+    }
+  char *m = ring.ring_mem;
+  ring.entries = p.sq_entries;
+  ring.sq_tail = (unsigned *)(m + p.sq_off.tail);
+  ring.sq_mask = *(unsigned *)(m + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(m + p.sq_off.array);
+  ring.cq_head = (unsigned *)(m + p.cq_off.head);
+  ring.cq_tail = (unsigned *)(m + p.cq_off.tail);
+  ring.cq_mask = *(unsigned *)(m + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(m + p.cq_off.cqes);
+  if (!ring_check_timeout ())
+    {
+    munmap (ring.sqes, ring.sqes_len);
+    munmap (ring.ring_mem, ring.ring_len);
+    close (ring.fd);
+    ring.fd = -1;
+    ring.users = 0;
+    errno = ENOSYS;
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  ring_teardown
+
+============================================================================*/
+static void ring_teardown (void)
+  {
+  if (--ring.users > 0) return;
+  munmap (ring.sqes, ring.sqes_len);
+  munmap (ring.ring_mem, ring.ring_len);
+  close (ring.fd);
+  ring.fd = -1;
+  }
+
+/*============================================================================
+
+  uring_open
+
+  Like i2cdev_open, but with a descriptor for each I2C address, as well
+  (see uring_probe), and a share of the ring
+
+============================================================================*/
+static void *uring_open (const char *dev)
+  {
+  pthread_mutex_lock (&ring.lock);
+  BOOL ok = ring_setup ();
+  pthread_mutex_unlock (&ring.lock);
+  if (!ok) return NULL;
+  int fd = open (dev, O_RDWR);
+  if (fd < 0) 
+    {
+    int e = errno;
+    pthread_mutex_lock (&ring.lock);
+    ring_teardown ();
+    pthread_mutex_unlock (&ring.lock);
+    errno = e;
+    return NULL;
+    }
+  URingBus *self = malloc (sizeof (URingBus));
+  memset (self, 0, sizeof (URingBus));
+  self->dev = strdup (dev);
+  self->i2c.fd = fd;
+  self->i2c.slave = -1;
+  return self;
+  }
+
+/*============================================================================
+
+  uring_close
+
+============================================================================*/
+static void uring_close (void *handle)
+  {
+  URingBus *self = handle;
+  for (int i = 0; i < self->naddrs; i++)
+    close (self->addr_fd[i]);
+  close (self->i2c.fd);
+  free (self->dev);
+  free (self);
+  pthread_mutex_lock (&ring.lock);
+  ring_teardown ();
+  pthread_mutex_unlock (&ring.lock);
+  }
+
+/*============================================================================
+
+  uring_probe
+
+  A plain write() to an i2c-dev descriptor goes to the address last 
+  set on it with I2C_SLAVE, so it's not possible to have writes to 
+  different addresses in flight on one descriptor. So each address 
+  gets a descriptor of its own.
+
+============================================================================*/
+static BOOL uring_probe (void *handle, int addr)
+  {
+  URingBus *self = handle;
+  if (!i2cdev_probe (&self->i2c, addr)) return FALSE;
+  for (int i = 0; i < self->naddrs; i++)
+    if (self->addrs[i] == addr) return TRUE;
+  if (self->naddrs >= TRANSPORT_ADDR_MAX) return FALSE;
+  int fd = open (self->dev, O_RDWR);
+  if (fd < 0) return FALSE;
+  if (ioctl (fd, I2C_SLAVE, addr) < 0)
+    {
+    close (fd);
+    return FALSE;
+    }
+  self->addrs[self->naddrs] = addr;
+  self->addr_fd[self->naddrs++] = fd;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  uring_xfer
+
+  Single transactions, including reads, are done just as i2c-dev does
+
+============================================================================*/
+static BOOL uring_xfer (void *handle, struct i2c_msg *msgs, int n)
+  {
+  URingBus *self = handle;
+  return i2cdev_xfer (&self->i2c, msgs, n);
+  }
+
+/*============================================================================
+
+  uring_addr_fd
+
+============================================================================*/
+static int uring_addr_fd (const URingBus *self, int addr)
+  {
+  for (int i = 0; i < self->naddrs; i++)
+    if (self->addrs[i] == addr) return self->addr_fd[i];
+  return -1;
+  }
+
+/*============================================================================
+
+  uring_run
+
+  Each job becomes a chain of linked entries: a write for each step,
+  and a timeout for each wait. A timeout normally "fails" when it 
+  expires, which would cancel the rest of the chain, so we use
+  IORING_TIMEOUT_ETIME_SUCCESS; then a chain only breaks if a write
+  fails. All the chains are submitted together, and the kernel runs
+  them side by side, so every bus is kept busy, and this thread just
+  waits for them all to finish.
+
+  The ring has a limited number of entries, so if they won't all fit,
+  we do it in rounds, dividing the ring equally between the jobs that
+  have steps left. Each round carries on where the last left off.
+
+  If a job wants to know when each step started, we collect the 
+  completions as they come, rather than all at once, and take the 
+  time at each. A step starts when whatever comes before it in its 
+  chain -- a timeout, or the previous write -- has completed, or when 
+  its round is submitted, if it comes first.
+
+============================================================================*/
+static void uring_run (TransportJob *jobs, int n)
+  {
+  pthread_mutex_lock (&ring.lock);
+  int next[n]; // The next step of each job
+  int delay[n]; // The wait due before it
+  BOOL failed[n];
+  struct __kernel_timespec ts[ring.entries];
+  BOOL timed = FALSE;
+  for (int j = 0; j < n; j++)
+    {
+    if (jobs[j].start_us) timed = TRUE;
+    jobs[j].done = 0;
+    next[j] = 0;
+    delay[j] = jobs[j].delay_us;
+    failed[j] = uring_addr_fd (jobs[j].handle, jobs[j].addr) < 0;
+    }
+
+  for (;;)
+    {
+    int active = 0;
+    for (int j = 0; j < n; j++)
+      if (!failed[j] && next[j] < jobs[j].nsteps) active++;
+    if (active == 0) break;
+    unsigned share = ring.entries / active;
+    if (share < 2) share = 2;
+
+    unsigned tail = *ring.sq_tail, count = 0, nts = 0;
+    long long now = timed ? transport_now_us () : 0;
+    for (int j = 0; j < n && count + share <= ring.entries; j++)
+      {
+      TransportJob *job = &jobs[j];
+      if (failed[j] || next[j] >= job->nsteps) continue;
+      int fd = uring_addr_fd (job->handle, job->addr);
+      struct io_uring_sqe *sqe = NULL;
+      unsigned used = 0;
+      while (next[j] < job->nsteps && used + 2 <= share)
+        {
+        // The entry's job, step, and whether it's the step's write, or
+        //  the timeout before it
+        __u64 id = ((__u64)j << 32) | ((__u64)next[j] << 1);
+        if (job->start_us && used == 0) job->start_us[next[j]] = now;
+        if (delay[j] > 0)
+          {
+          ts[nts].tv_sec = delay[j] / 1000000;
+          ts[nts].tv_nsec = (delay[j] % 1000000) * 1000;
+          sqe = ring_sqe (&tail, id);
+          sqe->opcode = IORING_OP_TIMEOUT;
+          sqe->addr = (__u64)(uintptr_t)&ts[nts++];
+          sqe->len = 1;
+          sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+          used++;
+          }
+        const TransportStep *step = &job->steps[next[j]];
+        sqe = ring_sqe (&tail, id | 1);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->off = (__u64)-1; // At the file position, as write() does
+        sqe->addr = (__u64)(uintptr_t)step->buf;
+        sqe->len = step->len;
+        used++;
+        delay[j] = step->wait_us;
+        next[j]++;
+        }
+      // The end of this job's chain
+      if (sqe) sqe->flags &= ~IOSQE_IO_LINK;
+      count += used;
+      }
+
+    if (!ring_submit (tail, count, timed ? 1 : count))
+      {
+      for (int j = 0; j < n; j++)
+        failed[j] = TRUE;
+      break;
+      }
+
+    unsigned reaped = 0;
+    for (;;)
+      {
+      if (timed) now = transport_now_us ();
+      unsigned head = *ring.cq_head;
+      unsigned cq_tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; head++, reaped++)
+        {
+        const struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+        TransportJob *job = &jobs[cqe->user_data >> 32];
+        int j = job - jobs;
+        int s = (cqe->user_data & 0xFFFFFFFF) >> 1;
+        if (!(cqe->user_data & 1))
+          {
+          if (cqe->res != -ETIME && cqe->res != 0) failed[j] = TRUE;
+          if (job->start_us) job->start_us[s] = now;
+          continue;
+          }
+        // If there's a timeout before the next step, this gets 
+        //  overwritten when that completes
+        if (job->start_us && s + 1 < job->nsteps) 
+          job->start_us[s + 1] = now;
+        if (!failed[j] && cqe->res == job->steps[job->done].len)
+          job->done++;
+        else
+          failed[j] = TRUE;
+        }
+      __atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+      if (reaped >= count || !ring_wait (1)) break;
+      }
+    if (reaped < count)
+      {
+      for (int j = 0; j < n; j++)
+        failed[j] = TRUE;
+      break;
+      }
+    }
+  pthread_mutex_unlock (&ring.lock);
+  }
+
+static const Transport transports[] =
+  {
+  { "i2c-dev", i2cdev_open, i2cdev_close, i2cdev_probe, i2cdev_xfer,
+      i2cdev_counts, NULL, NULL, TRANSPORT_I2C_GAP_US, NULL, FALSE },
+  { "i2c-uring", uring_open, uring_close, uring_probe, uring_xfer,
+      i2cdev_counts, NULL, NULL, TRANSPORT_I2C_GAP_US, uring_run, FALSE },
+  { "mock", mock_open, mock_close, mock_probe, mock_xfer,
+      mock_counts, mock_record, mock_reset, TRANSPORT_I2C_GAP_US, NULL, 
+      FALSE },
+  { "model", model_open, mock_close, mock_probe, mock_xfer,
+      mock_counts, mock_record, mock_reset, TRANSPORT_I2C_GAP_US, NULL,
+      FALSE },
+  { "gpio", gpio_open, gpio_close, mock_probe, gpio_xfer,
+      gpio_counts, NULL, gpio_reset, 0, NULL, TRUE },
+  { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, FALSE }
+  };
+
+/*============================================================================
+
+  transport_find
+
+============================================================================*/
+const Transport *transport_find (const char *name)
+  {
+  for (const Transport *t = transports; t->name; t++)
+    if (strcmp (t->name, name) == 0) return t;
+  return NULL;
+  }
+
+/*============================================================================
+
+  transport_default
+
+============================================================================*/
+const Transport *transport_default (void)
+  {
+  return &transports[0];
+  }
+
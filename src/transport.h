@@ -0,0 +1,109 @@
+/*============================================================================
+
+    transport.h
+
+    The interface between the LCD8574 driver and whatever carries its
+    I2C transactions. The usual transport is the kernel's i2c-dev
+    driver, but there is also a mock, which records what would have
+    been sent, and a model, which also takes as long as a real 100kHz
+    bus would. The mock and the model let the driver be tested and
+    measured without any hardware.
+
+    The "i2c-uring" transport is i2c-dev, but can also send the bytes
+    for many displays, on any number of buses, from one thread, using 
+    io_uring. Each display's writes are linked, with timeouts between 
+    them for the LCD module's execution time, so nothing sleeps.
+
+    The "gpio" transport has no I2C bus at all: the HD44780 is wired to
+    GPIO lines, which are set as if a PCF8574 in the standard wiring
+    were there. See transport.c for how those lines are specified.
+
+    This header is only for the driver itself -- applications select
+    a transport by name, using lcd8574_set_transport() or
+    lcd8574_bus_set_transport().
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#pragma once
+
+#include <linux/i2c.h>
+#include "defs.h"
+#include "lcd8574.h"
+
+// The time (usec) between the end of one LCD byte and the first clock
+//  edge of the next, when they are sent in the same I2C transaction. 
+//  The next byte has to get two PCF8574 bytes onto the bus before the
+//  LCD module latches anything. That's about 180usec at 100kHz, and 
+//  45usec at 400kHz. If an instruction takes no longer than this to 
+//  execute, the bus itself provides the delay, and no sleep is needed.
+#define TRANSPORT_I2C_GAP_US 45
+
+// One write in a batch (see Transport.run), and how long (usec) the 
+//  LCD module must be left alone after it
+typedef struct _TransportStep
+  {
+  const BYTE *buf;
+  int len;
+  int wait_us;
+  } TransportStep;
+
+// The writes for one display, in a batch
+typedef struct _TransportJob
+  {
+  void *handle; // The handle for the display's bus
+  int addr; // The display's I2C address
+  int delay_us; // How long to wait before the first write
+  const TransportStep *steps;
+  int nsteps;
+  int done; // Set by run() to the number of steps that succeeded
+  // If not NULL, run() sets the time (usec, CLOCK_MONOTONIC) that each 
+  //  step was started, at the cost of a system call per completion
+  long long *start_us; 
+  } TransportJob;
+
+typedef struct _Transport
+  {
+  const char *name;
+  // Open the device dev. Returns a handle that is passed to the other
+  //  functions, or NULL, with errno set
+  void *(*open) (const char *dev);
+  void (*close) (void *handle);
+  // Check that there is a device at the I2C address addr
+  BOOL (*probe) (void *handle, int addr);
+  // Carry out the transaction, returning FALSE if any part of it failed
+  BOOL (*xfer) (void *handle, struct i2c_msg *msgs, int n);
+  // Report the counts. For the i2c-dev transport, there aren't any
+  void (*counts) (void *handle, LCD8574BusCounts *counts);
+  // For the mock and the model, the bytes written since the last
+  //  reset, and the reset itself. NULL for i2c-dev
+  const BYTE *(*record) (void *handle, int *len);
+  void (*reset) (void *handle);
+  // The time (usec) the transport takes between one LCD byte and the
+  //  next, in the same transaction. Instructions that execute in less
+  //  time than this need no delay
+  int gap_us;
+  // Carry out the steps of a number of jobs, which can be for displays
+  //  on different buses, so long as they all use this transport. Each 
+  //  job's steps are done in order, with its waits between them, but 
+  //  the jobs are done concurrently. The last step's wait is left to 
+  //  the caller. Returns when every job has finished, or failed. NULL 
+  //  for transports that can only do one transaction at a time
+  void (*run) (TransportJob *jobs, int n);
+  // Set if the transport only understands the standard wiring, and 
+  //  ignores RW, so nothing can be read from the LCD module
+  BOOL standard_only;
+  } Transport;
+
+BEGIN_DECLS
+
+/** Find a transport by name: "i2c-dev", "i2c-uring", "mock", "model",
+    or "gpio". Returns
+    NULL if the name is not known. */
+const Transport *transport_find (const char *name);
+
+/** The transport used unless another one is selected */
+const Transport *transport_default (void);
+
+END_DECLS
+
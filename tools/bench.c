@@ -0,0 +1,254 @@
+/*============================================================================
+
+    bench.c
+
+    Measure the LCD8574 driver, using the "model" transport (or the
+    "mock" one, which takes no time on the bus), so no hardware is
+    needed. For each of a standard set of workloads, we draw and flush
+    a number of frames, and report how many updates a second we
+    managed, the bytes and transactions (syscalls, with i2c-dev) each
+    frame took, how long each frame spent sleeping while the LCD was
+    busy, and the median and 99th percentile flush latency.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "defs.h"
+#include "lcd8574.h"
+
+#define BENCH_FRAMES 200
+#define BENCH_ROWS 2
+#define BENCH_COLS 16
+#define BENCH_ADDR 0x27
+
+typedef struct _Workload
+  {
+  const char *name;
+  void (*setup) (LCD8574 *lcd);
+  void (*draw) (LCD8574 *lcd, int frame);
+  } Workload;
+
+/*============================================================================
+
+  now_us
+
+============================================================================*/
+static long long now_us (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+
+  full_draw
+
+  Change every cell, every frame
+
+============================================================================*/
+static void full_draw (LCD8574 *lcd, int frame)
+  {
+  int rows = lcd8574_get_rows (lcd), cols = lcd8574_get_cols (lcd);
+  for (int r = 0; r < rows; r++)
+    for (int c = 0; c < cols; c++)
+      lcd8574_write_char_at (lcd, r, c, 'A' + (frame + r * cols + c) % 26);
+  }
+
+/*============================================================================
+
+  clock_draw
+
+  A clock, ticking once a frame, with the date underneath. Most frames
+  change one digit
+
+============================================================================*/
+static void clock_draw (LCD8574 *lcd, int frame)
+  {
+  char s[32];
+  int t = 12 * 3600 + frame;
+  sprintf (s, "%02d:%02d:%02d", (t / 3600) % 24, (t / 60) % 60, t % 60);
+  lcd8574_write_string_at (lcd, 0, 0, (BYTE *)s, FALSE);
+  lcd8574_write_string_at (lcd, 1, 0, (BYTE *)"2020/06/01", FALSE);
+  }
+
+/*============================================================================
+
+  marquee_setup, marquee_draw
+
+============================================================================*/
+static void marquee_setup (LCD8574 *lcd)
+  {
+  lcd8574_write_string_at (lcd, 1, 0, (BYTE *)"Now playing:", FALSE);
+  lcd8574_marquee_start (lcd, 0,
+    (BYTE *)"The quick brown fox jumps over the lazy dog. ");
+  }
+
+static void marquee_draw (LCD8574 *lcd, int frame)
+  {
+  (void)frame;
+  lcd8574_marquee_step (lcd);
+  }
+
+/*============================================================================
+
+  bar_draw
+
+  A bar graph, sweeping up and down, in five steps per cell, using
+  custom glyphs for the partly-filled cell at the end of the bar
+
+============================================================================*/
+static void bar_draw (LCD8574 *lcd, int frame)
+  {
+  int cols = lcd8574_get_cols (lcd);
+  int steps = cols * 5;
+  int v = frame % (2 * steps);
+  if (v > steps) v = 2 * steps - v;
+
+  char s[32];
+  sprintf (s, "Level %3d%%", v * 100 / steps);
+  lcd8574_write_string_at (lcd, 0, 0, (BYTE *)s, FALSE);
+  for (int c = 0; c < cols; c++)
+    {
+    int fill = v - c * 5;
+    if (fill >= 5)
+      lcd8574_write_char_at (lcd, 1, c, 0xFF);
+    else if (fill <= 0)
+      lcd8574_write_char_at (lcd, 1, c, ' ');
+    else
+      {
+      BYTE bitmap[8];
+      memset (bitmap, (0x1F << (5 - fill)) & 0x1F, 8);
+      lcd8574_write_char_at (lcd, 1, c, lcd8574_glyph (lcd, bitmap));
+      }
+    }
+  }
+
+static const Workload workloads[] =
+  {
+  { "full redraw", NULL, full_draw },
+  { "clock tick", NULL, clock_draw },
+  { "marquee", marquee_setup, marquee_draw },
+  { "bar graph", NULL, bar_draw },
+  { NULL, NULL, NULL }
+  };
+
+/*============================================================================
+
+  compare_ll
+
+============================================================================*/
+static int compare_ll (const void *a, const void *b)
+  {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+  }
+
+/*============================================================================
+
+  run_workload
+
+============================================================================*/
+static BOOL run_workload (const Workload *w, const char *transport,
+    int rows, int cols, int frames)
+  {
+  LCD8574Bus *bus = lcd8574_bus_create (transport);
+  if (!lcd8574_bus_set_transport (bus, transport))
+    {
+    fprintf (stderr, "bench: unknown transport: %s\n", transport);
+    lcd8574_bus_destroy (bus);
+    return FALSE;
+    }
+  LCD8574 *lcd = lcd8574_create_dev (transport, BENCH_ADDR, rows, cols);
+  lcd8574_set_bus (lcd, bus);
+  char *error = NULL;
+  if (!lcd8574_init (lcd, &error))
+    {
+    fprintf (stderr, "bench: %s\n", error);
+    free (error);
+    lcd8574_destroy (lcd);
+    lcd8574_bus_destroy (bus);
+    return FALSE;
+    }
+  if (w->setup) w->setup (lcd);
+  lcd8574_flush (lcd);
+  lcd8574_bus_reset_counts (bus);
+  lcd8574_reset_stats (lcd);
+
+  long long *lat = malloc (frames * sizeof (long long));
+  long long start = now_us();
+  for (int i = 0; i < frames; i++)
+    {
+    long long t = now_us();
+    w->draw (lcd, i);
+    lcd8574_flush (lcd);
+    lat[i] = now_us() - t;
+    }
+  long long total = now_us() - start;
+
+  LCD8574BusCounts counts;
+  lcd8574_bus_get_counts (bus, &counts);
+  LCD8574Stats stats;
+  lcd8574_get_stats (lcd, &stats);
+  qsort (lat, frames, sizeof (long long), compare_ll);
+  int p99 = frames * 99 / 100;
+  if (p99 >= frames) p99 = frames - 1;
+  printf ("%-12s %10.0f %12.1f %15.2f %9.0f %9lld %9lld\n", w->name,
+    total > 0 ? frames * 1e6 / total : 0.0,
+    (double)counts.bytes / frames, (double)counts.xfers / frames,
+    (double)stats.sleep_us / frames, lat[frames / 2], lat[p99]);
+
+  free (lat);
+  lcd8574_uninit (lcd);
+  lcd8574_destroy (lcd);
+  lcd8574_bus_destroy (bus);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  main
+
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  const char *transport = "model";
+  int frames = BENCH_FRAMES;
+  int rows = BENCH_ROWS, cols = BENCH_COLS;
+  int opt;
+  while ((opt = getopt (argc, argv, "g:hn:t:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'g':
+        if (sscanf (optarg, "%dx%d", &rows, &cols) != 2) rows = 0;
+        break;
+      case 'n': frames = atoi (optarg); break;
+      case 't': transport = optarg; break;
+      default:
+        printf ("Usage: %s [-t mock|model] [-n frames] [-g rowsxcols]\n",
+          argv[0]);
+        return opt == 'h' ? 0 : 1;
+      }
+    }
+  if (rows <= 0 || cols <= 0 || frames <= 0)
+    {
+    fprintf (stderr, "%s: bad geometry or frame count\n", argv[0]);
+    return 1;
+    }
+
+  printf ("transport %s, %dx%d, %d frames\n", transport, rows, cols,
+    frames);
+  printf ("%-12s %10s %12s %15s %9s %9s %9s\n", "workload", "updates/s",
+    "bytes/frame", "syscalls/frame", "sleep us", "p50 us", "p99 us");
+  for (const Workload *w = workloads; w->name; w++)
+    if (!run_workload (w, transport, rows, cols, frames)) return 1;
+  return 0;
+  }
+
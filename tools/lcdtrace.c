@@ -0,0 +1,389 @@
+/*============================================================================
+
+    lcdtrace.c
+
+    Analyse a trace written by lcd8574_write_trace(). We replay the
+    PCF8574 bytes through a model of the HD44780 -- clocking a nibble on
+    each falling edge of E, pairing nibbles in 4-bit mode, and executing
+    the instructions -- to rebuild what the module's DDRAM and CGRAM
+    should contain. Along the way, we check that each instruction
+    arrived after the previous one had had time to execute, according
+    to the datasheet, and report any that didn't.
+
+    The trace only records when each transaction started, so the time
+    of each byte is worked out from its position in the transaction,
+    and the bus clock rate (-k, in kHz).
+
+    A 40x4 module has two controllers, on two E lines, which the trace
+    records as TRACE_E and TRACE_E2. Each controller gets a model of 
+    its own, and shows half the rows.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "defs.h"
+#include "trace.h"
+
+// Datasheet execution times (usec), for a 270kHz oscillator
+#define T_CLEAR_US 1520
+#define T_EXEC_US 37
+#define T_DATA_US 41
+// After the first and second 8-bit function sets of the resync
+#define T_RESYNC1_US 4100
+#define T_RESYNC2_US 100
+
+#define BUS_KHZ 100
+#define BYTE_CLOCKS 9
+
+typedef struct _Sim
+  {
+  BOOL verbose;
+  BOOL bits8; // Set if the module is in 8-bit mode
+  BOOL have_hi; // Set if we have the first nibble of a byte
+  BYTE hi;
+  long long first_t; // When the first nibble of the byte was clocked
+  BYTE ddram[128];
+  BYTE cgram[64];
+  int ac;
+  BOOL ac_cgram; // Set if the address counter points into CGRAM
+  BOOL two_line;
+  int shift;
+  int mode;
+  int resyncs; // 8-bit function sets since the last 4-bit one
+  long long busy_until; // When the last instruction will have finished
+  long long instructions, data, reads, violations;
+  } Sim;
+
+/*============================================================================
+
+  sim_next_addr
+
+============================================================================*/
+static int sim_next_addr (const Sim *s, int ac)
+  {
+  if (s->two_line)
+    {
+    if (ac == 0x27) return 0x40;
+    if (ac == 0x67) return 0x00;
+    return (ac + 1) & 0x7F;
+    }
+  return ac >= 0x4F ? 0 : ac + 1;
+  }
+
+/*============================================================================
+
+  sim_name
+
+  A name for an instruction, for reports
+
+============================================================================*/
+static const char *sim_name (BYTE b, BOOL rs, BOOL rw)
+  {
+  if (rw) return rs ? "read data" : "read busy flag";
+  if (rs) return "write data";
+  if (b & 0x80) return "set DDRAM address";
+  if (b & 0x40) return "set CGRAM address";
+  if (b & 0x20) return "function set";
+  if (b & 0x10) return "cursor/display shift";
+  if (b & 0x08) return "display control";
+  if (b & 0x04) return "entry mode";
+  if (b & 0x02) return "home";
+  if (b & 0x01) return "clear";
+  return "(nothing)";
+  }
+
+/*============================================================================
+
+  sim_execute
+
+  Execute one complete byte, whose first nibble was clocked at
+  start, and whose last was clocked at t. Instructions can only be
+  accepted when the module isn't busy, except for busy-flag reads.
+
+============================================================================*/
+static void sim_execute (Sim *s, BYTE b, BOOL rs, BOOL rw, long long start,
+    long long t)
+  {
+  if (s->verbose)
+    printf ("%12lld  %s %s 0x%02X\n", t, s->bits8 ? "8" : "4",
+      sim_name (b, rs, rw), b);
+
+  if (rw && !rs)
+    {
+    s->reads++;
+    return;
+    }
+
+  if (start < s->busy_until)
+    {
+    s->violations++;
+    printf ("%12lld  %s 0x%02X arrived %lld usec early\n", start,
+      sim_name (b, rs, rw), b, s->busy_until - start);
+    }
+
+  int exec = T_EXEC_US;
+  if (rw)
+    {
+    s->reads++;
+    exec = T_DATA_US;
+    if (s->ac_cgram) s->ac = (s->ac + 1) & 0x3F;
+    else s->ac = sim_next_addr (s, s->ac);
+    }
+  else if (rs)
+    {
+    s->data++;
+    exec = T_DATA_US;
+    if (s->ac_cgram)
+      {
+      s->cgram[s->ac & 0x3F] = b;
+      s->ac = (s->ac + 1) & 0x3F;
+      }
+    else
+      {
+      s->ddram[s->ac & 0x7F] = b;
+      s->ac = sim_next_addr (s, s->ac);
+      }
+    }
+  else
+    {
+    s->instructions++;
+    if (b & 0x80)
+      {
+      s->ac = b & 0x7F;
+      s->ac_cgram = FALSE;
+      }
+    else if (b & 0x40)
+      {
+      s->ac = b & 0x3F;
+      s->ac_cgram = TRUE;
+      }
+    else if (b & 0x20)
+      {
+      s->bits8 = (b & 0x10) != 0;
+      s->have_hi = FALSE;
+      s->two_line = (b & 0x08) != 0;
+      if (s->bits8)
+        {
+        s->resyncs++;
+        if (s->resyncs == 1) exec = T_RESYNC1_US;
+        else if (s->resyncs == 2) exec = T_RESYNC2_US;
+        }
+      else
+        s->resyncs = 0;
+      }
+    else if (b & 0x10)
+      {
+      int dir = (b & 0x04) ? -1 : 1; // Right, or left
+      if (b & 0x08)
+        s->shift = (s->shift + dir + 40) % 40;
+      else
+        s->ac = (s->ac - dir) & 0x7F;
+      }
+    else if (b & 0x08)
+      s->mode = b & 0x07;
+    else if (b & 0x02)
+      {
+      s->ac = 0;
+      s->ac_cgram = FALSE;
+      s->shift = 0;
+      exec = T_CLEAR_US;
+      }
+    else if (b & 0x01)
+      {
+      memset (s->ddram, ' ', sizeof (s->ddram));
+      s->ac = 0;
+      s->ac_cgram = FALSE;
+      s->shift = 0;
+      exec = T_CLEAR_US;
+      }
+    }
+  s->busy_until = t + exec;
+  }
+
+/*============================================================================
+
+  sim_clock
+
+  A falling edge of E. In 8-bit mode, the four data lines that aren't
+  connected read as zero.
+
+============================================================================*/
+static void sim_clock (Sim *s, BYTE nibble, BOOL rs, BOOL rw, long long t)
+  {
+  if (s->bits8)
+    {
+    sim_execute (s, nibble << 4, rs, rw, t, t);
+    return;
+    }
+  if (!s->have_hi)
+    {
+    s->have_hi = TRUE;
+    s->hi = nibble;
+    s->first_t = t;
+    return;
+    }
+  s->have_hi = FALSE;
+  sim_execute (s, (s->hi << 4) | nibble, rs, rw, s->first_t, t);
+  }
+
+/*============================================================================
+
+  show_display
+
+  Print what the display should be showing. Custom characters are
+  shown as digits 0-7.
+
+============================================================================*/
+static void show_display (const Sim *s, int rows, int cols)
+  {
+  printf ("display (shift %d, mode 0x%X):\n", s->shift, s->mode);
+  for (int r = 0; r < rows; r++)
+    {
+    putchar ('|');
+    for (int c = 0; c < cols; c++)
+      {
+      int base = (r & 1) * 0x40;
+      int off = (r >> 1) * cols + c;
+      int addr = s->two_line ? base + (off + s->shift) % 40 : off;
+      BYTE ch = s->ddram[addr & 0x7F];
+      if (ch < 16) putchar ('0' + (ch & 7));
+      else if (ch < 32 || ch > 126) putchar ('?');
+      else putchar (ch);
+      }
+    printf ("|\n");
+    }
+  }
+
+/*============================================================================
+
+  show_report
+
+  Print what one controller's model found
+
+============================================================================*/
+static void show_report (const Sim *s, const char *name, int rows, int cols,
+    int khz)
+  {
+  printf ("%s%lld instructions, %lld data bytes, %lld reads\n", name, 
+    s->instructions, s->data, s->reads);
+  printf ("%s%lld timing violations (datasheet, %d kHz bus)\n",
+    name, s->violations, khz);
+  if (s->have_hi)
+    printf ("%strace ends half-way through a byte\n", name);
+  show_display (s, rows, cols);
+  }
+
+/*============================================================================
+
+  main
+
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  // One model for each controller: the second is only used by 40x4s
+  Sim sims[2];
+  memset (sims, 0, sizeof (sims));
+  for (int i = 0; i < 2; i++)
+    memset (sims[i].ddram, ' ', sizeof (sims[i].ddram));
+  int khz = BUS_KHZ;
+  int opt;
+  while ((opt = getopt (argc, argv, "hk:v")) != -1)
+    {
+    switch (opt)
+      {
+      case 'k': khz = atoi (optarg); break;
+      case 'v': sims[0].verbose = sims[1].verbose = TRUE; break;
+      default:
+        printf ("Usage: %s [-v] [-k bus_khz] trace_file\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+      }
+    }
+  if (optind >= argc || khz <= 0)
+    {
+    fprintf (stderr, "Usage: %s [-v] [-k bus_khz] trace_file\n", argv[0]);
+    return 1;
+    }
+
+  FILE *f = fopen (argv[optind], "r");
+  if (!f)
+    {
+    perror (argv[optind]);
+    return 1;
+    }
+  TraceHeader h;
+  if (fread (&h, sizeof (TraceHeader), 1, f) != 1
+      || memcmp (h.magic, TRACE_MAGIC, 4) != 0 || h.version != TRACE_VERSION)
+    {
+    fprintf (stderr, "%s: not a trace file\n", argv[optind]);
+    fclose (f);
+    return 1;
+    }
+  printf ("%u entries, %u lost, display 0x%02X %ux%u\n", h.count, h.lost,
+    h.i2c_addr, h.rows, h.cols);
+  if (h.lost)
+    printf ("trace starts mid-stream: DDRAM contents before it are unknown\n");
+
+  // The module is assumed to start in 4-bit mode, and in step. If the
+  //  trace starts with the driver's resync, that works whether the
+  //  module was in 4-bit mode or not
+  long long byte_us = BYTE_CLOCKS * 1000 / khz;
+  long long base = 0, t = 0;
+  uint32_t last_raw = 0;
+  int pos = 0;
+  BOOL e[2] = { FALSE, FALSE }, first = TRUE, dual = FALSE;
+  long long failed = 0;
+  BYTE read_nibble = 0;
+  TraceEntry en;
+  for (uint32_t i = 0; i < h.count; i++)
+    {
+    if (fread (&en, sizeof (TraceEntry), 1, f) != 1) break;
+    if (en.flags & TRACE_XFER)
+      {
+      // Timestamps are the low 32 bits of a usec clock, so we track
+      //  the differences, which handles wrap-around
+      base = first ? 0 : base + (uint32_t)(en.t_us - last_raw);
+      last_raw = en.t_us;
+      first = FALSE;
+      pos = 0;
+      if (en.flags & TRACE_FAILED) failed++;
+      }
+    if (en.flags & TRACE_MSG) pos++; // The address byte
+    pos++;
+    t = base + pos * byte_us;
+
+    if (en.flags & TRACE_READ)
+      {
+      read_nibble = en.nibble;
+      continue;
+      }
+    if (en.flags & TRACE_E2) dual = TRUE;
+    for (int c = 0; c < 2; c++)
+      {
+      BOOL now_e = (en.flags & (c ? TRACE_E2 : TRACE_E)) != 0;
+      if (e[c] && !now_e)
+        {
+        BOOL rw = (en.flags & TRACE_RW) != 0;
+        sim_clock (&sims[c], rw ? read_nibble : en.nibble,
+          (en.flags & TRACE_RS) != 0, rw, t);
+        }
+      e[c] = now_e;
+      }
+    }
+  fclose (f);
+
+  printf ("%lld failed transactions\n", failed);
+  if (!dual)
+    {
+    show_report (&sims[0], "", h.rows, h.cols, khz);
+    return sims[0].violations ? 2 : 0;
+    }
+  int upper = h.rows > 2 ? 2 : h.rows;
+  show_report (&sims[0], "upper: ", upper, h.cols, khz);
+  show_report (&sims[1], "lower: ", h.rows - upper, h.cols, khz);
+  return sims[0].violations || sims[1].violations ? 2 : 0;
+  }